@@ -0,0 +1,430 @@
+/*
+ *  fgbench.c
+ *    Throughput and latency benchmark. Starts a server and a number of
+ *    clients in this process, each client sending to the next one through
+ *    the server, and prints one JSON object per run on stdout.
+ *
+ *    Usage: fgbench [options]
+ *
+ *      -c, --clients N     clients taking part (default 4, at most 120
+ *                          since user ids are an int8_t)
+ *      -m, --events M      events sent per run (default 100000)
+ *      -p, --busy-poll U   let the events threads spin for U usec before
+ *                          blocking (default 0, always block)
+ *      -s, --sizes LIST    comma separated payload sizes in bytes, one run
+ *                          each (default 0,64,1024,16384)
+ *      -t, --transport T   unix, inet or both (default both)
+ *      -u, --io-uring      move the bytes with io_uring instead of libevent
+ *      -w, --window W      events in flight at most (default 256)
+ *
+ *    Rates are taken over the whole run, mb_per_sec counts payload bytes and
+ *    wire_mb_per_sec every byte the server read. Latencies are end-to-end,
+ *    from fg_send_event until the receiving callback, including the time
+ *    spent waiting in the window. io_uring_enters_per_event sums the
+ *    io_uring_enter calls of the server and every client, the reads and
+ *    writes done by the ring do not show in the system call counts.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <semaphore.h>
+
+#include "fgevents.h"
+
+#define BENCH_ID        0x42
+#define SERVER_ID       1
+#define FIRST_CLIENT_ID 2
+#define MAX_CLIENTS     120
+#define SOCK_PATH       "/tmp/fgbench.sock"
+
+/* Give up on a run when no event arrives for this long */
+#define STALL_TIMEOUT_SEC 10
+
+enum transport {
+    TRANSPORT_UNIX = 1 << 0,
+    TRANSPORT_INET = 1 << 1
+};
+
+struct bench_opts {
+    int    clients;
+    long   events;
+    int    transports;
+    int    window;
+    long   busy_poll;    /* spin budget of the events threads in usec */
+    bool   io_uring;
+    char   *sizes;
+};
+
+struct bench_run {
+    long     received;
+    sem_t    credits;    /* free slots in the window */
+    sem_t    done;
+};
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr, "Usage: %s [-c clients] [-m events] "
+                     "[-p busy-poll-usec] [-s sizes] [-t unix|inet|both] "
+                     "[-u] [-w window]\n", prog);
+}
+
+static uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Read and write system calls made by the whole process so far, the
+   server and the clients alike */
+static void
+io_syscalls (long *reads, long *writes)
+{
+    char line[64];
+    FILE *fp = fopen ("/proc/self/io", "r");
+
+    *reads = *writes = 0;
+    if (fp == NULL)
+        return;
+    while (fgets (line, sizeof (line), fp) != NULL)
+      {
+        sscanf (line, "syscr: %ld", reads);
+        sscanf (line, "syscw: %ld", writes);
+      }
+    fclose (fp);
+}
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+client_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct bench_run *run = arg;
+
+    if (fgev == NULL || fgev->id != BENCH_ID)
+        return 0;
+
+    __atomic_fetch_add (&run->received, 1, __ATOMIC_RELAXED);
+    sem_post (&run->credits);
+    sem_post (&run->done);
+
+    return 0;
+}
+
+static int
+wait_sem (sem_t *sem)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += STALL_TIMEOUT_SEC;
+    while (sem_timedwait (sem, &ts) < 0)
+      {
+        if (errno != EINTR)
+            return -1;
+      }
+
+    return 0;
+}
+
+/* Sum the end-to-end latencies seen by every client into one histogram */
+static void
+merge_latency (struct fg_events_data *clients, int n, struct fg_hist *total,
+               struct fg_hist *hist)
+{
+    memset (total, 0, sizeof (struct fg_hist));
+    for (int i = 0; i < n; i++)
+      {
+        fg_events_get_latency_hist (&clients[i], FG_LATENCY_END_TO_END, hist);
+        if (hist->count == 0)
+            continue;
+        if (total->count == 0 || hist->min < total->min)
+            total->min = hist->min;
+        if (hist->max > total->max)
+            total->max = hist->max;
+        total->count += hist->count;
+        total->sum += hist->sum;
+        for (int b = 0; b < FG_HIST_BUCKETS; b++)
+            total->buckets[b] += hist->buckets[b];
+      }
+}
+
+static int
+bench_run (const struct bench_opts *opts, enum transport transport,
+           size_t payload_bytes)
+{
+    int s = 0;
+    long sent, reads, writes, end_reads, end_writes;
+    uint64_t start, elapsed, enters;
+    double seconds;
+    int32_t *payload;
+    struct bench_run run;
+    struct fg_events_opts evopts;
+    struct fg_events_data server;
+    struct fg_events_data *clients;
+    struct fg_events_stats stats;
+    struct fg_hist *total, *hist;
+    struct fgevent fgev;
+
+    payload = calloc (payload_bytes / sizeof (int32_t) + 1, sizeof (int32_t));
+    clients = calloc (opts->clients, sizeof (struct fg_events_data));
+    total = malloc (sizeof (struct fg_hist));
+    hist = malloc (sizeof (struct fg_hist));
+    if (payload == NULL || clients == NULL || total == NULL || hist == NULL)
+      {
+        perror ("fgbench");
+        exit (EXIT_FAILURE);
+      }
+
+    memset (&run, 0, sizeof (run));
+    sem_init (&run.credits, 0, opts->window);
+    sem_init (&run.done, 0, 0);
+
+    fg_events_opts_init (&evopts);
+    evopts.track_latency = true;
+    evopts.busy_poll.tv_sec = opts->busy_poll / 1000000;
+    evopts.busy_poll.tv_usec = opts->busy_poll % 1000000;
+    evopts.io_uring = opts->io_uring;
+
+    if (fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                    SOCK_PATH, SERVER_ID, &evopts) < 0)
+      {
+        fprintf (stderr, "fgbench: could not start server\n");
+        exit (EXIT_FAILURE);
+      }
+
+    for (int i = 0; i < opts->clients; i++)
+      {
+        if (transport == TRANSPORT_UNIX)
+            s = fg_events_client_init_unix_opts (&clients[i], &client_callback,
+                                                 NULL, &run, SOCK_PATH,
+                                                 FIRST_CLIENT_ID + i, &evopts);
+        else
+            s = fg_events_client_init_inet_opts (&clients[i], &client_callback,
+                                                 NULL, &run, "127.0.0.1",
+                                                 server.port,
+                                                 FIRST_CLIENT_ID + i, &evopts);
+        if (s < 0)
+          {
+            fprintf (stderr, "fgbench: could not start client %d\n", i);
+            exit (EXIT_FAILURE);
+          }
+      }
+    s = 0;
+
+    usleep (200 * 1000); // make sure all clients are confirmed
+
+    fgev.id = BENCH_ID;
+    fgev.writeback = 0;
+    fgev.length = payload_bytes / sizeof (int32_t);
+    fgev.payload = payload;
+
+    /* Closed loop, each client sends to the next one and a new event is
+       only sent once one of the window has arrived */
+    io_syscalls (&reads, &writes);
+    start = monotonic_ns ();
+    for (sent = 0; sent < opts->events; sent++)
+      {
+        int i = sent % opts->clients;
+
+        if (wait_sem (&run.credits) < 0)
+            break;
+        fgev.receiver = FIRST_CLIENT_ID + (i + 1) % opts->clients;
+        fg_send_event (&clients[i], &fgev);
+      }
+    for (long i = 0; i < sent; i++)
+      {
+        if (wait_sem (&run.done) < 0)
+            break;
+      }
+    elapsed = monotonic_ns () - start;
+    seconds = elapsed / 1e9;
+    io_syscalls (&end_reads, &end_writes);
+
+    if (__atomic_load_n (&run.received, __ATOMIC_RELAXED) != opts->events)
+      {
+        fprintf (stderr, "fgbench: stalled after %ld of %ld events\n",
+                 __atomic_load_n (&run.received, __ATOMIC_RELAXED),
+                 opts->events);
+        s = -1;
+      }
+
+    /* The ring of every events thread counts its own io_uring_enter calls,
+       unlike the read and write calls they are not seen in /proc */
+    fg_events_get_stats (&server, &stats);
+    enters = stats.io_enters;
+    for (int i = 0; i < opts->clients; i++)
+      {
+        struct fg_events_stats client_stats;
+
+        fg_events_get_stats (&clients[i], &client_stats);
+        enters += client_stats.io_enters;
+      }
+    merge_latency (clients, opts->clients, total, hist);
+
+    fprintf (stdout, "{\"bench\":\"throughput\","
+                     "\"transport\":\"%s\","
+                     "\"io_uring\":%s,"
+                     "\"clients\":%d,"
+                     "\"events\":%ld,"
+                     "\"payload_bytes\":%zu,"
+                     "\"ok\":%s,"
+                     "\"seconds\":%.6f,"
+                     "\"events_per_sec\":%.1f,"
+                     "\"mb_per_sec\":%.3f,"
+                     "\"wire_mb_per_sec\":%.3f,"
+                     "\"p50_us\":%.3f,"
+                     "\"p99_us\":%.3f,"
+                     "\"p999_us\":%.3f,"
+                     "\"max_us\":%.3f,"
+                     "\"read_syscalls_per_event\":%.3f,"
+                     "\"write_syscalls_per_event\":%.3f,"
+                     "\"io_uring_enters_per_event\":%.3f}\n",
+             transport == TRANSPORT_UNIX ? "unix" : "inet",
+             opts->io_uring ? "true" : "false",
+             opts->clients, opts->events,
+             fgev.length * sizeof (int32_t), s == 0 ? "true" : "false",
+             seconds, opts->events / seconds,
+             opts->events * fgev.length * sizeof (int32_t) / 1e6 / seconds,
+             stats.bytes_in / 1e6 / seconds,
+             fg_hist_percentile (total, 50) / 1e3,
+             fg_hist_percentile (total, 99) / 1e3,
+             fg_hist_percentile (total, 99.9) / 1e3,
+             total->max / 1e3,
+             (double) (end_reads - reads) / opts->events,
+             (double) (end_writes - writes) / opts->events,
+             (double) enters / opts->events);
+    fflush (stdout);
+
+    for (int i = 0; i < opts->clients; i++)
+        fg_events_client_shutdown (&clients[i]);
+    fg_events_server_shutdown (&server);
+
+    sem_destroy (&run.credits);
+    sem_destroy (&run.done);
+    free (hist);
+    free (total);
+    free (clients);
+    free (payload);
+
+    return s;
+}
+
+int
+main (int argc, char *argv[])
+{
+    int c, s = 0;
+    char *size, *saveptr;
+    struct bench_opts opts;
+    static const struct option long_opts[] = {
+        { "clients",   required_argument, NULL, 'c' },
+        { "events",    required_argument, NULL, 'm' },
+        { "busy-poll", required_argument, NULL, 'p' },
+        { "sizes",     required_argument, NULL, 's' },
+        { "transport", required_argument, NULL, 't' },
+        { "io-uring",  no_argument,       NULL, 'u' },
+        { "window",    required_argument, NULL, 'w' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    memset (&opts, 0, sizeof (opts));
+    opts.clients = 4;
+    opts.events = 100000;
+    opts.transports = TRANSPORT_UNIX | TRANSPORT_INET;
+    opts.window = 256;
+    opts.sizes = strdup ("0,64,1024,16384");
+
+    while ((c = getopt_long (argc, argv, "c:m:p:s:t:uw:", long_opts, NULL)) != -1)
+      {
+        switch (c)
+          {
+            case 'c':
+                opts.clients = atoi (optarg);
+                break;
+            case 'm':
+                opts.events = atol (optarg);
+                break;
+            case 'p':
+                opts.busy_poll = atol (optarg);
+                break;
+            case 's':
+                free (opts.sizes);
+                opts.sizes = strdup (optarg);
+                break;
+            case 't':
+                if (strcmp (optarg, "unix") == 0)
+                    opts.transports = TRANSPORT_UNIX;
+                else if (strcmp (optarg, "inet") == 0)
+                    opts.transports = TRANSPORT_INET;
+                else if (strcmp (optarg, "both") == 0)
+                    opts.transports = TRANSPORT_UNIX | TRANSPORT_INET;
+                else
+                  {
+                    usage (argv[0]);
+                    return EXIT_FAILURE;
+                  }
+                break;
+            case 'u':
+                opts.io_uring = true;
+                break;
+            case 'w':
+                opts.window = atoi (optarg);
+                break;
+            default:
+                usage (argv[0]);
+                return EXIT_FAILURE;
+          }
+      }
+
+    if (opts.clients < 1 || opts.clients > MAX_CLIENTS || opts.events < 1 ||
+        opts.window < 1 || opts.busy_poll < 0 || optind != argc)
+      {
+        usage (argv[0]);
+        return EXIT_FAILURE;
+      }
+
+    for (size = strtok_r (opts.sizes, ",", &saveptr);
+         size != NULL;
+         size = strtok_r (NULL, ",", &saveptr))
+      {
+        if (opts.transports & TRANSPORT_UNIX)
+            s |= bench_run (&opts, TRANSPORT_UNIX, strtoul (size, NULL, 10));
+        if (opts.transports & TRANSPORT_INET)
+            s |= bench_run (&opts, TRANSPORT_INET, strtoul (size, NULL, 10));
+      }
+
+    free (opts.sizes);
+
+    return s < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
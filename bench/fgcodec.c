@@ -0,0 +1,384 @@
+/*
+ *  fgcodec.c
+ *    Microbenchmarks of fg_parse_fgevent and create_serialized_fgevent_buffer,
+ *    without any sockets involved. Prints one JSON object per case on
+ *    stdout with the time and cycles spent per event.
+ *
+ *    Usage: fgcodec [-d seconds]
+ *
+ *      -d, --duration S    least time to spend on each case (default 0.2)
+ *
+ *    Cycles are read from the cpu-cycles perf counter, or from the time
+ *    stamp counter on x86 when perf events are not allowed. Without either
+ *    bytes_per_cycle is null.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "fgevents.h"
+
+#define TINY_LENGTH   0
+#define MEDIUM_LENGTH 64
+#define LARGE_LENGTH  16384
+
+/* Frames per buffer in the clumped case, like a busy socket delivers them */
+#define CLUMP_COUNT   64
+
+/* Bytes before the first STX in the garbage case */
+#define GARBAGE_LEN   61
+
+enum cycle_source {
+    CYCLES_NONE,
+    CYCLES_PERF,
+    CYCLES_TSC
+};
+
+struct codec_case {
+    const char    *name;
+    unsigned char *buf;       /* input of the parse cases */
+    size_t        len;
+    int           frames;     /* events in buf */
+    struct fgevent *fgev;     /* input of the serialize cases */
+};
+
+static int perf_fd = -1;
+static enum cycle_source cycle_source = CYCLES_NONE;
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr, "Usage: %s [-d seconds]\n", prog);
+}
+
+static uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+cycles_init (void)
+{
+    struct perf_event_attr attr;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.size = sizeof (attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    perf_fd = syscall (SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd >= 0)
+      {
+        cycle_source = CYCLES_PERF;
+        ioctl (perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+        return;
+      }
+
+#if defined(__x86_64__) || defined(__i386__)
+    cycle_source = CYCLES_TSC;
+#endif
+}
+
+static uint64_t
+cycles (void)
+{
+    uint64_t count = 0;
+
+    switch (cycle_source)
+      {
+        case CYCLES_PERF:
+            if (read (perf_fd, &count, sizeof (count)) != sizeof (count))
+                count = 0;
+            break;
+#if defined(__x86_64__) || defined(__i386__)
+        case CYCLES_TSC:
+            count = __rdtsc ();
+            break;
+#endif
+        default:
+            break;
+      }
+
+    return count;
+}
+
+static struct fgevent *
+make_event (int32_t length)
+{
+    struct fgevent *fgev = calloc (1, sizeof (struct fgevent));
+
+    if (fgev == NULL)
+        return NULL;
+
+    fgev->id = ABI;
+    fgev->sender = 2;
+    fgev->receiver = 3;
+    fgev->length = length;
+    if (length > 0)
+      {
+        fgev->payload = malloc (length * sizeof (int32_t));
+        if (fgev->payload == NULL)
+            return NULL;
+        for (int32_t i = 0; i < length; i++)
+            fgev->payload[i] = i * 0x01010101;
+      }
+
+    return fgev;
+}
+
+/* Build a buffer of count frames of the given length, after prefix bytes of
+   garbage free of STX */
+static unsigned char *
+make_frames (int32_t length, int count, size_t prefix, size_t *len)
+{
+    int s;
+    unsigned char *frame, *buf;
+    struct fgevent *fgev = make_event (length);
+
+    if (fgev == NULL ||
+        (s = create_serialized_fgevent_buffer (&frame, fgev)) < 0)
+        return NULL;
+
+    *len = prefix + (size_t) s * count;
+    buf = malloc (*len);
+    if (buf == NULL)
+        return NULL;
+
+    for (size_t i = 0; i < prefix; i++)
+        buf[i] = 0x80 | (i * 37);
+    for (int i = 0; i < count; i++)
+        memcpy (buf + prefix + (size_t) s * i, frame, s);
+
+    free (frame);
+    free (fgev->payload);
+    free (fgev);
+
+    return buf;
+}
+
+/* Parse every frame of the buffer once, returns the events found */
+static int
+parse_all (const struct codec_case *c)
+{
+    int n = 0;
+    unsigned char *ptr = c->buf;
+
+    while ((size_t) (ptr - c->buf) < c->len)
+      {
+        struct fgevent fgev;
+
+        if (fg_parse_fgevent (&fgev, c->buf, c->len, &ptr) > 0)
+          {
+            if (fgev.length > 0)
+                free (fgev.payload);
+            n++;
+          }
+      }
+
+    return n;
+}
+
+static int
+serialize_one (const struct codec_case *c)
+{
+    unsigned char *buf;
+
+    if (create_serialized_fgevent_buffer (&buf, c->fgev) < 0)
+        return 0;
+    free (buf);
+
+    return 1;
+}
+
+/* Run a case until at least duration seconds have passed, doubling the
+   iterations of each round so the clock is read rarely */
+static int
+run_case (const struct codec_case *c, int (*op) (const struct codec_case *),
+          size_t bytes_per_event, double duration)
+{
+    long iterations = 1, total = 0;
+    uint64_t start, elapsed, start_cycles, spent_cycles;
+    uint64_t events = 0;
+
+    /* Warm up caches and the allocator */
+    for (int i = 0; i < 100; i++)
+        op (c);
+
+    start = monotonic_ns ();
+    start_cycles = cycles ();
+    do
+      {
+        for (long i = 0; i < iterations; i++)
+            events += op (c);
+        total += iterations;
+        iterations *= 2;
+        elapsed = monotonic_ns () - start;
+      }
+    while (elapsed < duration * 1e9);
+    spent_cycles = cycles () - start_cycles;
+
+    if (events != (uint64_t) total * c->frames)
+      {
+        fprintf (stderr, "fgcodec: %s found %llu of %llu events\n", c->name,
+                 (unsigned long long) events,
+                 (unsigned long long) total * c->frames);
+        return -1;
+      }
+
+    fprintf (stdout, "{\"bench\":\"codec\","
+                     "\"case\":\"%s\","
+                     "\"events\":%llu,"
+                     "\"bytes_per_event\":%zu,"
+                     "\"ns_per_event\":%.2f,"
+                     "\"events_per_sec\":%.1f,",
+             c->name, (unsigned long long) events, bytes_per_event,
+             (double) elapsed / events, events * 1e9 / elapsed);
+    if (cycle_source == CYCLES_NONE || spent_cycles == 0)
+        fprintf (stdout, "\"cycles_per_event\":null,"
+                         "\"bytes_per_cycle\":null,"
+                         "\"cycle_source\":null}\n");
+    else
+        fprintf (stdout, "\"cycles_per_event\":%.2f,"
+                         "\"bytes_per_cycle\":%.4f,"
+                         "\"cycle_source\":\"%s\"}\n",
+                 (double) spent_cycles / events,
+                 (double) bytes_per_event * events / spent_cycles,
+                 cycle_source == CYCLES_PERF ? "perf" : "tsc");
+    fflush (stdout);
+
+    return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+    int c, s = 0;
+    double duration = 0.2;
+    static const struct option long_opts[] = {
+        { "duration", required_argument, NULL, 'd' },
+        { NULL, 0, NULL, 0 }
+    };
+    static const struct {
+        const char *name;
+        int32_t    length;
+        int        count;
+        size_t     prefix;
+    } parse_cases[] = {
+        { "parse_tiny",    TINY_LENGTH,   1,           0 },
+        { "parse_medium",  MEDIUM_LENGTH, 1,           0 },
+        { "parse_large",   LARGE_LENGTH,  1,           0 },
+        { "parse_garbage", MEDIUM_LENGTH, 1,           GARBAGE_LEN },
+        { "parse_clumped", MEDIUM_LENGTH, CLUMP_COUNT, 0 }
+    };
+    static const struct {
+        const char *name;
+        int32_t    length;
+    } serialize_cases[] = {
+        { "serialize_tiny",   TINY_LENGTH },
+        { "serialize_medium", MEDIUM_LENGTH },
+        { "serialize_large",  LARGE_LENGTH }
+    };
+
+    while ((c = getopt_long (argc, argv, "d:", long_opts, NULL)) != -1)
+      {
+        switch (c)
+          {
+            case 'd':
+                duration = atof (optarg);
+                break;
+            default:
+                usage (argv[0]);
+                return EXIT_FAILURE;
+          }
+      }
+
+    if (duration <= 0 || optind != argc)
+      {
+        usage (argv[0]);
+        return EXIT_FAILURE;
+      }
+
+    cycles_init ();
+
+    for (size_t i = 0; i < sizeof (parse_cases) / sizeof (parse_cases[0]); i++)
+      {
+        struct codec_case cc;
+
+        memset (&cc, 0, sizeof (cc));
+        cc.name = parse_cases[i].name;
+        cc.frames = parse_cases[i].count;
+        cc.buf = make_frames (parse_cases[i].length, cc.frames,
+                              parse_cases[i].prefix, &cc.len);
+        if (cc.buf == NULL)
+          {
+            perror ("fgcodec");
+            return EXIT_FAILURE;
+          }
+
+        s |= run_case (&cc, parse_all, cc.len / cc.frames, duration);
+        free (cc.buf);
+      }
+
+    for (size_t i = 0;
+         i < sizeof (serialize_cases) / sizeof (serialize_cases[0]);
+         i++)
+      {
+        struct codec_case cc;
+
+        memset (&cc, 0, sizeof (cc));
+        cc.name = serialize_cases[i].name;
+        cc.frames = 1;
+        cc.fgev = make_event (serialize_cases[i].length);
+        if (cc.fgev == NULL)
+          {
+            perror ("fgcodec");
+            return EXIT_FAILURE;
+          }
+
+        s |= run_case (&cc, serialize_one,
+                       2 + FGEVENT_HEADER_SIZE +
+                       cc.fgev->length * sizeof (int32_t), duration);
+        free (cc.fgev->payload);
+        free (cc.fgev);
+      }
+
+    if (perf_fd >= 0)
+        close (perf_fd);
+
+    return s < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
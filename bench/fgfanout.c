@@ -0,0 +1,455 @@
+/*
+ *  fgfanout.c
+ *    Fan-out benchmark. Starts a server, one producer and K consumers in
+ *    this process. Each round the producer sends the same event to every
+ *    consumer through the server, and one JSON object per K is printed on
+ *    stdout.
+ *
+ *    Usage: fgfanout [options]
+ *
+ *      -k, --consumers LIST comma separated consumer counts, one run each
+ *                           (default 1,10,50,125, at most 125 since user
+ *                           ids are an int8_t)
+ *      -r, --rounds R       rounds per run (default 2000)
+ *      -s, --size BYTES     payload size (default 64, at least 4)
+ *      -t, --transport T    unix or inet (default unix)
+ *      -w, --window W       rounds in flight at most (default 4)
+ *
+ *    server_cpu_ns_per_delivery is the cpu time of the server thread
+ *    divided by the events it delivered, the consumers and the producer
+ *    run on threads of their own. skew is the time between the first and
+ *    the last consumer receiving a round, spread is the time from the
+ *    first send of a round until the last consumer received it.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "fgevents.h"
+
+#define BENCH_ID          0x43
+#define SERVER_ID         1
+#define PRODUCER_ID       2
+#define FIRST_CONSUMER_ID 3
+#define MAX_CONSUMERS     (INT8_MAX - FIRST_CONSUMER_ID + 1)
+#define SOCK_PATH         "/tmp/fgfanout.sock"
+
+/* Give up on a run when no round completes for this long */
+#define STALL_TIMEOUT_SEC 10
+
+enum transport {
+    TRANSPORT_UNIX = 1 << 0,
+    TRANSPORT_INET = 1 << 1
+};
+
+struct fanout_opts {
+    long           rounds;
+    size_t         size;
+    enum transport transport;
+    int            window;
+    char           *consumers;
+};
+
+/* Arrivals of a single round, updated by every consumer thread */
+struct fanout_round {
+    uint64_t sent_ns;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    int      arrived;
+};
+
+struct fanout_run {
+    int                 consumers;
+    long                rounds;
+    struct fanout_round *round;
+    sem_t               credits;    /* free rounds in the window */
+    sem_t               done;
+};
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr, "Usage: %s [-k consumers] [-r rounds] [-s bytes] "
+                     "[-t unix|inet] [-w window]\n", prog);
+}
+
+static uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+thread_cpu_ns (pthread_t thread)
+{
+    clockid_t cid;
+    struct timespec ts;
+
+    if (pthread_getcpuclockid (thread, &cid) != 0 ||
+        clock_gettime (cid, &ts) < 0)
+        return 0;
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+consumer_callback (void *arg, struct fgevent *fgev,
+                   struct fgevent * UNUSED(ansev))
+{
+    uint64_t now, seen;
+    struct fanout_run *run = arg;
+    struct fanout_round *round;
+
+    if (fgev == NULL || fgev->id != BENCH_ID || fgev->length < 1 ||
+        fgev->payload[0] < 0 || fgev->payload[0] >= run->rounds)
+        return 0;
+
+    now = monotonic_ns ();
+    round = &run->round[fgev->payload[0]];
+
+    seen = __atomic_load_n (&round->first_ns, __ATOMIC_RELAXED);
+    while ((seen == 0 || now < seen) &&
+           !__atomic_compare_exchange_n (&round->first_ns, &seen, now, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    seen = __atomic_load_n (&round->last_ns, __ATOMIC_RELAXED);
+    while (now > seen &&
+           !__atomic_compare_exchange_n (&round->last_ns, &seen, now, true,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    if (__atomic_add_fetch (&round->arrived, 1, __ATOMIC_ACQ_REL) ==
+        run->consumers)
+      {
+        sem_post (&run->credits);
+        sem_post (&run->done);
+      }
+
+    return 0;
+}
+
+static int
+wait_sem (sem_t *sem)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += STALL_TIMEOUT_SEC;
+    while (sem_timedwait (sem, &ts) < 0)
+      {
+        if (errno != EINTR)
+            return -1;
+      }
+
+    return 0;
+}
+
+/* Wait until the server has every client confirmed */
+static int
+wait_connected (struct fg_events_data *server, int clients)
+{
+    struct fg_conn_stats *conns;
+    uint64_t start = monotonic_ns ();
+
+    conns = calloc (clients, sizeof (struct fg_conn_stats));
+    if (conns == NULL)
+        return -1;
+
+    while (monotonic_ns () - start < STALL_TIMEOUT_SEC * 1000000000ULL)
+      {
+        int connected = 0;
+        ssize_t n = fg_events_get_conn_stats (server, conns, clients);
+
+        for (ssize_t i = 0; i < n && i < clients; i++)
+            connected += conns[i].status == CONNECTED;
+        if (connected == clients)
+          {
+            free (conns);
+            return 0;
+          }
+        usleep (10 * 1000);
+      }
+
+    free (conns);
+    return -1;
+}
+
+static int
+cmp_u64 (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int
+fanout_run (const struct fanout_opts *opts, int consumers)
+{
+    int s = 0;
+    long r, completed;
+    uint64_t start, elapsed, cpu_start, cpu;
+    uint64_t *skew, *spread;
+    int32_t *payload;
+    struct fanout_run run;
+    struct fg_events_data server, producer;
+    struct fg_events_data *clients;
+    struct fgevent fgev;
+
+    memset (&run, 0, sizeof (run));
+    run.consumers = consumers;
+    run.rounds = opts->rounds;
+    run.round = calloc (opts->rounds, sizeof (struct fanout_round));
+    skew = calloc (opts->rounds, sizeof (uint64_t));
+    spread = calloc (opts->rounds, sizeof (uint64_t));
+    payload = calloc (opts->size / sizeof (int32_t), sizeof (int32_t));
+    clients = calloc (consumers, sizeof (struct fg_events_data));
+    if (run.round == NULL || skew == NULL || spread == NULL ||
+        payload == NULL || clients == NULL)
+      {
+        perror ("fgfanout");
+        exit (EXIT_FAILURE);
+      }
+    sem_init (&run.credits, 0, opts->window);
+    sem_init (&run.done, 0, 0);
+
+    if (fg_events_server_init (&server, &server_callback, NULL, 0,
+                               SOCK_PATH, SERVER_ID) < 0)
+      {
+        fprintf (stderr, "fgfanout: could not start server\n");
+        exit (EXIT_FAILURE);
+      }
+
+    for (int i = 0; i <= consumers; i++)
+      {
+        struct fg_events_data *etdata = i == 0 ? &producer : &clients[i - 1];
+        int8_t user_id = i == 0 ? PRODUCER_ID : FIRST_CONSUMER_ID + i - 1;
+
+        if (opts->transport == TRANSPORT_UNIX)
+            s = fg_events_client_init_unix (etdata, &consumer_callback, NULL,
+                                            &run, SOCK_PATH, user_id);
+        else
+            s = fg_events_client_init_inet (etdata, &consumer_callback, NULL,
+                                            &run, "127.0.0.1", server.port,
+                                            user_id);
+        if (s < 0)
+          {
+            fprintf (stderr, "fgfanout: could not start client %d\n", i);
+            exit (EXIT_FAILURE);
+          }
+      }
+    s = 0;
+
+    if (wait_connected (&server, consumers + 1) < 0)
+      {
+        fprintf (stderr, "fgfanout: clients did not connect\n");
+        exit (EXIT_FAILURE);
+      }
+
+    fgev.id = BENCH_ID;
+    fgev.writeback = 0;
+    fgev.length = opts->size / sizeof (int32_t);
+    fgev.payload = payload;
+
+    start = monotonic_ns ();
+    cpu_start = thread_cpu_ns (server.events_t);
+    for (r = 0; r < opts->rounds; r++)
+      {
+        if (wait_sem (&run.credits) < 0)
+            break;
+        payload[0] = r;
+        run.round[r].sent_ns = monotonic_ns ();
+        for (int i = 0; i < consumers; i++)
+          {
+            fgev.receiver = FIRST_CONSUMER_ID + i;
+            fg_send_event (&producer, &fgev);
+          }
+      }
+    for (completed = 0; completed < r; completed++)
+      {
+        if (wait_sem (&run.done) < 0)
+            break;
+      }
+    cpu = thread_cpu_ns (server.events_t) - cpu_start;
+    elapsed = monotonic_ns () - start;
+
+    if (completed != opts->rounds)
+      {
+        fprintf (stderr, "fgfanout: stalled after %ld of %ld rounds\n",
+                 completed, opts->rounds);
+        s = -1;
+      }
+
+    completed = 0;
+    for (r = 0; r < opts->rounds; r++)
+      {
+        struct fanout_round *round = &run.round[r];
+
+        if (__atomic_load_n (&round->arrived, __ATOMIC_ACQUIRE) != consumers)
+            continue;
+        skew[completed] = round->last_ns - round->first_ns;
+        spread[completed] = round->last_ns - round->sent_ns;
+        completed++;
+      }
+    qsort (skew, completed, sizeof (uint64_t), cmp_u64);
+    qsort (spread, completed, sizeof (uint64_t), cmp_u64);
+
+#define PCT(a, p) (completed > 0 ? (a)[completed * (p) / 1000] / 1e3 : 0.0)
+    fprintf (stdout, "{\"bench\":\"fanout\","
+                     "\"transport\":\"%s\","
+                     "\"consumers\":%d,"
+                     "\"rounds\":%ld,"
+                     "\"payload_bytes\":%zu,"
+                     "\"ok\":%s,"
+                     "\"seconds\":%.6f,"
+                     "\"deliveries_per_sec\":%.1f,"
+                     "\"server_cpu_ns_per_delivery\":%.1f,"
+                     "\"skew_p50_us\":%.3f,"
+                     "\"skew_p99_us\":%.3f,"
+                     "\"skew_max_us\":%.3f,"
+                     "\"spread_p50_us\":%.3f,"
+                     "\"spread_p99_us\":%.3f,"
+                     "\"spread_max_us\":%.3f}\n",
+             opts->transport == TRANSPORT_UNIX ? "unix" : "inet", consumers,
+             opts->rounds, fgev.length * sizeof (int32_t),
+             s == 0 ? "true" : "false", elapsed / 1e9,
+             completed * consumers * 1e9 / elapsed,
+             completed > 0 ? (double) cpu / (completed * consumers) : 0.0,
+             PCT (skew, 500), PCT (skew, 990),
+             completed > 0 ? skew[completed - 1] / 1e3 : 0.0,
+             PCT (spread, 500), PCT (spread, 990),
+             completed > 0 ? spread[completed - 1] / 1e3 : 0.0);
+#undef PCT
+    fflush (stdout);
+
+    fg_events_client_shutdown (&producer);
+    for (int i = 0; i < consumers; i++)
+        fg_events_client_shutdown (&clients[i]);
+    fg_events_server_shutdown (&server);
+
+    sem_destroy (&run.credits);
+    sem_destroy (&run.done);
+    free (clients);
+    free (payload);
+    free (spread);
+    free (skew);
+    free (run.round);
+
+    return s;
+}
+
+int
+main (int argc, char *argv[])
+{
+    int c, s = 0;
+    char *count, *saveptr;
+    struct fanout_opts opts;
+    static const struct option long_opts[] = {
+        { "consumers", required_argument, NULL, 'k' },
+        { "rounds",    required_argument, NULL, 'r' },
+        { "size",      required_argument, NULL, 's' },
+        { "transport", required_argument, NULL, 't' },
+        { "window",    required_argument, NULL, 'w' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    memset (&opts, 0, sizeof (opts));
+    opts.rounds = 2000;
+    opts.size = 64;
+    opts.transport = TRANSPORT_UNIX;
+    opts.window = 4;
+    opts.consumers = strdup ("1,10,50,125");
+
+    while ((c = getopt_long (argc, argv, "k:r:s:t:w:", long_opts, NULL)) != -1)
+      {
+        switch (c)
+          {
+            case 'k':
+                free (opts.consumers);
+                opts.consumers = strdup (optarg);
+                break;
+            case 'r':
+                opts.rounds = atol (optarg);
+                break;
+            case 's':
+                opts.size = strtoul (optarg, NULL, 10);
+                break;
+            case 't':
+                if (strcmp (optarg, "unix") == 0)
+                    opts.transport = TRANSPORT_UNIX;
+                else if (strcmp (optarg, "inet") == 0)
+                    opts.transport = TRANSPORT_INET;
+                else
+                  {
+                    usage (argv[0]);
+                    return EXIT_FAILURE;
+                  }
+                break;
+            case 'w':
+                opts.window = atoi (optarg);
+                break;
+            default:
+                usage (argv[0]);
+                return EXIT_FAILURE;
+          }
+      }
+
+    if (opts.rounds < 1 || opts.rounds > INT32_MAX ||
+        opts.size < sizeof (int32_t) || opts.window < 1 || optind != argc)
+      {
+        usage (argv[0]);
+        return EXIT_FAILURE;
+      }
+
+    for (count = strtok_r (opts.consumers, ",", &saveptr);
+         count != NULL;
+         count = strtok_r (NULL, ",", &saveptr))
+      {
+        int consumers = atoi (count);
+
+        if (consumers < 1 || consumers > MAX_CONSUMERS)
+          {
+            fprintf (stderr, "fgfanout: between 1 and %d consumers\n",
+                     MAX_CONSUMERS);
+            return EXIT_FAILURE;
+          }
+        s |= fanout_run (&opts, consumers);
+      }
+
+    free (opts.consumers);
+
+    return s < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
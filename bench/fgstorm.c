@@ -0,0 +1,421 @@
+/*
+ *  fgstorm.c
+ *    Connection storm benchmark. Starts a server in this process and opens
+ *    thousands of connections to it at once, like a fleet reconnecting
+ *    after a power blip, and prints one JSON object per transport on
+ *    stdout.
+ *
+ *    Usage: fgstorm [options]
+ *
+ *      -n, --connections N number of connections (default 2000)
+ *      -t, --transport T   unix, inet or both (default both)
+ *
+ *    A connection counts as handshaken once its FG_CONFIRMED event has
+ *    arrived. Connections are plain sockets which never announce a user,
+ *    so there may be more of them than user ids. The memory per connection
+ *    is the growth of the heap, and of the resident set, of the process
+ *    divided by the number of connections. The kernel socket buffers are
+ *    not included and the resident set of the second run is often smaller
+ *    since it reuses pages the first run touched.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <fcntl.h>
+#include <malloc.h>
+
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "fgevents.h"
+
+#define SERVER_ID 1
+#define SOCK_PATH "/tmp/fgstorm.sock"
+
+/* Give up when nothing happens for this long */
+#define STALL_TIMEOUT_MS 10000
+
+enum transport {
+    TRANSPORT_UNIX = 1 << 0,
+    TRANSPORT_INET = 1 << 1
+};
+
+struct storm_conn {
+    int           fd;
+    bool          connected;    /* connect has gone through */
+    bool          confirmed;
+    uint64_t      start_ns;
+    uint64_t      done_ns;
+    size_t        len;
+    unsigned char buf[64];
+};
+
+static void
+usage (const char *prog)
+{
+    fprintf (stderr, "Usage: %s [-n connections] [-t unix|inet|both]\n",
+             prog);
+}
+
+static uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long
+rss_bytes (void)
+{
+    long pages = 0;
+    FILE *fp = fopen ("/proc/self/statm", "r");
+
+    if (fp == NULL)
+        return 0;
+    if (fscanf (fp, "%*d %ld", &pages) != 1)
+        pages = 0;
+    fclose (fp);
+
+    return pages * sysconf (_SC_PAGESIZE);
+}
+
+static long
+heap_bytes (void)
+{
+    struct mallinfo2 mi = mallinfo2 ();
+
+    return mi.uordblks + mi.hblkhd;
+}
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+cmp_u64 (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Start a connection, unix sockets refuse with EAGAIN while the backlog of
+   the listener is full so these are retried later on */
+static int
+storm_connect (struct storm_conn *conn, enum transport transport,
+               uint16_t port)
+{
+    int s;
+
+    if (conn->fd < 0)
+      {
+        conn->fd = socket (transport == TRANSPORT_UNIX ? AF_LOCAL : AF_INET,
+                           SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (conn->fd < 0)
+            return -1;
+        conn->start_ns = monotonic_ns ();
+      }
+
+    if (transport == TRANSPORT_UNIX)
+      {
+        struct sockaddr_un sun;
+
+        memset (&sun, 0, sizeof (sun));
+        sun.sun_family = AF_LOCAL;
+        strncpy (sun.sun_path, SOCK_PATH, sizeof (sun.sun_path) - 1);
+        s = connect (conn->fd, (struct sockaddr *) &sun, sizeof (sun));
+      }
+    else
+      {
+        struct sockaddr_in sin;
+
+        memset (&sin, 0, sizeof (sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+        sin.sin_port = htons (port);
+        s = connect (conn->fd, (struct sockaddr *) &sin, sizeof (sin));
+      }
+
+    if (s == 0 || errno == EINPROGRESS)
+      {
+        conn->connected = true;
+        return 0;
+      }
+
+    return errno == EAGAIN ? 0 : -1;
+}
+
+/* Read what the server sent so far, true once FG_CONFIRMED is there */
+static bool
+storm_read (struct storm_conn *conn)
+{
+    ssize_t n;
+    unsigned char *ptr;
+    struct fgevent fgev;
+
+    n = read (conn->fd, conn->buf + conn->len, sizeof (conn->buf) - conn->len);
+    if (n <= 0)
+        return false;
+    conn->len += n;
+
+    ptr = conn->buf;
+    while ((size_t) (ptr - conn->buf) < conn->len)
+      {
+        if (fg_parse_fgevent (&fgev, conn->buf, conn->len, &ptr) <= 0)
+            continue;
+        if (fgev.length > 0)
+            free (fgev.payload);
+        if (fgev.id == FG_CONFIRMED)
+            return true;
+      }
+
+    return false;
+}
+
+/* Wait until the server has let go of every connection */
+static uint64_t
+wait_conns (struct fg_events_data *server, ssize_t expected)
+{
+    uint64_t start = monotonic_ns ();
+
+    while (fg_events_get_conn_stats (server, NULL, 0) != expected)
+      {
+        if (monotonic_ns () - start > STALL_TIMEOUT_MS * 1000000ULL)
+            break;
+        usleep (1000);
+      }
+
+    return monotonic_ns () - start;
+}
+
+static int
+storm_run (int count, enum transport transport)
+{
+    int s = 0, epfd, confirmed = 0, connected = 0;
+    long rss_before, rss_after, heap_before, heap_after;
+    ssize_t registered;
+    uint64_t start, last_event, elapsed, teardown;
+    uint64_t *handshake;
+    struct storm_conn *conns;
+    struct epoll_event evs[256];
+    struct fg_events_data server;
+
+    conns = calloc (count, sizeof (struct storm_conn));
+    handshake = calloc (count, sizeof (uint64_t));
+    epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (conns == NULL || handshake == NULL || epfd < 0)
+      {
+        perror ("fgstorm");
+        exit (EXIT_FAILURE);
+      }
+    for (int i = 0; i < count; i++)
+        conns[i].fd = -1;
+
+    if (fg_events_server_init (&server, &server_callback, NULL, 0, SOCK_PATH,
+                               SERVER_ID) < 0)
+      {
+        fprintf (stderr, "fgstorm: could not start server\n");
+        exit (EXIT_FAILURE);
+      }
+
+    usleep (100 * 1000); // let the server settle before measuring
+    rss_before = rss_bytes ();
+    heap_before = heap_bytes ();
+
+    start = last_event = monotonic_ns ();
+    while (confirmed < count)
+      {
+        int n;
+
+        /* Keep (re)trying the connections which did not go through */
+        for (int i = 0; connected < count && i < count; i++)
+          {
+            struct epoll_event ev;
+
+            if (conns[i].connected)
+                continue;
+            if (storm_connect (&conns[i], transport, server.port) < 0)
+              {
+                perror ("fgstorm: connect");
+                exit (EXIT_FAILURE);
+              }
+            if (!conns[i].connected)
+                break;  // the backlog is full, wait for the server
+
+            connected++;
+            ev.events = EPOLLIN;
+            ev.data.u32 = i;
+            if (epoll_ctl (epfd, EPOLL_CTL_ADD, conns[i].fd, &ev) < 0)
+              {
+                perror ("fgstorm: epoll_ctl");
+                exit (EXIT_FAILURE);
+              }
+          }
+
+        n = epoll_wait (epfd, evs, sizeof (evs) / sizeof (evs[0]),
+                        connected < count ? 1 : 100);
+        for (int i = 0; i < n; i++)
+          {
+            struct storm_conn *conn = &conns[evs[i].data.u32];
+
+            if (conn->confirmed || !storm_read (conn))
+                continue;
+            conn->confirmed = true;
+            conn->done_ns = monotonic_ns ();
+            handshake[confirmed++] = conn->done_ns - conn->start_ns;
+            last_event = conn->done_ns;
+          }
+
+        if (n == 0 && monotonic_ns () - last_event >
+                      STALL_TIMEOUT_MS * 1000000ULL)
+          {
+            fprintf (stderr, "fgstorm: stalled after %d of %d handshakes\n",
+                     confirmed, count);
+            s = -1;
+            break;
+          }
+      }
+    elapsed = monotonic_ns () - start;
+
+    registered = fg_events_get_conn_stats (&server, NULL, 0);
+    rss_after = rss_bytes ();
+    heap_after = heap_bytes ();
+
+    for (int i = 0; i < count; i++)
+        if (conns[i].fd >= 0)
+            close (conns[i].fd);
+    teardown = wait_conns (&server, 0);
+
+    qsort (handshake, confirmed, sizeof (uint64_t), cmp_u64);
+
+    fprintf (stdout, "{\"bench\":\"storm\","
+                     "\"transport\":\"%s\","
+                     "\"connections\":%d,"
+                     "\"confirmed\":%d,"
+                     "\"registered\":%zd,"
+                     "\"ok\":%s,"
+                     "\"seconds\":%.6f,"
+                     "\"accepts_per_sec\":%.1f,"
+                     "\"handshake_p50_ms\":%.3f,"
+                     "\"handshake_p99_ms\":%.3f,"
+                     "\"handshake_max_ms\":%.3f,"
+                     "\"heap_per_conn_bytes\":%ld,"
+                     "\"rss_per_conn_bytes\":%ld,"
+                     "\"teardown_seconds\":%.6f}\n",
+             transport == TRANSPORT_UNIX ? "unix" : "inet", count, confirmed,
+             registered, s == 0 ? "true" : "false", elapsed / 1e9,
+             confirmed * 1e9 / elapsed,
+             confirmed > 0 ? handshake[confirmed / 2] / 1e6 : 0.0,
+             confirmed > 0 ? handshake[confirmed * 99 / 100] / 1e6 : 0.0,
+             confirmed > 0 ? handshake[confirmed - 1] / 1e6 : 0.0,
+             (heap_after - heap_before) / count,
+             (rss_after - rss_before) / count, teardown / 1e9);
+    fflush (stdout);
+
+    fg_events_server_shutdown (&server);
+
+    close (epfd);
+    free (handshake);
+    free (conns);
+
+    /* Hand the memory back so the next run starts from the same size */
+    malloc_trim (0);
+
+    return s;
+}
+
+int
+main (int argc, char *argv[])
+{
+    int c, s = 0, count = 2000, transports = TRANSPORT_UNIX | TRANSPORT_INET;
+    struct rlimit rl;
+    static const struct option long_opts[] = {
+        { "connections", required_argument, NULL, 'n' },
+        { "transport",   required_argument, NULL, 't' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((c = getopt_long (argc, argv, "n:t:", long_opts, NULL)) != -1)
+      {
+        switch (c)
+          {
+            case 'n':
+                count = atoi (optarg);
+                break;
+            case 't':
+                if (strcmp (optarg, "unix") == 0)
+                    transports = TRANSPORT_UNIX;
+                else if (strcmp (optarg, "inet") == 0)
+                    transports = TRANSPORT_INET;
+                else if (strcmp (optarg, "both") == 0)
+                    transports = TRANSPORT_UNIX | TRANSPORT_INET;
+                else
+                  {
+                    usage (argv[0]);
+                    return EXIT_FAILURE;
+                  }
+                break;
+            default:
+                usage (argv[0]);
+                return EXIT_FAILURE;
+          }
+      }
+
+    if (count < 1 || optind != argc)
+      {
+        usage (argv[0]);
+        return EXIT_FAILURE;
+      }
+
+    /* Both ends of every connection live in this process */
+    if (getrlimit (RLIMIT_NOFILE, &rl) == 0)
+      {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit (RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur != RLIM_INFINITY &&
+            (rlim_t) count * 2 + 64 > rl.rlim_cur)
+          {
+            count = (rl.rlim_cur - 64) / 2;
+            fprintf (stderr, "fgstorm: limited to %d connections by "
+                             "RLIMIT_NOFILE\n", count);
+          }
+      }
+
+    if (transports & TRANSPORT_UNIX)
+        s |= storm_run (count, TRANSPORT_UNIX);
+    if (transports & TRANSPORT_INET)
+        s |= storm_run (count, TRANSPORT_INET);
+
+    return s < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,316 @@
+/*
+ *  capture.c
+ *    Capture of frames into a memory mapped ring file which outlives the
+ *    process, to be able to look at the traffic after something went wrong
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+
+#define ALIGN_UP(n) (((n) + FG_CAPTURE_ALIGN - 1) & ~(uint64_t) (FG_CAPTURE_ALIGN - 1))
+
+static inline uint64_t
+record_size (const struct fg_capture_record *rec)
+{
+    return ALIGN_UP (sizeof (struct fg_capture_record) + rec->len);
+}
+
+/* Helper function to tell whether a file holds a ring of the given size
+   which may be written on from where it was left */
+static int
+ring_matches (int fd, size_t file_size, size_t header_size, uint64_t data_size)
+{
+    struct fg_capture_header hdr;
+
+    if (file_size != header_size + data_size ||
+        pread (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr))
+        return 0;
+
+    return memcmp (hdr.magic, FG_CAPTURE_MAGIC, sizeof (hdr.magic)) == 0 &&
+           hdr.version == FG_CAPTURE_VERSION &&
+           hdr.header_size == header_size && hdr.data_size == data_size &&
+           hdr.tail <= hdr.head && hdr.head - hdr.tail <= data_size &&
+           hdr.head % FG_CAPTURE_ALIGN == 0 &&
+           hdr.tail % FG_CAPTURE_ALIGN == 0;
+}
+
+/* Helper function to move a file which can not be continued to path.1,
+   replacing an older one */
+static int
+rotate (const char *path)
+{
+    int s;
+    char *old = malloc (strlen (path) + 3);
+
+    if (old == NULL)
+        return -1;
+    sprintf (old, "%s.1", path);
+    s = rename (path, old);
+    free (old);
+
+    return s;
+}
+
+int
+fg_capture_open (struct fg_capture *cap, const char *path, size_t size)
+{
+    int fd, resume;
+    struct stat st;
+    size_t header_size = sysconf (_SC_PAGESIZE);
+    uint64_t data_size = size & ~(uint64_t) (FG_CAPTURE_ALIGN - 1);
+
+    memset (cap, 0, sizeof (struct fg_capture));
+
+    if (data_size < header_size)
+      {
+        errno = EINVAL;
+        return -1;
+      }
+
+    fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    if (fstat (fd, &st) < 0)
+      {
+        close (fd);
+        return -1;
+      }
+
+    /* A restart picks the ring up where it was left, the frames from before
+       are what is looked for after a crash. Anything else is kept aside */
+    resume = ring_matches (fd, st.st_size, header_size, data_size);
+    if (!resume && st.st_size > 0)
+      {
+        close (fd);
+        if (rotate (path) < 0)
+            return -1;
+        fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return -1;
+      }
+
+    cap->map_size = header_size + data_size;
+    if (!resume && ftruncate (fd, cap->map_size) < 0)
+      {
+        close (fd);
+        return -1;
+      }
+
+    /* Populate the mapping up front so capturing does not read pages in on
+       the events thread. Shared pages are mapped read only until written to,
+       the first store to each still faults */
+    cap->hdr = mmap (NULL, cap->map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, 0);
+    close (fd);
+    if (cap->hdr == MAP_FAILED)
+      {
+        cap->hdr = NULL;
+        return -1;
+      }
+    cap->data = (unsigned char *) cap->hdr + header_size;
+
+    if (resume)
+        return 0;
+
+    memcpy (cap->hdr->magic, FG_CAPTURE_MAGIC, sizeof (cap->hdr->magic));
+    cap->hdr->version = FG_CAPTURE_VERSION;
+    cap->hdr->header_size = header_size;
+    cap->hdr->data_size = data_size;
+
+    return 0;
+}
+
+void
+fg_capture_close (struct fg_capture *cap)
+{
+    if (cap->hdr != NULL)
+        munmap (cap->hdr, cap->map_size);
+
+    cap->hdr = NULL;
+    cap->data = NULL;
+}
+
+/* Helper function to evict the oldest records until n more bytes fit */
+static void
+make_room (struct fg_capture *cap, uint64_t n)
+{
+    struct fg_capture_header *hdr = cap->hdr;
+
+    while (hdr->head + n - hdr->tail > hdr->data_size)
+      {
+        const struct fg_capture_record *rec = (const void *)
+            (cap->data + hdr->tail % hdr->data_size);
+        __atomic_store_n (&hdr->tail, hdr->tail + record_size (rec),
+                          __ATOMIC_RELEASE);
+      }
+}
+
+void
+fg_capture_frame (struct fg_capture *cap, int dir, int8_t conn_id,
+                  int8_t user_id, const unsigned char *buf, size_t len)
+{
+    struct timespec ts;
+    struct fg_capture_record *rec;
+    struct fg_capture_header *hdr = cap->hdr;
+    uint64_t need, room;
+
+    if (hdr == NULL)
+        return;
+
+    need = ALIGN_UP (sizeof (struct fg_capture_record) + len);
+    if (need > hdr->data_size)
+      {
+        __atomic_fetch_add (&hdr->dropped, 1, __ATOMIC_RELAXED);
+        return;
+      }
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+
+    /* Frames are rarely written from more than one thread at once, a spin
+       lock is cheaper than anything sleeping */
+    while (__atomic_exchange_n (&cap->lock, 1, __ATOMIC_ACQUIRE))
+        ;
+
+    /* Records don't wrap, pad the rest of the ring and start over */
+    room = hdr->data_size - hdr->head % hdr->data_size;
+    if (room < need)
+      {
+        make_room (cap, room);
+        rec = (struct fg_capture_record *) (cap->data +
+                                            hdr->head % hdr->data_size);
+        memset (rec, 0, sizeof (struct fg_capture_record));
+        rec->len = room - sizeof (struct fg_capture_record);
+        rec->dir = FG_CAPTURE_PAD;
+        __atomic_store_n (&hdr->head, hdr->head + room, __ATOMIC_RELEASE);
+      }
+
+    make_room (cap, need);
+    rec = (struct fg_capture_record *) (cap->data + hdr->head % hdr->data_size);
+    rec->len = len;
+    rec->dir = dir;
+    rec->conn_id = conn_id;
+    rec->user_id = user_id;
+    rec->reserved = 0;
+    rec->ts = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    memcpy (rec + 1, buf, len);
+    __atomic_store_n (&hdr->head, hdr->head + need, __ATOMIC_RELEASE);
+
+    __atomic_store_n (&cap->lock, 0, __ATOMIC_RELEASE);
+}
+
+int
+fg_capture_reader_open (struct fg_capture_reader *reader, const char *path)
+{
+    int fd;
+    struct stat st;
+    const struct fg_capture_header *hdr;
+
+    memset (reader, 0, sizeof (struct fg_capture_reader));
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat (fd, &st) < 0 ||
+        (size_t) st.st_size < sizeof (struct fg_capture_header))
+      {
+        close (fd);
+        errno = EINVAL;
+        return -1;
+      }
+
+    hdr = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (hdr == MAP_FAILED)
+        return -1;
+
+    if (memcmp (hdr->magic, FG_CAPTURE_MAGIC, sizeof (FG_CAPTURE_MAGIC)) ||
+        hdr->version != FG_CAPTURE_VERSION ||
+        (uint64_t) hdr->header_size + hdr->data_size > (uint64_t) st.st_size)
+      {
+        munmap ((void *) hdr, st.st_size);
+        errno = EINVAL;
+        return -1;
+      }
+
+    reader->map_size = st.st_size;
+    reader->hdr = hdr;
+    reader->data = (const unsigned char *) hdr + hdr->header_size;
+    reader->pos = __atomic_load_n (&hdr->tail, __ATOMIC_ACQUIRE);
+
+    return 0;
+}
+
+int
+fg_capture_reader_next (struct fg_capture_reader *reader,
+                        const struct fg_capture_record **record,
+                        const unsigned char **frame)
+{
+    const struct fg_capture_header *hdr = reader->hdr;
+
+    for (;;)
+      {
+        const struct fg_capture_record *rec;
+        uint64_t head = __atomic_load_n (&hdr->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = __atomic_load_n (&hdr->tail, __ATOMIC_ACQUIRE);
+
+        /* The writer overtook us, skip to what is still there */
+        if (reader->pos < tail)
+            reader->pos = tail;
+        if (reader->pos >= head)
+            return 0;
+
+        rec = (const void *) (reader->data + reader->pos % hdr->data_size);
+        if (record_size (rec) > head - reader->pos ||
+            reader->pos % hdr->data_size + record_size (rec) > hdr->data_size)
+          {
+            errno = EINVAL;
+            return -1;
+          }
+        reader->pos += record_size (rec);
+
+        if (rec->dir == FG_CAPTURE_PAD)
+            continue;
+
+        *record = rec;
+        *frame = (const unsigned char *) (rec + 1);
+        return 1;
+      }
+}
+
+void
+fg_capture_reader_close (struct fg_capture_reader *reader)
+{
+    if (reader->hdr != NULL)
+        munmap ((void *) reader->hdr, reader->map_size);
+    reader->hdr = NULL;
+}
@@ -0,0 +1,103 @@
+/*
+ *  capture.h
+ *    The names of functions callable from within event capture
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* A capture file is a header page followed by a ring of records. Records
+   are aligned to FG_CAPTURE_ALIGN bytes and never wrap around the end of
+   the ring, the space left at the end is filled with a padding record.
+   head and tail are positions which only ever grow, the oldest record is
+   found at tail % data_size. All integers are in host byte order */
+#define FG_CAPTURE_MAGIC   "FGCAP01"
+#define FG_CAPTURE_VERSION 1
+#define FG_CAPTURE_ALIGN   16
+
+enum fg_capture_dir {
+    FG_CAPTURE_IN = 1,
+    FG_CAPTURE_OUT,
+    FG_CAPTURE_PAD
+};
+
+struct fg_capture_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;   /* offset of the ring in the file */
+    uint64_t data_size;     /* size of the ring */
+    uint64_t head;          /* position of the next record */
+    uint64_t tail;          /* position of the oldest record */
+    uint64_t dropped;       /* frames larger than the ring */
+};
+
+struct fg_capture_record {
+    uint32_t len;           /* bytes of frame following the record */
+    uint8_t  dir;
+    int8_t   conn_id;
+    int8_t   user_id;
+    uint8_t  reserved;
+    uint64_t ts;            /* CLOCK_REALTIME in nanoseconds */
+};
+
+/* Writer side, owned by the events thread of the capturing process */
+struct fg_capture {
+    size_t                   map_size;
+    struct fg_capture_header *hdr;
+    unsigned char            *data;
+    int                      lock;
+};
+
+/* Reader side, a read only mapping of a capture file */
+struct fg_capture_reader {
+    size_t                   map_size;
+    const struct fg_capture_header *hdr;
+    const unsigned char      *data;
+    uint64_t                 pos;
+};
+
+/* Open a capture file with a ring of the given size. A ring of that size
+   left by an earlier run is written on from its head, any other file at
+   the path is renamed to path.1 first */
+extern int fg_capture_open (struct fg_capture *, const char *, size_t);
+extern void fg_capture_close (struct fg_capture *);
+
+/* Append a frame, the oldest records are overwritten when the ring is
+   full. No system call is made, the frame is copied into the shared
+   mapping and the kernel writes the pages back on its own. The copy may
+   still stall: the first store to a page after it was written back goes
+   through page_mkwrite, which can wait for that writeback or for the
+   filesystem to allocate blocks. Put the file on tmpfs to avoid it */
+extern void fg_capture_frame (struct fg_capture *, int, int8_t, int8_t,
+                              const unsigned char *, size_t);
+
+/* Map a capture file and walk its records from the oldest one. next
+   returns 0 when there are no more records */
+extern int fg_capture_reader_open (struct fg_capture_reader *, const char *);
+extern int fg_capture_reader_next (struct fg_capture_reader *,
+                                   const struct fg_capture_record **,
+                                   const unsigned char **);
+extern void fg_capture_reader_close (struct fg_capture_reader *);
+
+#endif /* _CAPTURE_H_ */
@@ -15,6 +15,17 @@
  *      1 - writeback
  *      4 - length
  *      ? - payload      
+ *      ? - optional extensions, each made up of
+ *            1 - FG_EXT_MARK
+ *            1 - tag
+ *            1 - length n of value
+ *            n - value (integers are little endian)
+ *
+ *    These extensions are known:
+ *
+ *      FG_EXT_SEQ     - 4 - sequence number for session resumption
+ *      FG_EXT_SENT_TS - 8 - time the producer sent the event
+ *      FG_EXT_ECHO_TS - 8 - sent time of the event a writeback answers
  *      1 - ETX
  *      
  *****************************************************************************
@@ -45,6 +56,9 @@
 #include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
 #include <linux/limits.h>
 
 #include <arpa/inet.h>
@@ -61,37 +75,42 @@
 
 #include "fgevents.h"
 #include "list.h"
+#include "fgprobes.h"
+#include "metrics.h"
 
-/* Temporary ugly log error macros before fgutil library is done */
-/* TODO: write fgutil library */
+/* Errors are only recorded where they happen, see fg_report_error */
 #define report_error(etdata, msg)\
-        do\
-          {\
-            etdata->save_errno = errno;\
-            snprintf (etdata->error, sizeof etdata->error,\
-                      "fgevents: %s: %d: %s: %s\n",\
-                      __FILE__, __LINE__, msg, strerror (errno));\
-            etdata->cb (etdata->user_data, NULL, NULL);\
-          } while (0)
+        fg_report_error (etdata, __FILE__, __LINE__, msg, errno, -1)
 
 #define report_error_noen(etdata, msg)\
-        do\
-          {\
-            etdata->save_errno = 0;\
-            snprintf (etdata->error, sizeof etdata->error,\
-                      "fgevents: %s: %d: %s\n",\
-                      __FILE__, __LINE__, msg);\
-            etdata->cb (etdata->user_data, NULL, NULL);\
-          } while (0)
+        fg_report_error (etdata, __FILE__, __LINE__, msg, 0, -1)
 
 #define report_error_en(etdata, en, msg)\
-        do { errno = en;report_error (etdata, msg); } while (0)
+        fg_report_error (etdata, __FILE__, __LINE__, msg, en, -1)
+
+#define report_client_error(client, msg)\
+        fg_report_error (client->itdata, __FILE__, __LINE__, msg, errno,\
+                         client->user_id)
+
+/* Counters may be bumped from the events thread and from threads calling
+   fg_send_event at the same time, relaxed ordering is all they need */
+#define stat_add(counter, n)\
+        __atomic_fetch_add (&(counter), (n), __ATOMIC_RELAXED)
+#define stat_sub(counter, n)\
+        __atomic_fetch_sub (&(counter), (n), __ATOMIC_RELAXED)
+#define stat_get(counter)\
+        __atomic_load_n (&(counter), __ATOMIC_RELAXED)
+
+/* How long the listeners stop accepting when out of descriptors */
+#define FG_ACCEPT_BACKOFF_MS 100
 
 /* Forward declarations used in this file. */
 static void fg_dispatch_event (struct fg_events_data *itdata,
-                               struct bufferevent *bev, struct fgevent *fgev);
+                               struct bufferevent *bev, struct fgevent *fgev,
+                               const struct fg_frame_ext *ext);
 static void fg_handle_new_event (struct fg_events_data *,
-                                 struct bufferevent *, struct fgevent *);
+                                 struct bufferevent *, struct fgevent *,
+                                 const struct fg_frame_ext *);
 static void fg_handle_new_conn_event (struct fg_events_data *,
                                       struct bufferevent *, struct fgevent *);
 static void fg_handle_conn_confirm_event (struct fg_events_data *itdata,
@@ -104,33 +123,229 @@ static void fg_handle_ping_event (struct fg_events_data *,
 static void fg_handle_ping_confirmed_event (struct fg_events_data *,
                                             struct fgevent *);
 static int fg_send_event_bev (struct fg_events_data *, struct bufferevent *,
-                              struct fgevent *);
+                              struct fgevent *, const struct fg_frame_ext *);
+static int fg_send_event_client (struct fg_events_data *, struct client_t *,
+                                 struct fgevent *,
+                                 const struct fg_frame_ext *);
 static int fg_send_data_bev (struct fg_events_data *, struct bufferevent *,
                              unsigned char *, size_t);
 
 static int fg_send_connected_event (struct fg_events_data *);
 static int fg_send_disconnected_event (struct fg_events_data *);
 static int fg_send_confirmed_event (struct fg_events_data *,
-                                    struct bufferevent *, int8_t);
+                                    struct bufferevent *, int8_t, uint32_t);
 
 static struct client_t *get_client_by_user_id (struct fg_events_data *,
                                                int8_t);
-static struct client_t *get_client_by_conn_id (struct fg_events_data *,
-                                               int8_t);
+static struct client_t *get_client_by_bev (struct bufferevent *);
+
+static void track_output (struct client_t *);
+static void untrack_output (struct client_t *);
+static void close_uring (struct client_t *);
+static void throttle_producer (struct fg_events_data *, struct bufferevent *,
+                               struct client_t *);
 
 static int add_client (struct fg_events_data *, struct bufferevent *,
                        struct client_t **, int8_t);
 static void remove_client (struct client_t *);
+static void destroy_client (struct client_t *);
+static void suspend_client (struct client_t *);
+static bool resume_client (struct fg_events_data *, struct client_t *,
+                           struct client_t *, uint32_t);
 
-static void client_event_loop (struct fg_events_data *);
+static void fg_client_connect (struct fg_events_data *);
+static void fg_client_disconnect (struct fg_events_data *);
+static void fg_schedule_reconnect (struct fg_events_data *);
+static void fg_init_done (struct fg_events_data *);
 
 static int fg_events_server_setup_inet (struct fg_events_data *,
                                         struct evconnlistener **, uint16_t);
 static int fg_events_server_setup_unix (struct fg_events_data *,
-                                        struct evconnlistener **, char *);
+                                        struct evconnlistener **,
+                                        const char *, evconnlistener_cb);
 
 static void fg_exit_cb (evutil_socket_t, short, void *);
 static void fg_ping_cb (evutil_socket_t, short, void *);
+static void fg_reconnect_cb (evutil_socket_t, short, void *);
+static void fg_linger_cb (evutil_socket_t, short, void *);
+static void fg_drain_cb (evutil_socket_t, short, void *);
+static void fg_error_cb (evutil_socket_t, short, void *);
+static void fg_heartbeat_cb (evutil_socket_t, short, void *);
+static void fg_stop_cb (evutil_socket_t, short, void *);
+static void fg_loop_exit (struct fg_events_data *, const struct timeval *);
+static void fg_check_drained (struct fg_events_data *);
+static bool fg_check_memory (struct fg_events_data *, struct client_t *);
+
+/* Helper functions for the error ring, a bounded queue where every slot
+   carries a sequence number telling whether it is free for the producer
+   at tail or filled for the consumer at head */
+static void
+error_ring_init (struct fg_error_ring *ring)
+{
+    ring->head = 0;
+    ring->tail = 0;
+    for (uint32_t i = 0; i < FG_ERROR_RING_SIZE; i++)
+        ring->slots[i].seq = i;
+}
+
+static bool
+error_ring_push (struct fg_error_ring *ring, const struct fg_error *error)
+{
+    struct fg_error_slot *slot;
+    uint32_t pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+
+    for (;;)
+      {
+        int32_t diff;
+
+        slot = &ring->slots[pos & (FG_ERROR_RING_SIZE - 1)];
+        diff = (int32_t) (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) -
+                          pos);
+        if (diff == 0)
+          {
+            if (__atomic_compare_exchange_n (&ring->tail, &pos, pos + 1, true,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED))
+                break;
+          }
+        else if (diff < 0)
+          {
+            return false; // full
+          }
+        else
+          {
+            pos = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+          }
+      }
+
+    slot->error = *error;
+    __atomic_store_n (&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static bool
+error_ring_empty (struct fg_error_ring *ring)
+{
+    return __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE) ==
+           __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static bool
+error_ring_pop (struct fg_error_ring *ring, struct fg_error *error)
+{
+    struct fg_error_slot *slot;
+    uint32_t pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+
+    for (;;)
+      {
+        int32_t diff;
+
+        slot = &ring->slots[pos & (FG_ERROR_RING_SIZE - 1)];
+        diff = (int32_t) (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) -
+                          (pos + 1));
+        if (diff == 0)
+          {
+            if (__atomic_compare_exchange_n (&ring->head, &pos, pos + 1, true,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED))
+                break;
+          }
+        else if (diff < 0)
+          {
+            return false; // empty
+          }
+        else
+          {
+            pos = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+          }
+      }
+
+    *error = slot->error;
+    __atomic_store_n (&slot->seq, pos + FG_ERROR_RING_SIZE, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/* Record an error and have it handed out later on from the events thread.
+   This may run on any thread and in the middle of an error storm, so it
+   neither formats nor allocates and wakes the events thread only once for
+   a batch of errors */
+static void
+fg_report_error (struct fg_events_data *etdata, const char *file, int line,
+                 const char *msg, int errnum, int8_t user_id)
+{
+    struct fg_error error;
+
+    error.msg = msg;
+    error.file = file;
+    error.line = line;
+    error.errnum = errnum;
+    error.user_id = user_id;
+
+    etdata->save_errno = errnum;
+    stat_add (etdata->stats.errors, 1);
+    if (!error_ring_push (&etdata->errors, &error))
+        stat_add (etdata->stats.errors_dropped, 1);
+
+    /* The base of an embedded instance may not be thread safe, errors from
+       other threads like the watchdog are raised by the heartbeat */
+    if (etdata->embedded && !pthread_equal (pthread_self (), etdata->events_t))
+        return;
+
+    if (etdata->errev != NULL &&
+        !__atomic_exchange_n (&etdata->error_pending, true, __ATOMIC_ACQ_REL))
+        event_active (etdata->errev, EV_WRITE, 0);
+}
+
+/* Helper functions to remember which user ids were dropped by the liveness
+   check after their client_t has been freed, so senders are still told that
+   the user is offline */
+static inline void
+set_user_dropped (struct fg_events_data *itdata, int8_t user_id, bool dropped)
+{
+    uint8_t bit = (uint8_t) user_id;
+
+    if (dropped)
+        itdata->dropped_users[bit / 8] |= 1 << (bit % 8);
+    else
+        itdata->dropped_users[bit / 8] &= ~(1 << (bit % 8));
+}
+
+static inline bool
+is_user_dropped (struct fg_events_data *itdata, int8_t user_id)
+{
+    uint8_t bit = (uint8_t) user_id;
+
+    return itdata->dropped_users[bit / 8] & (1 << (bit % 8));
+}
+
+/* Helper functions to account for input being handled. The whole read is
+   copied out of the input buffer and each parsed payload is a separate
+   allocation, both are held until the read callback is done with them */
+static inline void
+charge_input (struct fg_events_data *itdata, struct client_t *holder,
+              size_t n)
+{
+    stat_add (itdata->stats.input_queued, n);
+    stat_add (holder->stats.input_queued, n);
+}
+
+static inline void
+release_input (struct fg_events_data *itdata, struct client_t *holder,
+               size_t n)
+{
+    stat_sub (itdata->stats.input_queued, n);
+    stat_sub (holder->stats.input_queued, n);
+}
+
+static inline uint64_t
+mem_used (struct fg_events_data *itdata)
+{
+    return stat_get (itdata->stats.output_queued) +
+           stat_get (itdata->stats.input_queued) +
+           stat_get (itdata->stats.resume_bytes);
+}
 
 /* Helper function to set tcp no delay on socket to disable
    packet-accumulation delay */
@@ -140,6 +355,26 @@ static void set_tcp_no_delay (evutil_socket_t fd)
     setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
 }
 
+/* Helper function to have the socket polled by the kernel while reading
+   instead of waiting for the interrupt. Raising it above the
+   net.core.busy_read sysctl needs CAP_NET_ADMIN */
+static void
+set_busy_poll (struct fg_events_data *itdata, evutil_socket_t fd)
+{
+    int usec = itdata->opts.busy_poll_usec;
+
+    if (usec == 0)
+        return;
+
+#ifdef SO_BUSY_POLL
+    if (setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof usec) < 0)
+        fg_log_debug (itdata, "could not set SO_BUSY_POLL: %s",
+                      strerror (errno));
+#else
+    fg_log_debug (itdata, "SO_BUSY_POLL is not supported");
+#endif
+}
+
 /* Helper functions to suppress and restore SIGPIPE */
 
 static inline void
@@ -185,6 +420,28 @@ restore_sigpipe (struct fg_events_data *etdata)
       }
 }
 
+/* Helper function to keep SIGPIPE from killing the process when libevent
+   writes to a socket closed by the peer. The signal is directed to the
+   writing thread, so blocking it in the events thread is enough */
+static void
+block_sigpipe (void)
+{
+    sigset_t mask;
+
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &mask, NULL);
+}
+
+/* Helper function for the options of the bufferevents of a connection.
+   Embedded instances are only used from the thread running the base so
+   there is nothing to lock */
+static inline int
+bev_options (struct fg_events_data *itdata)
+{
+    return BEV_OPT_CLOSE_ON_FREE | (itdata->embedded ? 0 : BEV_OPT_THREADSAFE);
+}
+
 /* Helper function to allocate memory for buffer and copy evbuffer to it */
 static ssize_t
 copy_evbuffer_into_buffer (struct evbuffer *evbuf, unsigned char **buf)
@@ -205,13 +462,258 @@ copy_evbuffer_into_buffer (struct evbuffer *evbuf, unsigned char **buf)
     return len;
 }
 
+/* Helper functions to read and write little endian integers of frame
+   extensions independently of host byte order */
+static inline void
+put_le32 (unsigned char *ptr, uint32_t value)
+{
+    ptr[0] = value & 0xff;
+    ptr[1] = (value >> 8) & 0xff;
+    ptr[2] = (value >> 16) & 0xff;
+    ptr[3] = (value >> 24) & 0xff;
+}
+
+static inline uint32_t
+get_le32 (const unsigned char *ptr)
+{
+    return (uint32_t) ptr[0] | (uint32_t) ptr[1] << 8 |
+           (uint32_t) ptr[2] << 16 | (uint32_t) ptr[3] << 24;
+}
+
+static inline void
+put_le64 (unsigned char *ptr, uint64_t value)
+{
+    put_le32 (ptr, value & 0xffffffff);
+    put_le32 (ptr + 4, value >> 32);
+}
+
+static inline uint64_t
+get_le64 (const unsigned char *ptr)
+{
+    return (uint64_t) get_le32 (ptr) | (uint64_t) get_le32 (ptr + 4) << 32;
+}
+
+/* Helper functions to read the clocks in nanoseconds. Timestamps sent to
+   other hosts use the wall clock, anything measured locally the monotonic
+   one */
+static inline uint64_t
+realtime_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t
+timeval_ns (const struct timeval *tv)
+{
+    return (uint64_t) tv->tv_sec * 1000000000 + (uint64_t) tv->tv_usec * 1000;
+}
+
+/* Helper function to record the time elapsed since a timestamp taken on
+   the wall clock, which may have been stepped backwards since */
+static inline void
+record_since (struct fg_hist *hist, uint64_t then, uint64_t now)
+{
+    fg_hist_record (hist, now > then ? now - then : 0);
+}
+
+/* Size of STX and the header of a frame */
+#define FG_FRAME_HEADER_SIZE (1 + FGEVENT_HEADER_SIZE)
+
+/* Helper function to read the size of STX, header and payload announced by
+   the header of the frame starting at STX ptr, which holds at least
+   FG_FRAME_HEADER_SIZE bytes. Returns -1 when the announced length can't be
+   right. The length is the last field of the header, written in host byte
+   order */
+static ssize_t
+frame_announced_size (const unsigned char *ptr)
+{
+    int32_t length;
+
+    memcpy (&length, ptr + FG_FRAME_HEADER_SIZE - sizeof (length),
+            sizeof (length));
+    if (length < 0 || length > FG_MAX_PAYLOAD_LENGTH)
+        return -1;
+
+    return FG_FRAME_HEADER_SIZE + (size_t) length * sizeof (int32_t);
+}
+
+/* Helper function to check the header of the frame starting at STX ptr.
+   Returns the size of STX, header and payload, 0 when fewer than avail
+   bytes are there, or -1 when the announced length can't be right */
+static ssize_t
+frame_body_size (const unsigned char *ptr, size_t avail)
+{
+    ssize_t size;
+
+    if (avail < FG_FRAME_HEADER_SIZE)
+        return 0;
+
+    size = frame_announced_size (ptr);
+    if (size < 0)
+        return -1;
+
+    return avail < (size_t) size ? 0 : size;
+}
+
+/* Helper function to find the end of the frame starting at STX ptr, given
+   avail bytes. Returns the size of the frame up to and including ETX, 0
+   when the rest of it is still on its way, or -1 when the header is
+   corrupt. When more is needed, *need is set to the least number of bytes
+   from ptr which could make up the frame */
+static ssize_t
+frame_size (const unsigned char *ptr, size_t avail, size_t *need)
+{
+    ssize_t size;
+    const unsigned char *cur, *end = ptr + avail;
+
+    size = frame_body_size (ptr, avail);
+    if (size < 0)
+        return size;
+    if (size == 0)
+      {
+        /* Wait for the whole payload and ETX at once */
+        *need = avail < FG_FRAME_HEADER_SIZE ? FG_FRAME_HEADER_SIZE
+                                             : frame_announced_size (ptr) + 1;
+        return 0;
+      }
+
+    /* An extension cut short means more is coming, otherwise skip to ETX
+       like fg_parse_fgevent does */
+    cur = ptr + size;
+    while (end - cur >= 3 && cur[0] == FG_EXT_MARK && end - cur >= 3 + cur[2])
+        cur += 3 + cur[2];
+    if (cur < end && cur[0] == FG_EXT_MARK)
+      {
+        *need = (cur - ptr) + 3 + (end - cur >= 3 ? cur[2] : 0) + 1;
+        return 0;
+      }
+    while (cur < end && cur[0] != 0x03) // ETX
+        cur++;
+    if (cur == end)
+      {
+        *need = avail + 1;
+        return 0;
+      }
+
+    return cur + 1 - ptr;
+}
+
+/* Helper function to decode the extensions following the payload. Unknown
+   tags are skipped so that readers parse frames of newer versions. Readers
+   predating extensions expect ETX right after the payload and trip over the
+   raw values, so extensions are only sent to peers which negotiated them:
+   clients announcing the resume fields in FG_CONNECTED, and servers sending
+   the token field in FG_CONFIRMED */
+static unsigned char *
+parse_frame_ext (struct fg_frame_ext *ext, unsigned char *ptr,
+                 unsigned char *end)
+{
+    while (end - ptr >= 3 && ptr[0] == FG_EXT_MARK && end - ptr >= 3 + ptr[2])
+      {
+        unsigned char tag = ptr[1];
+        unsigned char n = ptr[2];
+
+        if (ext != NULL && tag == FG_EXT_SEQ && n == 4)
+          {
+            ext->seq = get_le32 (ptr + 3);
+            ext->flags |= FG_EXT_HAS_SEQ;
+          }
+        else if (ext != NULL && tag == FG_EXT_SENT_TS && n == 8)
+          {
+            ext->sent_ts = get_le64 (ptr + 3);
+            ext->flags |= FG_EXT_HAS_SENT_TS;
+          }
+        else if (ext != NULL && tag == FG_EXT_ECHO_TS && n == 8)
+          {
+            ext->echo_ts = get_le64 (ptr + 3);
+            ext->flags |= FG_EXT_HAS_ECHO_TS;
+          }
+
+        ptr += 3 + n;
+      }
+
+    return ptr;
+}
+
+static size_t
+frame_ext_size (const struct fg_frame_ext *ext)
+{
+    size_t nbytes = 0;
+
+    if (ext == NULL)
+        return 0;
+
+    if (ext->flags & FG_EXT_HAS_SEQ)
+        nbytes += 3 + 4;
+    if (ext->flags & FG_EXT_HAS_SENT_TS)
+        nbytes += 3 + 8;
+    if (ext->flags & FG_EXT_HAS_ECHO_TS)
+        nbytes += 3 + 8;
+
+    return nbytes;
+}
+
+static void
+write_frame_ext (unsigned char *ptr, const struct fg_frame_ext *ext)
+{
+    if (ext == NULL)
+        return;
+
+    if (ext->flags & FG_EXT_HAS_SEQ)
+      {
+        ptr[0] = FG_EXT_MARK;
+        ptr[1] = FG_EXT_SEQ;
+        ptr[2] = 4;
+        put_le32 (ptr + 3, ext->seq);
+        ptr += 3 + 4;
+      }
+    if (ext->flags & FG_EXT_HAS_SENT_TS)
+      {
+        ptr[0] = FG_EXT_MARK;
+        ptr[1] = FG_EXT_SENT_TS;
+        ptr[2] = 8;
+        put_le64 (ptr + 3, ext->sent_ts);
+        ptr += 3 + 8;
+      }
+    if (ext->flags & FG_EXT_HAS_ECHO_TS)
+      {
+        ptr[0] = FG_EXT_MARK;
+        ptr[1] = FG_EXT_ECHO_TS;
+        ptr[2] = 8;
+        put_le64 (ptr + 3, ext->echo_ts);
+        ptr += 3 + 8;
+      }
+}
+
 int
 fg_parse_fgevent (struct fgevent *fgev, unsigned char *buffer,
                size_t len, unsigned char **p)
+{
+    return fg_parse_fgevent_ext (fgev, NULL, buffer, len, p);
+}
+
+int
+fg_parse_fgevent_ext (struct fgevent *fgev, struct fg_frame_ext *ext,
+                      unsigned char *buffer, size_t len, unsigned char **p)
 {
     int s;
     unsigned char *ptr = *p;
 
+    if (ext != NULL)
+        memset (ext, 0, sizeof (struct fg_frame_ext));
+
     while ((size_t)(ptr - buffer) < len && ptr[0] != 0x02) // STX
             ptr++;
 
@@ -222,12 +724,29 @@ fg_parse_fgevent (struct fgevent *fgev, unsigned char *buffer,
         return 0;
       }
 
+    /* Never read past the buffer, a frame cut short is as good as none and
+       a corrupt length is skipped to find the next STX */
+    s = frame_body_size (ptr, len - (ptr - buffer));
+    if (s == 0)
+      {
+        *p = buffer + len;
+        return 0;
+      }
+    else if (s < 0)
+      {
+        memset (fgev, 0, sizeof (struct fgevent));
+        *p = ptr + 1;
+        return -1;
+      }
+
     /* Deserialize fgevent to fgev struct. If it fails to allocate memory we
        increment by payload length */
     ptr = deserialize_fgevent (++ptr, fgev);
     s = fgev->length > 0 && !fgev->payload;
     if (s)
         ptr += fgev->length * sizeof (fgev->payload[0]);
+    else
+        ptr = parse_frame_ext (ext, ptr, buffer + len);
 
     while ((size_t)(ptr - buffer) < len && ptr[0] != 0x03) // ETX
         ptr++;
@@ -242,14 +761,24 @@ fg_parse_fgevent (struct fgevent *fgev, unsigned char *buffer,
 
 int
 create_serialized_fgevent_buffer (unsigned char **buf, struct fgevent *fgev)
+{
+    return create_serialized_fgevent_buffer_ext (buf, fgev, NULL);
+}
+
+int
+create_serialized_fgevent_buffer_ext (unsigned char **buf,
+                                      struct fgevent *fgev,
+                                      const struct fg_frame_ext *ext)
 {
     unsigned char *buffer;    
-    size_t nbytes;
+    size_t nbytes, ext_offset;
 
     nbytes = 2; // for STX and ETX delimiter
     nbytes += FGEVENT_HEADER_SIZE;
     if (fgev->length > 0)
         nbytes += fgev->length * sizeof (fgev->payload[0]);
+    ext_offset = nbytes - 1;
+    nbytes += frame_ext_size (ext);
 
     buffer = malloc (nbytes);
     if (!buffer)
@@ -257,6 +786,7 @@ create_serialized_fgevent_buffer (unsigned char **buf, struct fgevent *fgev)
 
     buffer[0] = 0x02; // STX
     serialize_fgevent (buffer+1, fgev);
+    write_frame_ext (buffer + ext_offset, ext);
     buffer[nbytes-1] = 0x03; // ETX
 
     *buf = buffer;
@@ -264,74 +794,385 @@ create_serialized_fgevent_buffer (unsigned char **buf, struct fgevent *fgev)
     return nbytes;
 }
 
-
+/* Helper function to add the time of a callback to the entry of its event
+   id, only the events thread writes to the table */
 static void
-fg_read_cb (struct bufferevent *bev, void *arg)
+record_callback (struct fg_events_data *itdata, int32_t id, uint64_t elapsed)
 {
-    ssize_t s;
-    size_t len;
-    unsigned char *buffer, *ptr;
-    struct client_t *holder = arg;
-    struct fg_events_data *itdata = holder->itdata;
+    struct fg_callback_slot *slot = NULL;
+    uint32_t hash = (uint32_t) id * 2654435761u;
 
-    s = copy_evbuffer_into_buffer (bufferevent_get_input (bev), &buffer);
-    if (s < 0)
+    for (int i = 0; i < FG_CALLBACK_STATS_SIZE; i++)
       {
-        report_error (itdata, "in function fg_read_cb malloc failed");
-        return;
+        struct fg_callback_slot *cur =
+            &itdata->cb_stats[(hash + i) & (FG_CALLBACK_STATS_SIZE - 1)];
+        if (!cur->used)
+          {
+            cur->stats.id = id;
+            __atomic_store_n (&cur->used, true, __ATOMIC_RELEASE);
+            slot = cur;
+            break;
+          }
+        if (cur->stats.id == id)
+          {
+            slot = cur;
+            break;
+          }
       }
-    len = s;
-    
-    if (itdata->read_cb != NULL)
+
+    if (timerisset (&itdata->opts.callback_warn) &&
+        elapsed > timeval_ns (&itdata->opts.callback_warn))
       {
-        itdata->read_cb (buffer, s, itdata->user_data);
+        stat_add (itdata->stats.slow_callbacks, 1);
+        if (slot != NULL)
+            stat_add (slot->stats.slow, 1);
+        fg_log_warn (itdata, "callback for event %d took %llu us", id,
+                     (unsigned long long) elapsed / 1000);
       }
-    else
-      {
-        ptr = buffer;
-        while ((size_t)(ptr - buffer) < len)
-          {        
-            struct fgevent fgev;
 
-            s = fg_parse_fgevent (&fgev, buffer, len, &ptr);
-            if (s < 0)
-              {
-                report_error (itdata,
-                              "in function fg_read_cb parse_fgevent failed");
-                continue;
-              }
-            else if (s == 0) // empty event
-              {
-                continue;
-              }
+    if (slot == NULL)
+        return;
 
-            fg_handle_new_event (itdata, bev, &fgev);
-            
-            if (fgev.length > 0)
-                free (fgev.payload);
-          }
+    stat_add (slot->stats.count, 1);
+    stat_add (slot->stats.total_ns, elapsed);
+    if (elapsed > stat_get (slot->stats.max_ns))
+        __atomic_store_n (&slot->stats.max_ns, elapsed, __ATOMIC_RELAXED);
+}
+
+/* Run the event callback, timing it when callbacks are watched. The event
+   id is published so the watchdog can tell which handler is stuck */
+static int
+fg_run_cb (struct fg_events_data *itdata, struct fgevent *fgev,
+           struct fgevent *ansev)
+{
+    int writeback;
+    uint64_t start;
+
+    itdata->cb_depth++;
+    if (!timerisset (&itdata->opts.callback_warn) &&
+        !timerisset (&itdata->opts.watchdog_timeout))
+      {
+        writeback = itdata->cb (itdata->user_data, fgev, ansev);
+        itdata->cb_depth--;
+        return writeback;
       }
 
-    free (buffer);
+    __atomic_store_n (&itdata->cb_event_id, fgev->id, __ATOMIC_RELAXED);
+    __atomic_store_n (&itdata->in_callback, true, __ATOMIC_RELEASE);
+    start = monotonic_ns ();
+
+    writeback = itdata->cb (itdata->user_data, fgev, ansev);
+
+    record_callback (itdata, fgev->id, monotonic_ns () - start);
+    __atomic_store_n (&itdata->in_callback, false, __ATOMIC_RELEASE);
+    itdata->cb_depth--;
+
+    return writeback;
 }
 
-static void
-fg_handle_new_event (struct fg_events_data *itdata, struct bufferevent *bev,
-                     struct fgevent *fgev)
+/* The watchdog runs on its own thread and checks that the events thread
+   keeps bumping its heartbeat, which it does from a timer firing four
+   times per timeout */
+static void *
+watchdog_thread_start (void *param)
 {
-    struct fgevent ansev;
-    int writeback;
+    bool stalled = false;
+    struct fg_events_data *itdata = param;
+    uint64_t timeout = timeval_ns (&itdata->opts.watchdog_timeout);
+    uint64_t interval = timeout / 4;
 
-    if (!itdata->is_server || fgev->receiver == itdata->user_id)
+    for (;;)
       {
-        writeback = itdata->cb (itdata->user_data, fgev, &ansev);
-        if (writeback)
+        struct timespec ts;
+        uint64_t age;
+
+        clock_gettime (CLOCK_REALTIME, &ts);
+        ts.tv_sec += interval / 1000000000;
+        ts.tv_nsec += interval % 1000000000;
+        if (ts.tv_nsec >= 1000000000)
           {
-            if (itdata->is_server)
-              {
-                fg_dispatch_event (itdata, NULL, &ansev);
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+          }
+        if (sem_timedwait (&itdata->watchdog_stop, &ts) == 0)
+            break;
+
+        age = monotonic_ns () -
+              __atomic_load_n (&itdata->heartbeat_ns, __ATOMIC_RELAXED);
+        if (age <= timeout)
+          {
+            stalled = false;
+            continue;
+          }
+
+        /* Report a stall once, not on every check while it lasts */
+        if (!stalled)
+          {
+            int32_t id = -1;
+
+            stalled = true;
+            if (__atomic_load_n (&itdata->in_callback, __ATOMIC_ACQUIRE))
+                id = __atomic_load_n (&itdata->cb_event_id, __ATOMIC_RELAXED);
+
+            stat_add (itdata->stats.loop_stalls, 1);
+            report_error_noen (itdata, "events loop stalled");
+            if (itdata->opts.stall_cb != NULL)
+                itdata->opts.stall_cb (itdata->user_data, id, age);
+          }
+      }
+
+    return NULL;
+}
+
+static void
+fg_setup_heartbeat (struct fg_events_data *itdata)
+{
+    struct timeval interval;
+    uint64_t ns;
+
+    if (!timerisset (&itdata->opts.watchdog_timeout))
+        return;
+
+    ns = timeval_ns (&itdata->opts.watchdog_timeout) / 4;
+    interval.tv_sec = ns / 1000000000;
+    interval.tv_usec = ns % 1000000000 / 1000;
+
+    __atomic_store_n (&itdata->heartbeat_ns, monotonic_ns (),
+                      __ATOMIC_RELAXED);
+    itdata->beatev = event_new (itdata->base, -1, EV_PERSIST, fg_heartbeat_cb,
+                                itdata);
+    if (!itdata->beatev || event_add (itdata->beatev, &interval) < 0)
+        report_error_noen (itdata, "Could not create/add heartbeat event");
+}
+
+static void
+fg_watchdog_start (struct fg_events_data *etdata)
+{
+    int s;
+
+    if (!timerisset (&etdata->opts.watchdog_timeout) || etdata->beatev == NULL)
+        return;
+
+    sem_init (&etdata->watchdog_stop, 0, 0);
+    s = pthread_create (&etdata->watchdog_t, NULL, &watchdog_thread_start,
+                        etdata);
+    if (s != 0)
+      {
+        report_error_en (etdata, s, "Could not create watchdog thread");
+        sem_destroy (&etdata->watchdog_stop);
+        return;
+      }
+    etdata->watchdog_running = true;
+}
+
+static void
+fg_watchdog_stop (struct fg_events_data *etdata)
+{
+    if (!etdata->watchdog_running)
+        return;
+
+    sem_post (&etdata->watchdog_stop);
+    pthread_join (etdata->watchdog_t, NULL);
+    sem_destroy (&etdata->watchdog_stop);
+    etdata->watchdog_running = false;
+}
+
+static void
+fg_read_cb (struct bufferevent *bev, void *arg)
+{
+    ssize_t s;
+    size_t len, need = 0;
+    unsigned char *buffer;
+    struct client_t *holder = arg;
+    struct fg_events_data *itdata = holder->itdata;
+    struct evbuffer *input = bufferevent_get_input (bev);
+
+    /* Input is still read while draining, but thrown away. Closing a socket
+       with unread data would reset the connection and lose our output */
+    if (itdata->draining)
+      {
+        evbuffer_drain (input, evbuffer_get_length (input));
+        release_input (itdata, holder, holder->pending_in);
+        holder->pending_in = 0;
+        return;
+      }
+
+    len = evbuffer_get_length (input);
+
+    /* Everything parsed from this read counts as arriving now */
+    if (itdata->opts.track_latency)
+        itdata->rx_mono_ns = monotonic_ns ();
+
+    /* The start of a frame left in the input last time was counted already */
+    stat_add (itdata->stats.bytes_in, len - holder->pending_in);
+    stat_add (holder->stats.bytes_in, len - holder->pending_in);
+    charge_input (itdata, holder, len - holder->pending_in);
+    
+    if (itdata->read_cb != NULL)
+      {
+        s = copy_evbuffer_into_buffer (input, &buffer);
+        if (s < 0)
+          {
+            report_error (itdata, "in function fg_read_cb malloc failed");
+            return;
+          }
+        fg_capture_frame (&itdata->capture, FG_CAPTURE_IN, holder->conn_id,
+                          holder->user_id, buffer, s);
+        itdata->cb_depth++;
+        itdata->read_cb (buffer, s, itdata->user_data);
+        itdata->cb_depth--;
+        free (buffer);
+      }
+    else
+      {
+        for (;;)
+          {        
+            struct fgevent fgev;
+            struct fg_frame_ext ext;
+            struct evbuffer_ptr stx;
+            unsigned char header[FG_FRAME_HEADER_SIZE];
+            unsigned char *frame, *end;
+            size_t avail, size;
+
+            stx = evbuffer_search (input, "\x02", 1, NULL); // STX
+            if (stx.pos < 0)
+              {
+                evbuffer_drain (input, evbuffer_get_length (input));
+                break;
+              }
+            evbuffer_drain (input, stx.pos);
+            avail = evbuffer_get_length (input);
+
+            /* A frame may be split over many reads. Only its header is
+               looked at until all of it is there, and the loop is not
+               woken up before then */
+            if (avail < FG_FRAME_HEADER_SIZE)
+              {
+                need = FG_FRAME_HEADER_SIZE;
+                break;
+              }
+            evbuffer_copyout (input, header, FG_FRAME_HEADER_SIZE);
+            s = frame_announced_size (header);
+            if (s < 0)
+              {
+                stat_add (itdata->stats.parse_failures, 1);
+                report_error_noen (itdata,
+                                   "in function fg_read_cb corrupt header");
+                evbuffer_drain (input, 1);
+                continue;
+              }
+            if (avail <= (size_t) s)
+              {
+                need = s + 1; // ETX
+                break;
+              }
+
+            /* The payload is complete, what is left are the extensions */
+            frame = evbuffer_pullup (input, avail);
+            if (frame == NULL)
+              {
+                report_error (itdata, "in function fg_read_cb pullup failed");
+                break;
+              }
+            s = frame_size (frame, avail, &need);
+            if (s == 0)
+                break;
+
+            fg_capture_frame (&itdata->capture, FG_CAPTURE_IN,
+                              holder->conn_id, holder->user_id, frame, s);
+
+            end = frame;
+            size = s;
+            s = fg_parse_fgevent_ext (&fgev, &ext, frame, size, &end);
+            evbuffer_drain (input, size);
+            if (s < 0)
+              {
+                stat_add (itdata->stats.parse_failures, 1);
+                report_error (itdata,
+                              "in function fg_read_cb parse_fgevent failed");
+                continue;
+              }
+
+            stat_add (itdata->stats.events_in, 1);
+            stat_add (holder->stats.events_in, 1);
+            FG_PROBE3 (frame_parsed, holder->user_id, fgev.id, fgev.length);
+
+            charge_input (itdata, holder, fgev.length * sizeof (int32_t));
+            fg_handle_new_event (itdata, bev, &fgev, &ext);
+
+            /* Remember the last event seen to be able to resume */
+            if (!itdata->is_server && (ext.flags & FG_EXT_HAS_SEQ))
+                itdata->last_seq = ext.seq;
+            
+            /* Unless the callback took the payload */
+            if (fgev.length > 0)
+                free (fgev.payload);
+            release_input (itdata, holder, fgev.length * sizeof (int32_t));
+          }
+      }
+
+    /* Whatever is left is the start of a frame, don't bother waking up
+       until the rest of it may be there */
+    holder->pending_in = evbuffer_get_length (input);
+    release_input (itdata, holder, len - holder->pending_in);
+    bufferevent_setwatermark (bev, EV_READ,
+                              holder->pending_in > 0 ? need : 0, 0);
+
+    /* The holder may be shed here, do not touch it afterwards */
+    if (itdata->is_server)
+        fg_check_memory (itdata, holder);
+}
+
+static void
+fg_handle_new_event (struct fg_events_data *itdata, struct bufferevent *bev,
+                     struct fgevent *fgev, const struct fg_frame_ext *ext)
+{
+    struct fgevent ansev;
+    struct fg_frame_ext ansext;
+    int writeback;
+
+    if (!itdata->is_server || fgev->receiver == itdata->user_id)
+      {
+        memset (&ansext, 0, sizeof (ansext));
+        if (itdata->opts.track_latency)
+          {
+            uint64_t now = realtime_ns ();
+
+            if (ext->flags & FG_EXT_HAS_SENT_TS)
+                record_since (&itdata->latency[FG_LATENCY_END_TO_END],
+                              ext->sent_ts, now);
+            if (ext->flags & FG_EXT_HAS_ECHO_TS)
+                record_since (&itdata->latency[FG_LATENCY_WRITEBACK],
+                              ext->echo_ts, now);
+
+            /* Answers carry the time of the event they reply to, so the
+               producer measures the round trip on its own clock */
+            if (ext->flags & FG_EXT_HAS_SENT_TS)
+              {
+                ansext.flags |= FG_EXT_HAS_ECHO_TS;
+                ansext.echo_ts = ext->sent_ts;
+              }
+          }
+
+        /* Internal events are looked at again once the callback returns */
+        itdata->cb_event = fgev->id >= ABI ? fgev : NULL;
+        writeback = fg_run_cb (itdata, fgev, &ansev);
+        itdata->cb_event = NULL;
+        if (writeback)
+          {
+            if (itdata->opts.track_latency)
+              {
+                ansext.flags |= FG_EXT_HAS_SENT_TS;
+                ansext.sent_ts = realtime_ns ();
               }
-            else if (fg_send_event_bev (itdata, bev, &ansev) < 0)
+
+            if (itdata->is_server)
+              {
+                fg_dispatch_event (itdata, NULL, &ansev, &ansext);
+              }
+            else if (fg_send_event_bev (itdata, bev, &ansev,
+                                        itdata->self.ext_ok ? &ansext
+                                                            : NULL) < 0)
               {
                 report_error (itdata, "fg_send_event_bev failed");
               }
@@ -347,7 +1188,7 @@ fg_handle_new_event (struct fg_events_data *itdata, struct bufferevent *bev,
       }
     else
       {
-        itdata->cb (itdata->user_data, fgev, &ansev);
+        fg_run_cb (itdata, fgev, &ansev);
 
         // TODO: also check status of sender
         
@@ -361,19 +1202,26 @@ fg_handle_new_event (struct fg_events_data *itdata, struct bufferevent *bev,
           }
         else
           {
-            fg_dispatch_event (itdata, bev, fgev);                        
+            fg_dispatch_event (itdata, bev, fgev, ext);
           }
       }
 }
 
 static void
 fg_dispatch_event (struct fg_events_data *itdata, struct bufferevent *bev,
-                   struct fgevent *fgev)
+                   struct fgevent *fgev, const struct fg_frame_ext *ext)
 {
     struct client_t *client = get_client_by_user_id (itdata,
                                                      fgev->receiver);
+
+    FG_PROBE4 (event_routed, fgev->sender, fgev->receiver, fgev->id,
+               client != NULL ? client->status : -1);
+
     if (client == NULL)
       {
+        stat_add (itdata->stats.dispatch_misses, 1);
+        if (bev != NULL && is_user_dropped (itdata, fgev->receiver))
+            fg_send_offline_event (itdata, bev, fgev);
         /* TODO: if sender requires writeback, send back a FG_NO_SUCH_USER
           event */
         return;
@@ -381,6 +1229,16 @@ fg_dispatch_event (struct fg_events_data *itdata, struct bufferevent *bev,
 
     if (client->status != CONNECTED)
       {
+        /* The session is suspended, keep the event until the client
+           resumes it or the session expires */
+        if (client->bev == NULL && client->sent != NULL)
+          {
+            throttle_producer (itdata, bev, client);
+            if (fg_send_event_client (itdata, client, fgev, ext) < 0)
+                report_error (itdata, "fg_send_event_client failed");
+            return;
+          }
+
         if (bev == NULL)
           {
             // TODO: this is the server dispatching from writeback, send
@@ -393,48 +1251,104 @@ fg_dispatch_event (struct fg_events_data *itdata, struct bufferevent *bev,
         return;
       }
 
-    if (fg_send_event_bev (itdata, client->bev, fgev) < 0)
+    throttle_producer (itdata, bev, client);
+    if (fg_send_event_client (itdata, client, fgev, ext) < 0)
       {
-        report_error (itdata, "fg_send_event_bev failed");
+        report_error (itdata, "fg_send_event_client failed");
+      }
+    else if (itdata->opts.track_latency)
+      {
+        record_since (&itdata->latency[FG_LATENCY_SERVER_HOP],
+                      itdata->rx_mono_ns, monotonic_ns ());
       }
 }
 
 static void
 fg_handle_new_conn_event (struct fg_events_data *itdata,
-                          struct bufferevent * UNUSED(bev),
+                          struct bufferevent *bev,
                           struct fgevent *fgev)
 {
     if (fgev->id == FG_CONNECTED)
       {
-        struct client_t *client = get_client_by_user_id (itdata,
-                                                         fgev->sender);
-        if (client != NULL)
+        struct client_t *client;
+        struct client_t *old = get_client_by_user_id (itdata, fgev->sender);
+        /* Clients supporting resumption send their previous token and the
+           last sequence number seen after the (unused) conn_id */
+        bool can_resume = itdata->opts.resume_window > 0 &&
+                          fgev->length >= 3;
+        bool resumed = false;
+        uint32_t last_seq = can_resume ? (uint32_t) fgev->payload[2] : 0;
+        bool token_ok = can_resume && old != NULL && old->token != 0 &&
+                        old->token == (uint32_t) fgev->payload[1];
+
+        /* A client may reconnect before the server notices its previous
+           connection is gone, the token proves the session is its own */
+        if (old != NULL && old->status == CONNECTED && !token_ok &&
+            old->bev != bev)
           {
-            if (client->status != CONNECTED)
-              {
-                remove_client (client);
-              }
-            else
-              {
-                report_error_noen (client->itdata,
-                                   "in function fg_handle_new_conn_event connection denied");
-                /* TODO: if sender requires writeback, send back a
-                   FG_CONN_DENIED event */
-                return;
-              }            
+            report_error_noen (old->itdata,
+                               "in function fg_handle_new_conn_event connection denied");
+            /* TODO: if sender requires writeback, send back a
+               FG_CONN_DENIED event */
+            return;
           }
 
-        client = get_client_by_conn_id (itdata, fgev->payload[0]);
+        /* The connection is known from the bufferevent, so clients may send
+           FG_CONNECTED right away instead of echoing the conn_id from
+           FG_CONFIRMED first */
+        client = get_client_by_bev (bev);
         if (client == NULL)
           {
             /* TODO: if sender requires writeback, send back a
                FG_NO_SUCH_USER event */
+            if (old != NULL && old->status != CONNECTED)
+                remove_client (old);
             return;
           }
 
+        /* A peer that disconnected may announce itself again on the same
+           connection, there is nothing to take over then */
+        if (old == client)
+            old = NULL;
+
+        if (old != NULL)
+          {
+            if (token_ok && old->sent != NULL)
+                resumed = resume_client (itdata, old, client, last_seq);
+            /* Closes a half-open previous connection as well */
+            remove_client (old);
+          }
+
         client->user_id = fgev->sender;
-        client->conn_id = -1;
         client->status = CONNECTED;
+        client->ext_ok = fgev->length >= 3;
+        set_user_dropped (itdata, client->user_id, false);
+        FG_PROBE2 (connect, client->user_id, resumed);
+
+        if (resumed)
+          {
+            /* Send the gap the client has not seen yet */
+            for (uint32_t seq = last_seq + 1; seq != client->next_seq; seq++)
+              {
+                struct fg_sent_frame *frame =
+                    &client->sent[seq % itdata->opts.resume_window];
+                if (fg_send_data_bev (itdata, client->bev, frame->buf,
+                                      frame->len) < 0)
+                    report_error (itdata, "fg_send_data_bev failed");
+              }
+          }
+        else if (can_resume)
+          {
+            /* Start a new session, numbering continues from what the
+               client has seen so a stale last_seq stays consistent */
+            if (client->sent == NULL)
+                client->sent = calloc (itdata->opts.resume_window,
+                                       sizeof (struct fg_sent_frame));
+            if (client->sent == NULL)
+                report_error (itdata, "in function fg_handle_new_conn_event"
+                                      " calloc failed");
+            client->next_seq = last_seq + 1;
+          }
       }
     else if (fgev->id == FG_DISCONNECTED)
       {
@@ -455,8 +1369,6 @@ static void
 fg_handle_conn_confirm_event (struct fg_events_data *itdata,
                               struct bufferevent *bev, struct fgevent *fgev)
 {
-    ssize_t s;
-
     if (fgev->id != FG_CONFIRMED)
       {
         report_error_noen (itdata,
@@ -471,16 +1383,13 @@ fg_handle_conn_confirm_event (struct fg_events_data *itdata,
         return; 
       }
 
+    /* FG_CONNECTED was already sent when connecting, only remember the
+       token needed to resume this session later on */
     itdata->conn_id = fgev->payload[0];
-
-    s = fg_send_connected_event (itdata);
-    if (s != 0)
-      {
-        report_error (itdata, "fg_send_connected_event failed");
-      }
-
+    itdata->resume_token = fgev->length >= 2 ? (uint32_t) fgev->payload[1] : 0;
+    itdata->self.ext_ok = fgev->length >= 2;
     itdata->connstatus = CONNECTED;
-    sem_post (&itdata->init_flag);
+    itdata->self.status = CONNECTED;
 }
 
 static void
@@ -490,7 +1399,7 @@ fg_handle_ping_confirmed_event (struct fg_events_data *itdata,
   struct client_t *sender = get_client_by_user_id (itdata, fgev->sender);
   if (sender == NULL)
     {
-      fprintf(stdout, "[DEBUG] in function fg_handle_new_event: no such user\n");
+      fg_log_debug (itdata, "ping confirmed by unknown user %d", fgev->sender);
       return;
     }
 
@@ -507,7 +1416,8 @@ fg_send_offline_event (struct fg_events_data *itdata, struct bufferevent *bev,
     ansev.sender = itdata->user_id;
     ansev.receiver = fgev->sender;
     ansev.length = 0;
-    if (fg_send_event_bev (itdata, bev, &ansev) < 0)
+    stat_add (itdata->stats.offline_events, 1);
+    if (fg_send_event_bev (itdata, bev, &ansev, NULL) < 0)
       {
         report_error (itdata, "fg_send_event_bev failed");
       }
@@ -523,19 +1433,28 @@ fg_handle_ping_event (struct fg_events_data *itdata, struct bufferevent *bev,
     ansev.sender = fgev->receiver;
     ansev.receiver = 0;
     ansev.length = 0;
-    if (fg_send_event_bev (itdata, bev, &ansev) < 0)
+    if (fg_send_event_bev (itdata, bev, &ansev, NULL) < 0)
       {
         report_error (itdata, "fg_send_event_bev failed");
       }
 }                      
 
 static void
-fg_write_cb (struct bufferevent *bev, void * UNUSED(arg))
+fg_write_cb (struct bufferevent *bev, void *arg)
 {
+    struct client_t *holder = arg;
+    struct fg_events_data *itdata = holder->itdata;
     //struct evbuffer *output = bufferevent_get_output (bev);
 
     bufferevent_flush (bev, EV_WRITE, BEV_FLUSH);
 
+    /* The holder may be shed here, do not touch it afterwards */
+    if (itdata->mem_paused)
+        fg_check_memory (itdata, holder);
+
+    if (itdata->draining)
+        fg_check_drained (itdata);
+
     /* writeback flushed */
     /*
     if (evbuffer_get_length (output) == 0)
@@ -554,39 +1473,61 @@ fg_event_client_cb (struct bufferevent *bev, short events, void *arg)
 
     if (events & BEV_EVENT_CONNECTED)
       {
-        fprintf(stdout, "[DEBUG] in function fg_event_client_cb: BEV_EVENT_CONNECTED\n");
-        evutil_socket_t fd = bufferevent_getfd (bev);
+        fg_log_debug (itdata, "connected to %s", itdata->addr);
+        evutil_socket_t fd = holder->uring != NULL ?
+                             fg_uring_conn_fd (holder->uring) :
+                             bufferevent_getfd (bev);
         set_tcp_no_delay (fd);
+        set_busy_poll (itdata, fd);
+        itdata->reconnect_attempts = 0;
+        FG_PROBE2 (connect, itdata->user_id, false);
+        fg_init_done (itdata);
       }
     if (events & BEV_EVENT_ERROR)
         report_error (itdata, "in function fg_event_client_cb");
 
+    fg_log_debug (itdata, "client events is %d", events);
+
     if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF))
       {
-        fprintf (stdout, "[DEBUG] in function fg_event_client_cb: freeing event\n");
-        event_base_loopexit (itdata->base, NULL);
-      }
+        fg_log_info (itdata, "connection to %s lost", itdata->addr);
+        FG_PROBE1 (disconnect, itdata->user_id);
+        fg_client_disconnect (itdata);
+        fg_schedule_reconnect (itdata);
 
-    fprintf (stdout, "[DEBUG] client events is %d\n", events);
+        if (itdata->draining)
+            fg_check_drained (itdata);
+      }
 }
 
 static void
 fg_event_server_cb (struct bufferevent * UNUSED(bev), short events, void *arg)
 {
     struct client_t *client = arg;
+    struct fg_events_data *itdata = client->itdata;
 
-    if (events & BEV_EVENT_ERROR)
-      {
-        report_error (client->itdata, "in function fg_event_server_cb");        
-        remove_client (client);
-      }
-    if (events & BEV_EVENT_EOF)
+    fg_log_debug (itdata, "server events is %d", events);
+
+    /* Both flags may be raised at once, make sure the client is only
+       removed (and freed) a single time */
+    if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF))
       {
-        fprintf (stdout, "[DEBUG] in function fg_event_server_cb: got eof from %d\n", client->user_id);        
-        remove_client (client);
-      }
+        if (events & BEV_EVENT_ERROR)
+            report_client_error (client, "in function fg_event_server_cb");
+        else
+            fg_log_info (itdata, "user %d disconnected", client->user_id);
+        FG_PROBE1 (disconnect, client->user_id);
+
+        /* Keep the session of a client which went away without saying
+           goodbye so that it may be resumed */
+        if (client->status == CONNECTED && client->sent != NULL)
+            suspend_client (client);
+        else
+            remove_client (client);
 
-    fprintf (stdout, "[DEBUG] server events is %d\n", events);
+        if (itdata->draining)
+            fg_check_drained (itdata);
+      }
 }
 
 static struct client_t *
@@ -607,20 +1548,14 @@ get_client_by_user_id (struct fg_events_data *itdata, int8_t user_id)
     return NULL;
 }
 
+/* Helper function to look up the client owning a server side bufferevent */
 static struct client_t *
-get_client_by_conn_id (struct fg_events_data *itdata, int8_t conn_id)
+get_client_by_bev (struct bufferevent *bev)
 {
-    for (struct node *cur_head = itdata->clients;
-         cur_head != NULL;
-         cur_head = cur_head->next)
-      {
-        struct client_t *client = cur_head->value;
-        if (client->conn_id == conn_id)
-          {
-            return cur_head->value;
-          }
-      }
-    return NULL;
+    void *client;
+
+    bufferevent_getcb (bev, NULL, NULL, NULL, &client);
+    return client;
 }
 
 static int
@@ -648,6 +1583,7 @@ add_client (struct fg_events_data *itdata, struct bufferevent *bev,
     if (s != 0)
       {
         report_error (itdata, "in function add_client");
+        free (client);
         return -1;
       }
 
@@ -664,97 +1600,503 @@ remove_client (struct client_t *client)
     s = list_remove (&client->itdata->clients, client);
     if (s != 0)
       {
-        report_error (client->itdata, "in function remove_client");
+        report_client_error (client, "in function remove_client");
       }
 
-    bufferevent_free (client->bev);
+    destroy_client (client);
 }
 
 static void
-accept_conn_cb (struct evconnlistener *listener, evutil_socket_t fd,
-                struct sockaddr * UNUSED(address), int UNUSED(socklen),
-                void *arg)
+destroy_client (struct client_t *client)
 {
-    static int8_t conn_tot = 0;
-    int s;
-    struct bufferevent *bev;
-    struct event_base *base;
-    struct client_t *client;
-    struct fg_events_data *itdata = arg;
-
-    base = evconnlistener_get_base (listener);
-    bev = bufferevent_socket_new (base, fd, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
-    s = add_client (itdata, bev, &client, conn_tot);
-    set_tcp_no_delay (fd);
-    evbuffer_enable_locking (bufferevent_get_output (bev), NULL);
+    untrack_output (client);
+    close_uring (client);
+    if (client->bev != NULL)
+        bufferevent_free (client->bev);
+    if (client->lingerev != NULL)
+        event_free (client->lingerev);
 
-    if (s == 0)
+    if (client->sent != NULL)
       {
-        bufferevent_setcb (bev, fg_read_cb, fg_write_cb, fg_event_server_cb, client);
-        bufferevent_enable (bev, EV_READ | EV_WRITE);
+        for (int i = 0; i < client->itdata->opts.resume_window; i++)
+            free (client->sent[i].buf);
+        free (client->sent);
+      }
+    stat_sub (client->itdata->stats.resume_bytes,
+              stat_get (client->stats.resume_bytes));
+    release_input (client->itdata, client, client->pending_in);
 
-        fg_send_confirmed_event (itdata, bev, conn_tot++);
+    free (client);
+}
+
+static void
+fg_output_cb (struct evbuffer * UNUSED(buffer),
+              const struct evbuffer_cb_info *info, void *arg)
+{
+    struct client_t *client = arg;
+
+    if (info->n_added > info->n_deleted)
+      {
+        size_t n = info->n_added - info->n_deleted;
+        stat_add (client->stats.output_queued, n);
+        stat_add (client->itdata->stats.output_queued, n);
       }
-    else
+    else if (info->n_deleted > info->n_added)
       {
-        // TODO: send connection failed event
+        size_t n = info->n_deleted - info->n_added;
+        stat_sub (client->stats.output_queued, n);
+        stat_sub (client->itdata->stats.output_queued, n);
       }
 }
 
+/* Helper functions to keep count of the bytes queued in the output buffer
+   of a connection. What is left when the connection goes away is
+   subtracted since freeing the buffer does not invoke the callback */
 static void
-accept_error_cb (struct evconnlistener *listener, void *arg)
+track_output (struct client_t *client)
 {
-    int err;
-    struct event_base *base;
-    struct fg_events_data *itdata = arg;
+    client->stats.output_queued = 0;
+    client->outcb = evbuffer_add_cb (bufferevent_get_output (client->bev),
+                                     fg_output_cb, client);
+}
 
-    base = evconnlistener_get_base (listener);
-    err = EVUTIL_SOCKET_ERROR ();
-    itdata->save_errno = 0;
-    snprintf (itdata->error, sizeof itdata->error,
-              "fgevents: %s: %d: Error when listening on events (%d): %s\n",
-              __FILE__, __LINE__, err, evutil_socket_error_to_string (err));
-    itdata->cb (itdata->user_data, NULL, NULL);
-    event_base_loopexit (base, NULL);
+static void
+untrack_output (struct client_t *client)
+{
+    struct evbuffer *output;
+
+    if (client->outcb == NULL)
+        return;
+
+    output = bufferevent_get_output (client->bev);
+    evbuffer_lock (output);
+    evbuffer_remove_cb_entry (output, client->outcb);
+    client->outcb = NULL;
+    stat_sub (client->itdata->stats.output_queued,
+              stat_get (client->stats.output_queued));
+    client->stats.output_queued = 0;
+    evbuffer_unlock (output);
 }
 
-static int
-fg_send_connected_event (struct fg_events_data *etdata)
+/* Helper function to give up the io_uring transport of a connection, before
+   its bufferevent is freed */
+static void
+close_uring (struct client_t *client)
 {
-    struct fgevent fgev;
+    if (client->uring == NULL)
+        return;
 
-    int32_t conn_id_payload = (int32_t) etdata->conn_id;
-    fgev.id = FG_CONNECTED;
-    fgev.sender = etdata->user_id;
-    fgev.receiver = 0;
-    fgev.writeback = 0;
-    fgev.length = 1;
-    fgev.payload = &conn_id_payload;
+    fg_uring_conn_close (client->uring);
+    client->uring = NULL;
+}
 
-    if (fg_send_event (etdata, &fgev) < 0)
+/* Helper function to find the client pinning the most memory, which is
+   the slowest consumer or a session kept around for resumption */
+static struct client_t *
+get_largest_client (struct fg_events_data *itdata)
+{
+    uint64_t largest = 0;
+    struct client_t *found = NULL;
+
+    for (struct node *cur_head = itdata->clients;
+         cur_head != NULL;
+         cur_head = cur_head->next)
       {
-        report_error (etdata, "fg_send_connected_event failed");
-        return -1;
+        struct client_t *client = cur_head->value;
+        uint64_t used = stat_get (client->stats.output_queued) +
+                        stat_get (client->stats.resume_bytes);
+
+        if (used > largest)
+          {
+            largest = used;
+            found = client;
+          }
       }
 
-    return 0;
+    return found;
+}
+
+/* Helper function to stop reading from the connection of bev when it sends
+   to a consumer which is congested, so it cannot queue any more for it.
+   Traffic between everybody else keeps flowing */
+static void
+throttle_producer (struct fg_events_data *itdata, struct bufferevent *bev,
+                   struct client_t *consumer)
+{
+    struct client_t *producer;
+
+    if (!consumer->congested || bev == NULL)
+        return;
+
+    producer = get_client_by_bev (bev);
+    if (producer == NULL || producer->mem_paused)
+        return;
+
+    fg_log_debug (itdata, "pausing user %d, user %d is congested",
+                  producer->user_id, consumer->user_id);
+    producer->mem_paused = true;
+    bufferevent_disable (bev, EV_READ);
+}
+
+static void
+resume_producers (struct fg_events_data *itdata)
+{
+    for (struct node *cur_head = itdata->clients;
+         cur_head != NULL;
+         cur_head = cur_head->next)
+      {
+        struct client_t *client = cur_head->value;
+
+        client->congested = false;
+        if (!client->mem_paused)
+            continue;
+        client->mem_paused = false;
+        if (client->bev != NULL)
+            bufferevent_enable (client->bev, EV_READ);
+        if (client->uring != NULL)
+            fg_uring_conn_resume (client->uring);
+      }
+}
+
+/* Enforce opts.mem_budget on the server. Called after every read, since
+   that is where buffers grow, and after writes while reading is paused to
+   pick it up again once the output has drained. Returns true when holder,
+   the client whose callback is running, was shed and freed */
+static bool
+fg_check_memory (struct fg_events_data *itdata, struct client_t *holder)
+{
+    bool shed = false;
+    uint64_t budget = itdata->opts.mem_budget;
+
+    if (budget == 0)
+        return false;
+
+    if (itdata->opts.mem_policy & FG_MEM_SHED)
+      {
+        while (mem_used (itdata) > budget)
+          {
+            struct client_t *client = get_largest_client (itdata);
+            if (client == NULL)
+                break;
+
+            fg_log_warn (itdata, "dropping user %d holding %llu bytes, "
+                         "over the memory budget", client->user_id,
+                         (unsigned long long)
+                         (stat_get (client->stats.output_queued) +
+                          stat_get (client->stats.resume_bytes)));
+            stat_add (itdata->stats.mem_sheds, 1);
+            if (client->status == CONNECTED)
+              {
+                client->status = DROPPED;
+                set_user_dropped (itdata, client->user_id, true);
+              }
+            shed |= client == holder;
+            remove_client (client);
+          }
+      }
+
+    if (!(itdata->opts.mem_policy & FG_MEM_BACKPRESSURE))
+        return shed;
+
+    /* The consumer pinning the most is marked congested, and whoever sends
+       to it next is no longer read from. Resume once usage is well below
+       the budget so a busy server does not flip on every read, or when
+       nothing is left to write since waiting any longer would not free
+       anything */
+    if (mem_used (itdata) > budget)
+      {
+        struct client_t *largest = get_largest_client (itdata);
+
+        if (!itdata->mem_paused)
+          {
+            fg_log_warn (itdata, "over the memory budget, pausing producers");
+            stat_add (itdata->stats.mem_pauses, 1);
+            itdata->mem_paused = true;
+          }
+        if (largest != NULL)
+            largest->congested = true;
+      }
+    else if (itdata->mem_paused &&
+             (mem_used (itdata) <= budget - budget / 4 ||
+              stat_get (itdata->stats.output_queued) == 0))
+      {
+        fg_log_info (itdata, "back under the memory budget, resuming input");
+        itdata->mem_paused = false;
+        resume_producers (itdata);
+      }
+
+    return shed;
+}
+
+static void
+suspend_client (struct client_t *client)
+{
+    struct fg_events_data *itdata = client->itdata;
+
+    untrack_output (client);
+    close_uring (client);
+    bufferevent_free (client->bev);
+    client->bev = NULL;
+    client->status = DISCONNECTED;
+    release_input (itdata, client, client->pending_in);
+    client->pending_in = 0;
+
+    client->lingerev = evtimer_new (itdata->base, fg_linger_cb, client);
+    if (!client->lingerev ||
+        event_add (client->lingerev, &itdata->opts.resume_linger) < 0)
+      {
+        report_error_noen (itdata, "Could not create/add linger event");
+        remove_client (client);
+      }
+}
+
+/* Helper function to hand the session of a suspended client over to its new
+   connection. Fails unless every event after last_seq is still kept */
+static bool
+resume_client (struct fg_events_data *itdata, struct client_t *old,
+               struct client_t *client, uint32_t last_seq)
+{
+    uint32_t window = itdata->opts.resume_window;
+
+    if (old->next_seq - 1 - last_seq > window)
+        return false;
+
+    for (uint32_t seq = last_seq + 1; seq != old->next_seq; seq++)
+      {
+        struct fg_sent_frame *frame = &old->sent[seq % window];
+        if (frame->buf == NULL || frame->seq != seq)
+            return false;
+      }
+
+    client->sent = old->sent;
+    client->next_seq = old->next_seq;
+    client->stats.resume_bytes = old->stats.resume_bytes;
+    old->sent = NULL;
+    old->stats.resume_bytes = 0;
+
+    return true;
+}
+
+static void
+accept_conn_cb (struct evconnlistener *listener, evutil_socket_t fd,
+                struct sockaddr * UNUSED(address), int UNUSED(socklen),
+                void *arg)
+{
+    static int8_t conn_tot = 0;
+    int s;
+    uint32_t token = 0;
+    struct bufferevent *bev;
+    struct event_base *base;
+    struct client_t *client;
+    struct fg_events_data *itdata = arg;
+
+    /* With io_uring the bufferevent only holds the buffers, the socket is
+       handed to the ring once the client is set up */
+    base = evconnlistener_get_base (listener);
+    bev = bufferevent_socket_new (base, itdata->uring != NULL ? -1 : fd,
+                                  bev_options (itdata));
+    if (bev == NULL)
+      {
+        report_error_en (itdata, ENOMEM, "bufferevent_socket_new failed");
+        evutil_closesocket (fd);
+        return;
+      }
+
+    /* The bufferevent or the ring owns the socket from here on, freeing the
+       client closes the connection */
+    s = add_client (itdata, bev, &client, conn_tot);
+    if (s != 0)
+      {
+        // TODO: send connection failed event
+        bufferevent_free (bev);
+        if (itdata->uring != NULL)
+            evutil_closesocket (fd);
+        return;
+      }
+
+    set_tcp_no_delay (fd);
+    set_busy_poll (itdata, fd);
+    if (!itdata->embedded)
+        evbuffer_enable_locking (bufferevent_get_output (bev), NULL);
+    bufferevent_setcb (bev, fg_read_cb, fg_write_cb, fg_event_server_cb, client);
+    bufferevent_enable (bev, EV_READ | EV_WRITE);
+    track_output (client);
+
+    if (itdata->uring != NULL)
+      {
+        client->uring = fg_uring_conn_new (itdata->uring, bev, fd);
+        if (client->uring == NULL)
+          {
+            report_error (itdata, "fg_uring_conn_new failed");
+            evutil_closesocket (fd);
+            remove_client (client);
+            return;
+          }
+      }
+
+    /* The token lets the client resume this session later on. It only
+       guards against resuming someone else's session by mistake and is not
+       meant as authentication */
+    if (itdata->opts.resume_window > 0)
+      {
+        while (token == 0)
+            token = (uint32_t) rand_r (&itdata->rand_seed) << 16 ^
+                    (uint32_t) rand_r (&itdata->rand_seed);
+      }
+    client->token = token;
+
+    fg_send_confirmed_event (itdata, bev, conn_tot++, token);
+}
+
+static void
+accept_resume_cb (evutil_socket_t UNUSED(fd), short UNUSED(what), void *arg)
+{
+    evconnlistener_enable (arg);
+}
+
+static void
+accept_error_cb (struct evconnlistener *listener, void *arg)
+{
+    int err;
+    struct event_base *base;
+    struct fg_events_data *itdata = arg;
+    struct timeval tv = {0, FG_ACCEPT_BACKOFF_MS * 1000};
+
+    base = evconnlistener_get_base (listener);
+    err = EVUTIL_SOCKET_ERROR ();
+    report_error_en (itdata, err, "Error when listening on events");
+
+    /* Out of descriptors or memory during a connection storm, the pending
+       connections stay in the backlog until some are closed. Stop accepting
+       for a while instead of spinning on the readable listener */
+    if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+      {
+        evconnlistener_disable (listener);
+        if (event_base_once (base, -1, EV_TIMEOUT, accept_resume_cb,
+                             listener, &tv) == 0)
+            return;
+      }
+
+    fg_loop_exit (itdata, NULL);
+}
+
+static void
+metrics_error_cb (struct evconnlistener * UNUSED(listener), void *arg)
+{
+    struct fg_events_data *itdata = arg;
+
+    /* Unlike the event listeners this is no reason to stop the server */
+    report_error_en (itdata, EVUTIL_SOCKET_ERROR (),
+                     "Error when listening for metrics");
+}
+
+static void
+fg_metrics_free (struct fg_events_data *itdata, struct bufferevent *bev)
+{
+    list_remove (&itdata->metrics_conns, bev);
+    bufferevent_free (bev);
+}
+
+/* The whole answer is written, the scraper reads it until EOF */
+static void
+fg_metrics_write_cb (struct bufferevent *bev, void *arg)
+{
+    fg_metrics_free (arg, bev);
+}
+
+static void
+fg_metrics_event_cb (struct bufferevent *bev, short events, void *arg)
+{
+    if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF | BEV_EVENT_TIMEOUT))
+        fg_metrics_free (arg, bev);
+}
+
+/* Hand out a snapshot of the metrics to each connection. The snapshot is
+   formatted into the output buffer right away and written as the socket
+   allows, a scraper which stops reading is given up on after a second */
+static void
+metrics_conn_cb (struct evconnlistener *listener, evutil_socket_t fd,
+                 struct sockaddr * UNUSED(address), int UNUSED(socklen),
+                 void *arg)
+{
+    struct bufferevent *bev;
+    struct timeval timeout = { 1, 0 };
+    struct fg_events_data *itdata = arg;
+
+    bev = bufferevent_socket_new (evconnlistener_get_base (listener), fd,
+                                  BEV_OPT_CLOSE_ON_FREE);
+    if (bev == NULL)
+      {
+        report_error_noen (itdata, "Could not create metrics bufferevent");
+        evutil_closesocket (fd);
+        return;
+      }
+
+    if (list_insert (&itdata->metrics_conns, bev) != 0)
+      {
+        report_error (itdata, "in function metrics_conn_cb");
+        bufferevent_free (bev);
+        return;
+      }
+
+    if (fg_metrics_format (itdata, bufferevent_get_output (bev)) < 0)
+      {
+        report_error (itdata, "in function metrics_conn_cb format failed");
+        fg_metrics_free (itdata, bev);
+        return;
+      }
+
+    bufferevent_setcb (bev, NULL, fg_metrics_write_cb, fg_metrics_event_cb,
+                       itdata);
+    bufferevent_set_timeouts (bev, NULL, &timeout);
+    bufferevent_enable (bev, EV_WRITE);
+}
+
+static int
+fg_send_connected_event (struct fg_events_data *etdata)
+{
+    struct fgevent fgev;
+
+    /* The conn_id is not known before FG_CONFIRMED arrives, the server
+       identifies the connection by its socket instead */
+    int32_t payload[3];
+    payload[0] = -1;
+    payload[1] = (int32_t) etdata->resume_token;
+    payload[2] = (int32_t) etdata->last_seq;
+    fgev.id = FG_CONNECTED;
+    fgev.sender = etdata->user_id;
+    fgev.receiver = 0;
+    fgev.writeback = 0;
+    fgev.length = 3;
+    fgev.payload = payload;
+
+    if (fg_send_event (etdata, &fgev) < 0)
+      {
+        report_error (etdata, "fg_send_connected_event failed");
+        return -1;
+      }
+
+    return 0;
 }
 
 static int
 fg_send_confirmed_event (struct fg_events_data *etdata,
-                         struct bufferevent *bev, int8_t conn_id)
+                         struct bufferevent *bev, int8_t conn_id,
+                         uint32_t token)
 {
     struct fgevent fgev;
 
-    int32_t conn_id_payload = (int32_t) conn_id;
+    int32_t payload[2];
+    payload[0] = (int32_t) conn_id;
+    payload[1] = (int32_t) token;
     fgev.id = FG_CONFIRMED;
     fgev.sender = etdata->user_id;
     fgev.receiver = 0;
     fgev.writeback = 1;
-    fgev.length = 1;
-    fgev.payload = &conn_id_payload;
+    fgev.length = 2; // the token field tells clients extensions are parsed
+    fgev.payload = payload;
 
-    if (fg_send_event_bev (etdata, bev, &fgev) < 0)
+    if (fg_send_event_bev (etdata, bev, &fgev, NULL) < 0)
       {
         report_error (etdata, "fg_send_confirmed_event failed");
         return -1;
@@ -785,24 +2127,84 @@ fg_send_disconnected_event (struct fg_events_data *etdata)
 
 static int
 fg_send_event_bev (struct fg_events_data *etdata, struct bufferevent *bev,
-                   struct fgevent *fgev)
+                   struct fgevent *fgev, const struct fg_frame_ext *ext)
 {
     ssize_t s;
     unsigned char *fgbuf;
+    struct client_t *client;
 
     if (etdata->connstatus == DISCONNECTED) return 0;
     
-    s = create_serialized_fgevent_buffer (&fgbuf, fgev);
+    s = create_serialized_fgevent_buffer_ext (&fgbuf, fgev, ext);
     if (s < 0)
         return -1;
 
     s = fg_send_data_bev (etdata, bev, fgbuf, s);    
+    client = get_client_by_bev (bev);
+    if (s == 0 && client != NULL)
+      {
+        stat_add (etdata->stats.events_out, 1);
+        stat_add (client->stats.events_out, 1);
+      }
 
     free (fgbuf);
 
     return s;
 }
 
+/* Send event to a connected client, numbering it and keeping a copy if the
+   client supports session resumption */
+static int
+fg_send_event_client (struct fg_events_data *itdata, struct client_t *client,
+                      struct fgevent *fgev, const struct fg_frame_ext *fwd)
+{
+    ssize_t s;
+    unsigned char *fgbuf;
+    struct fg_frame_ext ext;
+    struct fg_sent_frame *frame;
+
+    /* Timestamps are forwarded as they are, the sequence number belongs to
+       this connection */
+    if (fwd != NULL && client->ext_ok)
+        ext = *fwd;
+    else
+        memset (&ext, 0, sizeof (ext));
+    ext.flags &= ~FG_EXT_HAS_SEQ;
+
+    if (client->sent == NULL)
+        return fg_send_event_bev (itdata, client->bev, fgev, &ext);
+
+    ext.flags |= FG_EXT_HAS_SEQ;
+    ext.seq = client->next_seq++;
+
+    s = create_serialized_fgevent_buffer_ext (&fgbuf, fgev, &ext);
+    if (s < 0)
+        return -1;
+
+    /* The buffer is kept instead of freed, evicting the oldest event */
+    frame = &client->sent[ext.seq % itdata->opts.resume_window];
+    stat_sub (client->stats.resume_bytes, frame->len);
+    stat_sub (itdata->stats.resume_bytes, frame->len);
+    stat_add (client->stats.resume_bytes, s);
+    stat_add (itdata->stats.resume_bytes, s);
+    free (frame->buf);
+    frame->seq = ext.seq;
+    frame->len = s;
+    frame->buf = fgbuf;
+
+    if (client->bev == NULL)
+        return 0;
+
+    s = fg_send_data_bev (itdata, client->bev, fgbuf, s);
+    if (s == 0)
+      {
+        stat_add (itdata->stats.events_out, 1);
+        stat_add (client->stats.events_out, 1);
+      }
+
+    return s;
+}
+
 static int
 fg_send_data_bev (struct fg_events_data *itdata, struct bufferevent *bev,
                   unsigned char *buf, size_t len)
@@ -820,18 +2222,45 @@ fg_send_data_bev (struct fg_events_data *itdata, struct bufferevent *bev,
     restore_sigpipe (itdata);
     evbuffer_unlock (output);
 
+    if (s == 0)
+      {
+        struct client_t *client = get_client_by_bev (bev);
+
+        /* The events thread let go of the connection while the application
+           was writing to it, freeing the bufferevent clears the callbacks
+           and the rest of it goes at the next turn of the loop */
+        if (client == NULL)
+            return 0;
+
+        stat_add (itdata->stats.bytes_out, len);
+        stat_add (client->stats.bytes_out, len);
+        FG_PROBE3 (data_enqueued, client->user_id, len,
+                   stat_get (client->stats.output_queued));
+        fg_capture_frame (&itdata->capture, FG_CAPTURE_OUT, client->conn_id,
+                          client->user_id, buf, len);
+      }
+
     return s;
 }
 
 int
 fg_send_event (struct fg_events_data *etdata, struct fgevent *fgev)
 {
+    struct fg_frame_ext ext;
+
     if (etdata->connstatus == DISCONNECTED) return 0;
 
     // TODO: if we are the server, send the event to ourself
     fgev->sender = etdata->user_id;
 
-    return fg_send_event_bev (etdata, etdata->bev, fgev);
+    if (!etdata->opts.track_latency || !etdata->self.ext_ok)
+        return fg_send_event_bev (etdata, etdata->bev, fgev, NULL);
+
+    memset (&ext, 0, sizeof (ext));
+    ext.flags = FG_EXT_HAS_SENT_TS;
+    ext.sent_ts = realtime_ns ();
+
+    return fg_send_event_bev (etdata, etdata->bev, fgev, &ext);
 }
 
 int
@@ -840,6 +2269,28 @@ fg_send_data (struct fg_events_data *etdata, unsigned char *buf, size_t len)
     return fg_send_data_bev (etdata, etdata->bev, buf, len);
 }
 
+int32_t *
+fg_events_take_payload (struct fg_events_data *etdata, struct fgevent *fgev)
+{
+    int32_t *payload;
+
+    if (fgev == NULL || fgev != etdata->cb_event ||
+        !pthread_equal (pthread_self (), etdata->events_t))
+      {
+        errno = EINVAL;
+        return NULL;
+      }
+
+    /* Empty events come without an allocated payload */
+    if (fgev->length == 0)
+        return NULL;
+
+    payload = fgev->payload;
+    fgev->payload = NULL;
+
+    return payload;
+}
+
 static int
 fg_events_server_setup_inet (struct fg_events_data *itdata,
                              struct evconnlistener **listener, uint16_t port)
@@ -855,7 +2306,7 @@ fg_events_server_setup_inet (struct fg_events_data *itdata,
 
     _listener = evconnlistener_new_bind (itdata->base, &accept_conn_cb, itdata,
                                          LEV_OPT_REUSEABLE |
-                                         LEV_OPT_CLOSE_ON_FREE, -1,
+                                         LEV_OPT_CLOSE_ON_FREE, SOMAXCONN,
                                          (struct sockaddr *) &sin,
                                          sizeof (sin));
     if (_listener == NULL)
@@ -880,7 +2331,8 @@ fg_events_server_setup_inet (struct fg_events_data *itdata,
 
 static int
 fg_events_server_setup_unix (struct fg_events_data *itdata,
-                             struct evconnlistener **listener, char *unix_path)
+                             struct evconnlistener **listener,
+                             const char *unix_path, evconnlistener_cb cb)
 {
     struct sockaddr_un sun;
     struct evconnlistener *_listener;    
@@ -894,9 +2346,9 @@ fg_events_server_setup_unix (struct fg_events_data *itdata,
 
     unlink (unix_path);
 
-    _listener = evconnlistener_new_bind (itdata->base, &accept_conn_cb, itdata,
+    _listener = evconnlistener_new_bind (itdata->base, cb, itdata,
                                          LEV_OPT_REUSEABLE |
-                                         LEV_OPT_CLOSE_ON_FREE, -1,
+                                         LEV_OPT_CLOSE_ON_FREE, SOMAXCONN,
                                          (struct sockaddr *) &sun,
                                          sizeof (sun));
     if (_listener == NULL)
@@ -905,150 +2357,521 @@ fg_events_server_setup_unix (struct fg_events_data *itdata,
         return -1;
       }
 
-    evconnlistener_set_error_cb (_listener, &accept_error_cb);
+    if (cb == &accept_conn_cb)
+        evconnlistener_set_error_cb (_listener, &accept_error_cb);
+    else
+        evconnlistener_set_error_cb (_listener, &metrics_error_cb);
 
     *listener = _listener;
 
     return 0;
 }
 
-static void *
-events_thread_server_start (void *param)
+/* Helper function to tell whether the loop did any work, anything read or
+   queued for writing moves these counters */
+static inline uint64_t
+loop_activity (struct fg_events_data *itdata)
 {
-    int s;
-    struct timeval pinginterval = { 1, 0 }; // ping clients every 1 seconds
-    struct fg_events_data *itdata = param;
-    struct client_t *client;
-    void *client_pointer;
+    return stat_get (itdata->stats.bytes_in) +
+           stat_get (itdata->stats.bytes_out);
+}
 
-    evthread_use_pthreads ();
-    itdata->base = event_base_new ();
-    if (itdata->base == NULL)
-      {
-        report_error_en (itdata, EAGAIN, "Could not create event base");
-        sem_post (&itdata->init_flag);
-        return NULL;
-      }
+/* Run the loop of the events thread. With opts.busy_poll set the loop is
+   polled without sleeping, and only blocks in the kernel once it has been
+   idle for that long. It blocks for a single round then, and spins again
+   as soon as something happened. The CPU is yielded between rounds, so
+   a spinning thread does not starve its peers on a busy core */
+static void
+fg_dispatch (struct fg_events_data *itdata)
+{
+    uint64_t budget = timeval_ns (&itdata->opts.busy_poll);
+    uint64_t seen, idle_since;
+    struct event_base *base = itdata->base;
 
-    s = fg_events_server_setup_inet (itdata, &itdata->listener_inet,
-                                     itdata->port);
-    if (s != 0)
+    if (budget == 0)
       {
-        event_base_free (itdata->base);
-        sem_post (&itdata->init_flag);
-        return NULL;      
+        event_base_dispatch (base);
+        return;
       }
 
-    s = fg_events_server_setup_unix (itdata, &itdata->listener_unix,
-                                     itdata->addr);
-    if (s != 0)
+    seen = loop_activity (itdata);
+    idle_since = monotonic_ns ();
+    while (!event_base_got_exit (base) && !event_base_got_break (base))
       {
-        evconnlistener_free (itdata->listener_inet);        
-        event_base_free (itdata->base);
-        sem_post (&itdata->init_flag);
-        return NULL;
-      }
+        uint64_t activity;
 
-    /* Register event to be able to break out of event loop when raised */
-    itdata->exev = event_new (itdata->base, -1, 0, fg_exit_cb, itdata);
-    if (!itdata->exev || event_add (itdata->exev, NULL) < 0)
-        report_error_noen (itdata, "Could not create/add exit event");
+        if (event_base_loop (base, EVLOOP_NONBLOCK) != 0)
+            break;
 
-    itdata->pingev = event_new (itdata->base, -1, EV_PERSIST, fg_ping_cb,
-                                itdata);
-    if (!itdata->pingev || event_add (itdata->pingev, &pinginterval) < 0)
-        report_error_noen (itdata, "Could not create/add ping event");
-
-    itdata->connstatus = CONNECTED;
-    sem_post (&itdata->init_flag);
-    event_base_dispatch (itdata->base);
+        activity = loop_activity (itdata);
+        if (activity != seen)
+          {
+            seen = activity;
+            idle_since = monotonic_ns ();
+          }
+        else if (monotonic_ns () - idle_since >= budget)
+          {
+            if (event_base_loop (base, EVLOOP_ONCE) != 0)
+                break;
+            seen = loop_activity (itdata);
+            idle_since = monotonic_ns ();
+            continue;
+          }
+
+        sched_yield ();
+      }
+}
+
+/* Helper function to create the event ending an embedded instance, which
+   does not own the loop and tears itself down from it instead */
+static void
+fg_setup_stop (struct fg_events_data *itdata)
+{
+    if (!itdata->embedded)
+        return;
+
+    itdata->stopev = evtimer_new (itdata->base, fg_stop_cb, itdata);
+    if (!itdata->stopev)
+        report_error_noen (itdata, "Could not create stop event");
+}
+
+/* Helper function to set up the io_uring transport, the connections stay on
+   libevent when the kernel does not support it */
+static void
+fg_setup_uring (struct fg_events_data *itdata)
+{
+    if (!itdata->opts.io_uring)
+        return;
+
+    itdata->uring = fg_uring_new (itdata->base, &itdata->stats.io_enters);
+    if (itdata->uring == NULL)
+      {
+        report_error (itdata, "Could not set up io_uring, using libevent");
+        itdata->opts.io_uring = false;
+      }
+}
+
+/* Set up the listeners and events of a server on itdata->base */
+/* Helper function to allocate the latency histograms, they are large enough
+   to be left out unless track_latency is set */
+static void
+fg_setup_latency (struct fg_events_data *itdata)
+{
+    if (!itdata->opts.track_latency)
+        return;
+
+    itdata->latency = calloc (FG_LATENCY_KINDS, sizeof (struct fg_hist));
+    if (itdata->latency == NULL)
+      {
+        report_error (itdata, "Could not allocate latency histograms");
+        itdata->opts.track_latency = false;
+      }
+}
+
+static int
+fg_server_start (struct fg_events_data *itdata)
+{
+    int s;
+
+    s = fg_events_server_setup_inet (itdata, &itdata->listener_inet,
+                                     itdata->port);
+    if (s != 0)
+        return -1;
+
+    s = fg_events_server_setup_unix (itdata, &itdata->listener_unix,
+                                     itdata->addr, &accept_conn_cb);
+    if (s != 0)
+      {
+        evconnlistener_free (itdata->listener_inet);
+        itdata->listener_inet = NULL;
+        return -1;
+      }
+
+    /* Register event to be able to break out of event loop when raised */
+    itdata->exev = event_new (itdata->base, -1, 0, fg_exit_cb, itdata);
+    if (!itdata->exev || event_add (itdata->exev, NULL) < 0)
+        report_error_noen (itdata, "Could not create/add exit event");
+
+    /* Register event to start draining the connections when raised */
+    itdata->drainev = event_new (itdata->base, -1, 0, fg_drain_cb, itdata);
+    if (!itdata->drainev || event_add (itdata->drainev, NULL) < 0)
+        report_error_noen (itdata, "Could not create/add drain event");
+
+    /* Register event to hand out errors when raised, raise it right away
+       for errors reported before it existed */
+    itdata->errev = event_new (itdata->base, -1, 0, fg_error_cb, itdata);
+    if (!itdata->errev)
+        report_error_noen (itdata, "Could not create error event");
+    else
+        event_active (itdata->errev, EV_WRITE, 0);
+
+    fg_setup_stop (itdata);
+
+    /* Metrics are optional, the server runs on without them */
+    if (itdata->opts.metrics_path != NULL)
+        fg_events_server_setup_unix (itdata, &itdata->listener_metrics,
+                                     itdata->opts.metrics_path,
+                                     &metrics_conn_cb);
+
+    if (itdata->opts.capture_path != NULL &&
+        fg_capture_open (&itdata->capture, itdata->opts.capture_path,
+                         itdata->opts.capture_size) < 0)
+        report_error (itdata, "Could not open capture file");
+    fg_setup_latency (itdata);
+    fg_setup_uring (itdata);
+
+    fg_setup_heartbeat (itdata);
+
+    itdata->rand_seed = (unsigned int) time (NULL) ^
+                        (unsigned int) getpid () ^
+                        (unsigned int) (uintptr_t) itdata;
+
+    if (timerisset (&itdata->opts.ping_interval))
+      {
+        itdata->pingev = event_new (itdata->base, -1, EV_PERSIST, fg_ping_cb,
+                                    itdata);
+        if (!itdata->pingev ||
+            event_add (itdata->pingev, &itdata->opts.ping_interval) < 0)
+            report_error_noen (itdata, "Could not create/add ping event");
+      }
+
+    itdata->connstatus = CONNECTED;
+
+    return 0;
+}
+
+/* Tear down what fg_server_start set up, the event base is left alone */
+static void
+fg_server_stop (struct fg_events_data *itdata)
+{
+    struct client_t *client;
+    void *client_pointer;
 
     while (list_pop (&itdata->clients, &client_pointer) != -1)
       {
         client = client_pointer;
-        bufferevent_free (client->bev);
+        destroy_client (client);
       }
 
+    while (list_pop (&itdata->metrics_conns, &client_pointer) != -1)
+        bufferevent_free (client_pointer);
+    fg_uring_free (itdata->uring);
+    itdata->uring = NULL;
+
     evconnlistener_free (itdata->listener_inet);
-    evconnlistener_free (itdata->listener_unix);
+    if (itdata->listener_unix)
+        evconnlistener_free (itdata->listener_unix);
+    if (itdata->listener_metrics)
+        evconnlistener_free (itdata->listener_metrics);
     if (itdata->exev)
         event_free (itdata->exev);
+    if (itdata->drainev)
+        event_free (itdata->drainev);
+    if (itdata->errev)
+      {
+        event_free (itdata->errev);
+        itdata->errev = NULL;
+      }
+    if (itdata->stopev)
+        event_free (itdata->stopev);
+    fg_capture_close (&itdata->capture);
+    free (itdata->latency);
+    itdata->latency = NULL;
+    if (itdata->beatev)
+        event_free (itdata->beatev);
     if (itdata->pingev)
         event_free (itdata->pingev);
+}
+
+static void *
+events_thread_server_start (void *param)
+{
+    struct fg_events_data *itdata = param;
+
+    block_sigpipe ();
+    evthread_use_pthreads ();
+    itdata->base = event_base_new ();
+    if (itdata->base == NULL)
+      {
+        report_error_en (itdata, EAGAIN, "Could not create event base");
+        sem_post (&itdata->init_flag);
+        return NULL;
+      }
+
+    if (fg_server_start (itdata) != 0)
+      {
+        event_base_free (itdata->base);
+        sem_post (&itdata->init_flag);
+        return NULL;
+      }
+
+    sem_post (&itdata->init_flag);
+    fg_dispatch (itdata);
+
+    fg_server_stop (itdata);
     event_base_free (itdata->base);
 
     return NULL;
 }
 
+/* Helper function to release the thread blocked in one of the client init
+   functions. It must only be posted once since the semaphore is destroyed
+   right after the wait returns. */
 static void
-client_event_loop (struct fg_events_data *itdata)
+fg_init_done (struct fg_events_data *itdata)
 {
-    while (itdata->running)
+    if (itdata->init_pending)
       {
-        ssize_t s;
-        socklen_t len;
-        struct sockaddr_in sin;
-        struct sockaddr_un sun;
-        struct sockaddr *saddr;
-        struct client_t holder;
+        itdata->init_pending = false;
+        sem_post (&itdata->init_flag);
+      }
+}
 
-        memset (&holder, 0, sizeof (struct client_t));
-        holder.itdata = itdata;
+/* Helper function to compute the delay before the next connection attempt.
+   The first retry is immediate, after that the delay doubles from
+   reconnect_base up to reconnect_max and is randomly shortened by up to
+   reconnect_jitter percent so clients don't reconnect in lockstep */
+static void
+fg_reconnect_delay (struct fg_events_data *itdata, struct timeval *tv)
+{
+    uint64_t delay, max;
+    unsigned int attempt = itdata->reconnect_attempts;
 
-        itdata->bev = bufferevent_socket_new (itdata->base, -1,
-                                              BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
-        evbuffer_enable_locking (bufferevent_get_output (itdata->bev), NULL);
-        bufferevent_setcb (itdata->bev, fg_read_cb, NULL, fg_event_client_cb,
-                           &holder);
-        bufferevent_enable (itdata->bev, EV_READ | EV_PERSIST | EV_WRITE);
+    timerclear (tv);
+    if (attempt == 0)
+        return;
 
-        itdata->connstatus = CONNECTING;
+    delay = (uint64_t) itdata->opts.reconnect_base.tv_sec * 1000000 +
+            itdata->opts.reconnect_base.tv_usec;
+    max = (uint64_t) itdata->opts.reconnect_max.tv_sec * 1000000 +
+          itdata->opts.reconnect_max.tv_usec;
 
-        if (itdata->port > 0)
-          {
-            /* connect via inet sockets */
-            len = sizeof (sin);
-            memset(&sin, 0, len);
-            sin.sin_family = AF_INET;
-            sin.sin_addr.s_addr = inet_addr (itdata->addr); // htonl (0x7f000001);
-            sin.sin_port = htons (itdata->port);
-
-            saddr = (struct sockaddr *) &sin;
-          }
-        else
-          {
-            /* connect via unix domain sockets */
-            len = sizeof (sun);
-            memset (&sun, 0, len);
-            sun.sun_family = AF_LOCAL;
-            strncpy (sun.sun_path, itdata->addr, sizeof (sun.sun_path) - 1);
-            
-            saddr = (struct sockaddr *) &sun;
-          }
+    while (--attempt > 0 && delay < max)
+        delay <<= 1;
+    if (delay > max)
+        delay = max;
 
-        s = bufferevent_socket_connect (itdata->bev, saddr, len);
-        if (s < 0)
-          {
-            bufferevent_free (itdata->bev);
-            report_error (itdata, "bufferevent_socket_connect failed");
+    if (itdata->opts.reconnect_jitter > 0 && delay > 0)
+      {
+        uint64_t spread = delay * itdata->opts.reconnect_jitter / 100;
+        if (spread > 0)
+            delay -= (uint64_t) rand_r (&itdata->rand_seed) % (spread + 1);
+      }
 
-            sem_post (&itdata->init_flag);
+    tv->tv_sec = delay / 1000000;
+    tv->tv_usec = delay % 1000000;
+}
 
-            /* attempt to reconnect after 10 seconds */
-            usleep (10 * 1000 * 1000);
-            continue;
-          }
+static void
+fg_schedule_reconnect (struct fg_events_data *itdata)
+{
+    struct timeval delay;
 
-        event_base_dispatch (itdata->base);
+    if (!itdata->running || itdata->reconnev == NULL)
+        return;
 
-        bufferevent_free (itdata->bev);
+    fg_reconnect_delay (itdata, &delay);
+    if (itdata->reconnect_attempts < UINT_MAX)
+        itdata->reconnect_attempts++;
+
+    if (event_add (itdata->reconnev, &delay) < 0)
+        report_error_noen (itdata, "Could not add reconnect event");
+}
+
+static void
+fg_client_connect (struct fg_events_data *itdata)
+{
+    ssize_t s;
+    socklen_t len;
+    struct sockaddr_in sin;
+    struct sockaddr_un sun;
+    struct sockaddr *saddr;
+    struct bufferevent *bev;
+
+    bev = bufferevent_socket_new (itdata->base, -1, bev_options (itdata));
+    if (bev == NULL)
+      {
+        report_error_en (itdata, ENOMEM, "bufferevent_socket_new failed");
+        fg_init_done (itdata);
+        fg_schedule_reconnect (itdata);
+        return;
+      }
 
+    /* Only published with its callbacks set, the application thread finds
+       the client of the connection through them */
+    if (!itdata->embedded)
+        evbuffer_enable_locking (bufferevent_get_output (bev), NULL);
+    bufferevent_setcb (bev, fg_read_cb, fg_write_cb, fg_event_client_cb,
+                       &itdata->self);
+    itdata->bev = bev;
+    itdata->self.bev = bev;
+    itdata->self.status = CONNECTING;
+    itdata->self.ext_ok = false;
+    track_output (&itdata->self);
+    bufferevent_enable (itdata->bev, EV_READ | EV_PERSIST | EV_WRITE);
+
+    itdata->connstatus = CONNECTING;
+
+    if (itdata->port > 0)
+      {
+        /* connect via inet sockets */
+        len = sizeof (sin);
+        memset(&sin, 0, len);
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = inet_addr (itdata->addr); // htonl (0x7f000001);
+        sin.sin_port = htons (itdata->port);
+
+        saddr = (struct sockaddr *) &sin;
+      }
+    else
+      {
+        /* connect via unix domain sockets */
+        len = sizeof (sun);
+        memset (&sun, 0, len);
+        sun.sun_family = AF_LOCAL;
+        strncpy (sun.sun_path, itdata->addr, sizeof (sun.sun_path) - 1);
+        
+        saddr = (struct sockaddr *) &sun;
+      }
+
+    if (itdata->uring != NULL)
+      {
+        itdata->self.uring = fg_uring_connect (itdata->uring, itdata->bev,
+                                               saddr, len);
+        s = itdata->self.uring != NULL ? 0 : -1;
+      }
+    else
+      {
+        s = bufferevent_socket_connect (itdata->bev, saddr, len);
+      }
+    if (s < 0)
+      {
         itdata->connstatus = DISCONNECTED;
-        /* TODO: timeout should listen to signals such as SIGINT */
-        // wait 10 seconds before attempting to re-connect unless exitting
-        if (itdata->running)        
-            usleep (10 * 1000 * 1000);
+        untrack_output (&itdata->self);
+        itdata->self.bev = NULL;
+        itdata->self.status = DISCONNECTED;
+        bufferevent_free (itdata->bev);
+        itdata->bev = NULL;
+        report_error (itdata, itdata->uring != NULL ?
+                              "fg_uring_connect failed" :
+                              "bufferevent_socket_connect failed");
+
+        fg_init_done (itdata);
+        fg_schedule_reconnect (itdata);
+        return;
+      }
+
+    /* Announce ourselves in the first frame, along with what is needed to
+       resume a previous session. It is flushed as soon as the connection is
+       up and application events are queued right behind it, so there is no
+       need to wait for FG_CONFIRMED */
+    if (fg_send_connected_event (itdata) != 0)
+        report_error (itdata, "fg_send_connected_event failed");
+}
+
+static void
+fg_client_disconnect (struct fg_events_data *itdata)
+{
+    itdata->connstatus = DISCONNECTED;
+    if (itdata->bev != NULL)
+      {
+        untrack_output (&itdata->self);
+        close_uring (&itdata->self);
+        itdata->self.bev = NULL;
+        itdata->self.status = DISCONNECTED;
+        bufferevent_free (itdata->bev);
+        itdata->bev = NULL;
+        release_input (itdata, &itdata->self, itdata->self.pending_in);
+        itdata->self.pending_in = 0;
+      }
+}
+
+static void
+fg_reconnect_cb (evutil_socket_t UNUSED(sig), short UNUSED(events), void *arg)
+{
+    struct fg_events_data *itdata = arg;
+
+    if (itdata->running)
+      {
+        stat_add (itdata->stats.reconnects, 1);
+        fg_client_connect (itdata);
+      }
+}
+
+/* Set up the events of a client on itdata->base and start connecting */
+static void
+fg_client_start (struct fg_events_data *itdata)
+{
+    /* Register event to be able to break out of event loop when raised */
+    itdata->exev = event_new (itdata->base, -1, 0, fg_exit_cb, itdata);
+    if (!itdata->exev || event_add (itdata->exev, NULL) < 0)
+        report_error_noen (itdata, "Could not create/add exit event");
+
+    /* Reconnection is driven by this timer so the loop keeps running, and
+       shutdown stays responsive, while waiting for the next attempt */
+    itdata->reconnev = evtimer_new (itdata->base, fg_reconnect_cb, itdata);
+    if (!itdata->reconnev)
+        report_error_noen (itdata, "Could not create reconnect event");
+
+    /* Register event to start draining the connection when raised */
+    itdata->drainev = event_new (itdata->base, -1, 0, fg_drain_cb, itdata);
+    if (!itdata->drainev || event_add (itdata->drainev, NULL) < 0)
+        report_error_noen (itdata, "Could not create/add drain event");
+
+    /* Register event to hand out errors when raised, raise it right away
+       for errors reported before it existed */
+    itdata->errev = event_new (itdata->base, -1, 0, fg_error_cb, itdata);
+    if (!itdata->errev)
+        report_error_noen (itdata, "Could not create error event");
+    else
+        event_active (itdata->errev, EV_WRITE, 0);
+
+    fg_setup_stop (itdata);
+
+    if (itdata->opts.capture_path != NULL &&
+        fg_capture_open (&itdata->capture, itdata->opts.capture_path,
+                         itdata->opts.capture_size) < 0)
+        report_error (itdata, "Could not open capture file");
+    fg_setup_latency (itdata);
+    fg_setup_uring (itdata);
+
+    fg_setup_heartbeat (itdata);
+
+    itdata->self.itdata = itdata;
+    itdata->self.user_id = itdata->user_id;
+    itdata->rand_seed = (unsigned int) time (NULL) ^
+                        (unsigned int) getpid () ^
+                        (unsigned int) (uintptr_t) itdata;
+    itdata->running = true;
+    fg_client_connect (itdata);
+}
+
+/* Tear down what fg_client_start set up, the event base is left alone */
+static void
+fg_client_stop (struct fg_events_data *itdata)
+{
+    fg_client_disconnect (itdata);
+    fg_uring_free (itdata->uring);
+    itdata->uring = NULL;
+
+    if (itdata->reconnev)
+        event_free (itdata->reconnev);
+    if (itdata->exev)
+        event_free (itdata->exev);
+    if (itdata->drainev)
+        event_free (itdata->drainev);
+    if (itdata->errev)
+      {
+        event_free (itdata->errev);
+        itdata->errev = NULL;
       }
+    if (itdata->stopev)
+        event_free (itdata->stopev);
+    fg_capture_close (&itdata->capture);
+    free (itdata->latency);
+    itdata->latency = NULL;
+    if (itdata->beatev)
+        event_free (itdata->beatev);
 }
 
 static void *
@@ -1056,48 +2879,91 @@ events_thread_client_start (void *param)
 {    
     struct fg_events_data *itdata = param;
 
+    block_sigpipe ();
     evthread_use_pthreads ();
 
     struct event_config *config = event_config_new ();
 
     itdata->base = event_base_new_with_config (config);
+    event_config_free (config);
     if (itdata->base == NULL)
       {
         report_error_noen (itdata, "Could not create event base");
+        fg_init_done (itdata);
         return NULL;
       }
 
-    event_config_free (config);
-
-    /* Register event to be able to break out of event loop when raised */
-    itdata->exev = event_new (itdata->base, -1, 0, fg_exit_cb, itdata);
-    if (!itdata->exev || event_add (itdata->exev, NULL) < 0)
-        report_error_noen (itdata, "Could not create/add exit event");
-
-    itdata->running = true;
-    client_event_loop (itdata);
+    fg_client_start (itdata);
+    fg_dispatch (itdata);
 
-    if (itdata->exev)
-        event_free (itdata->exev);
+    fg_client_stop (itdata);
     event_base_free (itdata->base);
 
     return NULL;
 }
 
+void
+fg_events_opts_init (struct fg_events_opts *opts)
+{
+    memset (opts, 0, sizeof (struct fg_events_opts));
+    opts->ping_interval.tv_sec = FG_DEFAULT_PING_INTERVAL_SEC;
+    opts->ping_interval.tv_usec = 0;
+    opts->ping_max_failed = FG_DEFAULT_PING_MAX_FAILED;
+    opts->reconnect_base.tv_sec = 0;
+    opts->reconnect_base.tv_usec = FG_DEFAULT_RECONNECT_BASE_MSEC * 1000;
+    opts->reconnect_max.tv_sec = FG_DEFAULT_RECONNECT_MAX_SEC;
+    opts->reconnect_max.tv_usec = 0;
+    opts->reconnect_jitter = FG_DEFAULT_RECONNECT_JITTER;
+    opts->resume_window = FG_DEFAULT_RESUME_WINDOW;
+    opts->resume_linger.tv_sec = FG_DEFAULT_RESUME_LINGER_SEC;
+    opts->resume_linger.tv_usec = 0;
+    opts->log_level = FG_DEFAULT_LOG_LEVEL;
+    opts->capture_size = FG_DEFAULT_CAPTURE_SIZE;
+    opts->mem_policy = FG_DEFAULT_MEM_POLICY;
+    opts->io_uring = false;
+}
+
 int
 fg_events_server_init (struct fg_events_data *etdata, fg_handle_event_cb cb,
                        void *arg, uint16_t port, char *unix_path,
                        int8_t user_id)
 {
-    ssize_t s;
+    return fg_events_server_init_opts (etdata, cb, arg, port, unix_path,
+                                       user_id, NULL);
+}
 
+/* Helper function to fill in etdata for any of the init functions */
+static void
+fg_events_data_init (struct fg_events_data *etdata, fg_handle_event_cb cb,
+                     fg_handle_read_cb read_cb, void *arg, char *addr,
+                     uint16_t port, int8_t user_id, bool is_server,
+                     const struct fg_events_opts *opts)
+{
     memset (etdata, 0, sizeof (struct fg_events_data));
+    error_ring_init (&etdata->errors);
+    if (opts != NULL)
+        etdata->opts = *opts;
+    else
+        fg_events_opts_init (&etdata->opts);
     etdata->cb = cb;
+    etdata->read_cb = read_cb;
     etdata->user_data = arg;
-    etdata->addr = unix_path;
+    etdata->addr = addr;
     etdata->port = port;
-    etdata->is_server = true;
+    etdata->is_server = is_server;
     etdata->user_id = user_id;
+}
+
+int
+fg_events_server_init_opts (struct fg_events_data *etdata,
+                            fg_handle_event_cb cb, void *arg, uint16_t port,
+                            char *unix_path, int8_t user_id,
+                            const struct fg_events_opts *opts)
+{
+    ssize_t s;
+
+    fg_events_data_init (etdata, cb, NULL, arg, unix_path, port, user_id,
+                         true, opts);
 
     sem_init (&etdata->init_flag, 0, 0);
     s = pthread_create (&etdata->events_t, NULL, &events_thread_server_start,
@@ -1110,27 +2976,51 @@ fg_events_server_init (struct fg_events_data *etdata, fg_handle_event_cb cb,
     sem_wait (&etdata->init_flag);
     sem_destroy (&etdata->init_flag);
 
+    /* The events thread gave up before it could hand out errors */
+    if (etdata->errev == NULL)
+        fg_error_cb (-1, 0, etdata);
+    else
+        fg_watchdog_start (etdata);
+
     return etdata->save_errno;
 }
 
 int
-fg_events_client_init_inet (struct fg_events_data *etdata,
-                            fg_handle_event_cb cb, fg_handle_read_cb read_cb,
-                            void *arg, char *inet_addr, uint16_t port,
-                            int8_t user_id)
+fg_events_server_init_base (struct fg_events_data *etdata,
+                            struct event_base *base, fg_handle_event_cb cb,
+                            void *arg, uint16_t port, char *unix_path,
+                            int8_t user_id, const struct fg_events_opts *opts)
+{
+    fg_events_data_init (etdata, cb, NULL, arg, unix_path, port, user_id,
+                         true, opts);
+    etdata->embedded = true;
+    etdata->base = base;
+    etdata->events_t = pthread_self ();
+
+    if (fg_server_start (etdata) != 0)
+      {
+        etdata->base = NULL;
+        fg_error_cb (-1, 0, etdata);
+        return -1;
+      }
+    fg_watchdog_start (etdata);
+
+    return 0;
+}
+
+static int
+fg_events_client_init (struct fg_events_data *etdata, fg_handle_event_cb cb,
+                       fg_handle_read_cb read_cb, void *arg, char *addr,
+                       uint16_t port, int8_t user_id,
+                       const struct fg_events_opts *opts)
 {
     ssize_t s;
 
-    memset (etdata, 0, sizeof (struct fg_events_data));
-    etdata->cb = cb;
-    etdata->read_cb = read_cb;
-    etdata->user_data = arg;
-    etdata->addr = inet_addr;
-    etdata->port = port;
-    etdata->is_server = false;
-    etdata->user_id = user_id;
+    fg_events_data_init (etdata, cb, read_cb, arg, addr, port, user_id,
+                         false, opts);
 
     sem_init (&etdata->init_flag, 0, 0);
+    etdata->init_pending = true;
     s = pthread_create (&etdata->events_t, NULL, &events_thread_client_start,
                         etdata);
     if (s != 0)
@@ -1141,37 +3031,143 @@ fg_events_client_init_inet (struct fg_events_data *etdata,
     sem_wait (&etdata->init_flag);
     sem_destroy (&etdata->init_flag);
 
+    /* The events thread gave up before it could hand out errors */
+    if (etdata->errev == NULL)
+        fg_error_cb (-1, 0, etdata);
+    else
+        fg_watchdog_start (etdata);
+
     return etdata->save_errno;
 }
 
+/* Nothing waits for the first connection attempt here, it is only started
+   and completes once the caller dispatches the base. Failing attempts are
+   retried like in the events thread and reported through the error
+   callback */
+static int
+fg_events_client_init_embedded (struct fg_events_data *etdata,
+                                struct event_base *base,
+                                fg_handle_event_cb cb,
+                                fg_handle_read_cb read_cb, void *arg,
+                                char *addr, uint16_t port, int8_t user_id,
+                                const struct fg_events_opts *opts)
+{
+    fg_events_data_init (etdata, cb, read_cb, arg, addr, port, user_id,
+                         false, opts);
+    etdata->embedded = true;
+    etdata->base = base;
+    etdata->events_t = pthread_self ();
+
+    fg_client_start (etdata);
+    fg_watchdog_start (etdata);
+
+    return 0;
+}
+
+int
+fg_events_client_init_inet (struct fg_events_data *etdata,
+                            fg_handle_event_cb cb, fg_handle_read_cb read_cb,
+                            void *arg, char *inet_addr, uint16_t port,
+                            int8_t user_id)
+{
+    return fg_events_client_init (etdata, cb, read_cb, arg, inet_addr, port,
+                                  user_id, NULL);
+}
+
+int
+fg_events_client_init_inet_opts (struct fg_events_data *etdata,
+                                 fg_handle_event_cb cb,
+                                 fg_handle_read_cb read_cb, void *arg,
+                                 char *inet_addr, uint16_t port,
+                                 int8_t user_id,
+                                 const struct fg_events_opts *opts)
+{
+    return fg_events_client_init (etdata, cb, read_cb, arg, inet_addr, port,
+                                  user_id, opts);
+}
+
 int
 fg_events_client_init_unix (struct fg_events_data *etdata,
                             fg_handle_event_cb cb, fg_handle_read_cb read_cb,
                             void *arg, char *unix_path, int8_t user_id)
 {
-    ssize_t s;
+    return fg_events_client_init (etdata, cb, read_cb, arg, unix_path, 0,
+                                  user_id, NULL);
+}
 
-    memset (etdata, 0, sizeof (struct fg_events_data));
-    etdata->cb = cb;
-    etdata->read_cb = read_cb;
-    etdata->user_data = arg;
-    etdata->addr = unix_path;
-    etdata->port = 0;
-    etdata->is_server = false;
-    etdata->user_id = user_id;
+int
+fg_events_client_init_unix_opts (struct fg_events_data *etdata,
+                                 fg_handle_event_cb cb,
+                                 fg_handle_read_cb read_cb, void *arg,
+                                 char *unix_path, int8_t user_id,
+                                 const struct fg_events_opts *opts)
+{
+    return fg_events_client_init (etdata, cb, read_cb, arg, unix_path, 0,
+                                  user_id, opts);
+}
 
-    sem_init (&etdata->init_flag, 0, 0);
-    s = pthread_create (&etdata->events_t, NULL, &events_thread_client_start,
-                        etdata);
-    if (s != 0)
-      {
-        errno = s;
-        return -1;
-      }
-    sem_wait (&etdata->init_flag);
-    sem_destroy (&etdata->init_flag);
+int
+fg_events_client_init_inet_base (struct fg_events_data *etdata,
+                                 struct event_base *base,
+                                 fg_handle_event_cb cb,
+                                 fg_handle_read_cb read_cb, void *arg,
+                                 char *inet_addr, uint16_t port,
+                                 int8_t user_id,
+                                 const struct fg_events_opts *opts)
+{
+    return fg_events_client_init_embedded (etdata, base, cb, read_cb, arg,
+                                           inet_addr, port, user_id, opts);
+}
 
-    return etdata->save_errno;
+int
+fg_events_client_init_unix_base (struct fg_events_data *etdata,
+                                 struct event_base *base,
+                                 fg_handle_event_cb cb,
+                                 fg_handle_read_cb read_cb, void *arg,
+                                 char *unix_path, int8_t user_id,
+                                 const struct fg_events_opts *opts)
+{
+    return fg_events_client_init_embedded (etdata, base, cb, read_cb, arg,
+                                           unix_path, 0, user_id, opts);
+}
+
+/* Helper function to end the loop after the given time, or right after the
+   current round of callbacks. Embedded instances tear themselves down at
+   that point instead, the loop belongs to the caller */
+static void
+fg_loop_exit (struct fg_events_data *itdata, const struct timeval *tv)
+{
+    if (!itdata->embedded)
+        event_base_loopexit (itdata->base, tv);
+    else if (itdata->stopev != NULL && tv != NULL)
+        event_add (itdata->stopev, tv);
+    else if (itdata->stopev != NULL)
+        event_active (itdata->stopev, EV_TIMEOUT, 0);
+}
+
+/* Tear down an embedded instance, what the events thread does once its
+   loop has ended. Does nothing when it is torn down already */
+static void
+fg_events_stop (struct fg_events_data *itdata)
+{
+    if (itdata->base == NULL)
+        return;
+
+    /* A slow teardown is no stall, and the watchdog must not look at what
+       is being freed */
+    fg_watchdog_stop (itdata);
+    itdata->running = false;
+    if (itdata->is_server)
+        fg_server_stop (itdata);
+    else
+        fg_client_stop (itdata);
+    itdata->base = NULL;
+}
+
+static void
+fg_stop_cb (evutil_socket_t UNUSED(sig), short UNUSED(events), void *arg)
+{
+    fg_events_stop (arg);
 }
 
 static void
@@ -1180,7 +3176,59 @@ fg_exit_cb (evutil_socket_t UNUSED(sig), short UNUSED(events), void *arg)
     struct fg_events_data *itdata = arg;
 
     itdata->running = false;
-    event_base_loopexit (itdata->base, NULL);
+    fg_loop_exit (itdata, NULL);
+}
+
+static void
+fg_error_cb (evutil_socket_t UNUSED(sig), short UNUSED(events), void *arg)
+{
+    bool have_error = false;
+    struct fg_error error;
+    struct fg_events_data *itdata = arg;
+
+    /* Clear first so errors reported from now on raise the event again */
+    __atomic_store_n (&itdata->error_pending, false, __ATOMIC_RELEASE);
+
+    itdata->cb_depth++;
+    while (error_ring_pop (&itdata->errors, &error))
+      {
+        if (itdata->opts.error_cb != NULL)
+            itdata->opts.error_cb (itdata->user_data, &error);
+        have_error = true;
+      }
+
+    /* Without an error callback only the last error of a batch is passed
+       on, the way the old synchronous reporting overwrote earlier ones */
+    if (have_error && itdata->opts.error_cb == NULL)
+      {
+        fg_events_format_error (&error, itdata->error, sizeof itdata->error);
+        itdata->cb (itdata->user_data, NULL, NULL);
+      }
+    itdata->cb_depth--;
+}
+
+static void
+fg_heartbeat_cb (evutil_socket_t UNUSED(sig), short UNUSED(events), void *arg)
+{
+    struct fg_events_data *itdata = arg;
+
+    __atomic_store_n (&itdata->heartbeat_ns, monotonic_ns (),
+                      __ATOMIC_RELAXED);
+
+    if (itdata->embedded && itdata->errev != NULL &&
+        !error_ring_empty (&itdata->errors) &&
+        !__atomic_exchange_n (&itdata->error_pending, true, __ATOMIC_ACQ_REL))
+        event_active (itdata->errev, EV_WRITE, 0);
+}
+
+static void
+fg_linger_cb (evutil_socket_t UNUSED(sig), short UNUSED(events), void *arg)
+{
+    struct client_t *client = arg;
+
+    fg_log_info (client->itdata, "session of user %d expired",
+                 client->user_id);
+    remove_client (client);
 }
 
 static void
@@ -1188,34 +3236,401 @@ fg_ping_cb (evutil_socket_t UNUSED(sig), short UNUSED(events), void *arg)
 {
     struct fg_events_data *itdata = arg;
     struct fgevent fgev;
+    struct node *next_head;
     
     fgev.id = FG_ALIVE;
     fgev.sender = itdata->user_id;    
     fgev.length = 0;
 
+    /* Dropping a client unlinks its node so fetch the next one up front */
     for (struct node *cur_head = itdata->clients;
       cur_head != NULL;
-      cur_head = cur_head->next)
+      cur_head = next_head)
     {
       struct client_t *client = cur_head->value;
+      next_head = cur_head->next;
       if (client->status != CONNECTED) continue;      
 
-      if (++client->failed > 5)
+      /* The answers of a producer paused for the memory budget are not
+         read, that is no reason to give up on it. A congested consumer
+         which stopped reading is dropped like any other */
+      if (client->mem_paused && !client->congested)
+          client->failed = 0;
+
+      /* Compared before counting the ping about to be sent, the counter
+         saturates so that a limit of 255 still drops */
+      if (itdata->opts.ping_max_failed > 0 &&
+          client->failed >= itdata->opts.ping_max_failed)
         {
+          fg_log_warn (itdata, "dropping unresponsive user %d",
+                       client->user_id);
           client->status = DROPPED;
+          FG_PROBE2 (drop, client->user_id, client->failed);
+          stat_add (itdata->stats.drops, 1);
+          set_user_dropped (itdata, client->user_id, true);
+          remove_client (client);
+          continue;
         }
+      if (client->failed < UINT8_MAX)
+          client->failed++;
 
       fgev.receiver = client->user_id;
-      if (fg_send_event_bev (itdata, client->bev, &fgev) < 0)
+      if (fg_send_event_bev (itdata, client->bev, &fgev, NULL) < 0)
         {
           report_error (itdata, "fg_send_event_bev failed");
         }
     }
+
+  /* Dropping a congested consumer may free enough to resume its
+     producers */
+  if (itdata->mem_paused)
+      fg_check_memory (itdata, NULL);
+}
+
+void
+fg_events_get_stats (struct fg_events_data *etdata,
+                     struct fg_events_stats *stats)
+{
+    stats->events_in = stat_get (etdata->stats.events_in);
+    stats->events_out = stat_get (etdata->stats.events_out);
+    stats->bytes_in = stat_get (etdata->stats.bytes_in);
+    stats->bytes_out = stat_get (etdata->stats.bytes_out);
+    stats->parse_failures = stat_get (etdata->stats.parse_failures);
+    stats->dispatch_misses = stat_get (etdata->stats.dispatch_misses);
+    stats->offline_events = stat_get (etdata->stats.offline_events);
+    stats->reconnects = stat_get (etdata->stats.reconnects);
+    stats->drops = stat_get (etdata->stats.drops);
+    stats->output_queued = stat_get (etdata->stats.output_queued);
+    stats->input_queued = stat_get (etdata->stats.input_queued);
+    stats->resume_bytes = stat_get (etdata->stats.resume_bytes);
+    stats->mem_bytes = stats->output_queued + stats->input_queued +
+                       stats->resume_bytes;
+    stats->mem_pauses = stat_get (etdata->stats.mem_pauses);
+    stats->mem_sheds = stat_get (etdata->stats.mem_sheds);
+    stats->errors = stat_get (etdata->stats.errors);
+    stats->errors_dropped = stat_get (etdata->stats.errors_dropped);
+    stats->slow_callbacks = stat_get (etdata->stats.slow_callbacks);
+    stats->loop_stalls = stat_get (etdata->stats.loop_stalls);
+    stats->io_enters = stat_get (etdata->stats.io_enters);
+}
+
+size_t
+fg_events_get_callback_stats (struct fg_events_data *etdata,
+                              struct fg_callback_stats *stats, size_t max)
+{
+    size_t n = 0;
+
+    for (int i = 0; i < FG_CALLBACK_STATS_SIZE; i++)
+      {
+        struct fg_callback_slot *slot = &etdata->cb_stats[i];
+
+        if (!__atomic_load_n (&slot->used, __ATOMIC_ACQUIRE))
+            continue;
+
+        if (n < max)
+          {
+            stats[n].id = slot->stats.id;
+            stats[n].count = stat_get (slot->stats.count);
+            stats[n].total_ns = stat_get (slot->stats.total_ns);
+            stats[n].max_ns = stat_get (slot->stats.max_ns);
+            stats[n].slow = stat_get (slot->stats.slow);
+          }
+        n++;
+      }
+
+    return n;
+}
+
+size_t
+fg_events_drain_errors (struct fg_events_data *etdata, struct fg_error *errors,
+                        size_t max)
+{
+    size_t n = 0;
+
+    while (n < max && error_ring_pop (&etdata->errors, &errors[n]))
+        n++;
+
+    return n;
+}
+
+int
+fg_events_format_error (const struct fg_error *error, char *buf, size_t len)
+{
+    if (error->errnum != 0)
+        return snprintf (buf, len, "fgevents: %s: %d: %s: %s\n",
+                         error->file, error->line, error->msg,
+                         strerror (error->errnum));
+
+    return snprintf (buf, len, "fgevents: %s: %d: %s\n", error->file,
+                     error->line, error->msg);
+}
+
+static void
+summarize_hist (const struct fg_hist *hist, struct fg_latency *latency)
+{
+    latency->count = hist->count;
+    latency->min = hist->min;
+    latency->max = hist->max;
+    latency->mean = hist->count > 0 ? hist->sum / hist->count : 0;
+    latency->p50 = fg_hist_percentile (hist, 50.0);
+    latency->p90 = fg_hist_percentile (hist, 90.0);
+    latency->p99 = fg_hist_percentile (hist, 99.0);
+    latency->p999 = fg_hist_percentile (hist, 99.9);
+}
+
+int
+fg_events_get_latency_hist (struct fg_events_data *etdata,
+                            enum fg_latency_kind kind, struct fg_hist *hist)
+{
+    if (kind < 0 || kind >= FG_LATENCY_KINDS)
+      {
+        errno = EINVAL;
+        return -1;
+      }
+
+    if (etdata->latency == NULL)
+      {
+        errno = ENODATA;
+        return -1;
+      }
+
+    fg_hist_snapshot (&etdata->latency[kind], hist);
+
+    return 0;
+}
+
+int
+fg_events_get_latency (struct fg_events_data *etdata,
+                       enum fg_latency_kind kind, struct fg_latency *latency)
+{
+    struct fg_hist *hist;
+
+    /* Too large for the stacks of the threads we are usually called on */
+    hist = malloc (sizeof (struct fg_hist));
+    if (hist == NULL)
+        return -1;
+
+    if (fg_events_get_latency_hist (etdata, kind, hist) < 0)
+      {
+        free (hist);
+        return -1;
+      }
+
+    summarize_hist (hist, latency);
+    free (hist);
+
+    return 0;
+}
+
+static void
+copy_conn_stats (struct client_t *client, struct fg_conn_stats *stats)
+{
+    stats->user_id = client->user_id;
+    stats->status = client->status;
+    stats->events_in = stat_get (client->stats.events_in);
+    stats->events_out = stat_get (client->stats.events_out);
+    stats->bytes_in = stat_get (client->stats.bytes_in);
+    stats->bytes_out = stat_get (client->stats.bytes_out);
+    stats->output_queued = stat_get (client->stats.output_queued);
+    stats->input_queued = stat_get (client->stats.input_queued);
+    stats->resume_bytes = stat_get (client->stats.resume_bytes);
+    stats->mem_bytes = stats->output_queued + stats->input_queued +
+                       stats->resume_bytes;
+}
+
+/* Helper function to walk the connections, must run on the events thread
+   since that is the only one changing the list of clients */
+static size_t
+collect_conn_stats (struct fg_events_data *itdata,
+                    struct fg_conn_stats *stats, size_t max)
+{
+    size_t n = 0;
+
+    if (!itdata->is_server)
+      {
+        if (max > 0)
+          {
+            copy_conn_stats (&itdata->self, &stats[0]);
+            stats[0].user_id = itdata->user_id;
+          }
+        return 1;
+      }
+
+    for (struct node *cur_head = itdata->clients;
+         cur_head != NULL;
+         cur_head = cur_head->next, n++)
+      {
+        if (n < max)
+            copy_conn_stats (cur_head->value, &stats[n]);
+      }
+
+    return n;
+}
+
+struct conn_stats_request {
+    struct fg_events_data *itdata;
+    struct fg_conn_stats  *stats;
+    size_t                max;
+    size_t                n;
+    sem_t                 done;
+};
+
+static void
+fg_conn_stats_cb (evutil_socket_t UNUSED(sig), short UNUSED(events),
+                  void *arg)
+{
+    struct conn_stats_request *req = arg;
+
+    req->n = collect_conn_stats (req->itdata, req->stats, req->max);
+    sem_post (&req->done);
+}
+
+ssize_t
+fg_events_get_conn_stats (struct fg_events_data *etdata,
+                          struct fg_conn_stats *stats, size_t max)
+{
+    struct conn_stats_request req;
+
+    if (etdata->base == NULL)
+      {
+        errno = EINVAL;
+        return -1;
+      }
+
+    /* Called from a callback, the list can be walked right away */
+    if (pthread_equal (pthread_self (), etdata->events_t))
+        return collect_conn_stats (etdata, stats, max);
+
+    req.itdata = etdata;
+    req.stats = stats;
+    req.max = max;
+    req.n = 0;
+    sem_init (&req.done, 0, 0);
+    if (event_base_once (etdata->base, -1, EV_TIMEOUT, fg_conn_stats_cb, &req,
+                         NULL) < 0)
+      {
+        sem_destroy (&req.done);
+        errno = EAGAIN;
+        return -1;
+      }
+    sem_wait (&req.done);
+    sem_destroy (&req.done);
+
+    return req.n;
+}
+
+/* Helper function to tell if any queued output is left on the connections.
+   Output already handed to the kernel is sent even after the socket is
+   closed */
+static void
+fg_check_drained (struct fg_events_data *itdata)
+{
+    if (itdata->is_server)
+      {
+        for (struct node *cur_head = itdata->clients;
+             cur_head != NULL;
+             cur_head = cur_head->next)
+          {
+            struct client_t *client = cur_head->value;
+            if (client->bev != NULL &&
+                evbuffer_get_length (bufferevent_get_output (client->bev)) > 0)
+                return;
+          }
+      }
+    else if (itdata->bev != NULL &&
+             evbuffer_get_length (bufferevent_get_output (itdata->bev)) > 0)
+      {
+        return;
+      }
+
+    fg_loop_exit (itdata, NULL);
+}
+
+static void
+fg_drain_cb (evutil_socket_t UNUSED(sig), short UNUSED(events), void *arg)
+{
+    struct fg_events_data *itdata = arg;
+
+    itdata->draining = true;
+    itdata->running = false;
+
+    /* Stop taking new connections and reconnecting */
+    if (itdata->listener_inet)
+        evconnlistener_disable (itdata->listener_inet);
+    if (itdata->listener_unix)
+        evconnlistener_disable (itdata->listener_unix);
+    if (itdata->pingev)
+        event_del (itdata->pingev);
+    if (itdata->reconnev)
+        event_del (itdata->reconnev);
+
+    /* Tear down at the deadline even if some peer is not reading, without
+       one only once everything is flushed */
+    if (!itdata->drain_unbounded)
+        fg_loop_exit (itdata, &itdata->drain_timeout);
+    fg_check_drained (itdata);
+}
+
+static void
+fg_events_drain (struct fg_events_data *itdata, const struct timeval *timeout)
+{
+    if (itdata->embedded && itdata->base == NULL)
+        return;
+
+    if (itdata->drainev == NULL)
+      {
+        fg_events_server_shutdown (itdata);
+        return;
+      }
+
+    itdata->drain_unbounded = timeout == NULL;
+    if (timeout != NULL)
+        itdata->drain_timeout = *timeout;
+
+    if (itdata->embedded)
+      {
+        fg_drain_cb (-1, 0, itdata);
+        return;
+      }
+
+    fg_watchdog_stop (itdata);
+    event_active (itdata->drainev, EV_WRITE, 0);
+    pthread_join (itdata->events_t, NULL);
+}
+
+void
+fg_events_server_drain (struct fg_events_data *itdata,
+                        const struct timeval *timeout)
+{
+    fg_events_drain (itdata, timeout);
+}
+
+void
+fg_events_client_drain (struct fg_events_data *itdata,
+                        const struct timeval *timeout)
+{
+    fg_send_disconnected_event (itdata);
+    fg_events_drain (itdata, timeout);
 }
 
 void
 fg_events_server_shutdown (struct fg_events_data *itdata)
 {    
+    if (itdata->embedded)
+      {
+        /* From one of our callbacks the bufferevent or event running it
+           would be freed under it, the loop tears down right after */
+        if (itdata->cb_depth > 0 && itdata->stopev != NULL)
+          {
+            itdata->running = false;
+            fg_loop_exit (itdata, NULL);
+          }
+        else
+            fg_events_stop (itdata);
+        return;
+      }
+
+    fg_watchdog_stop (itdata);
     if (itdata->exev)
       {
         event_active (itdata->exev, EV_WRITE, 0);
@@ -26,6 +26,7 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <stdbool.h>
 #include <semaphore.h>
 #include <pthread.h>
@@ -41,6 +42,10 @@
 #endif
 
 #include "list.h"
+#include "hist.h"
+#include "fglog.h"
+#include "capture.h"
+#include "uring.h"
 
 /* macro to supress unused parameter warnings */
 #ifdef UNUSED
@@ -50,8 +55,36 @@
 # define UNUSED(x) x
 #endif
 
+/* Error recorded by the library. Nothing is formatted when the error
+   happens, msg and file point to string literals */
+struct fg_error {
+    const char *msg;
+    const char *file;
+    int         line;
+    int         errnum;   /* errno at the time, zero if not applicable */
+    int8_t      user_id;  /* user id of the client involved or -1 */
+};
+
 typedef int (*fg_handle_event_cb)(void *, struct fgevent *, struct fgevent *);
 typedef void (*fg_handle_read_cb)(unsigned char *, size_t, void *);
+typedef void (*fg_handle_error_cb)(void *, const struct fg_error *);
+typedef void (*fg_handle_stall_cb)(void *, int32_t, uint64_t);
+
+/* Number of errors kept until they are handed out, must be a power of two.
+   Errors raised while the ring is full are counted and thrown away */
+#define FG_ERROR_RING_SIZE 64
+
+struct fg_error_slot {
+    uint32_t        seq;
+    struct fg_error error;
+};
+
+/* Bounded lock-free queue of errors, any thread may report or drain */
+struct fg_error_ring {
+    uint32_t             head;
+    uint32_t             tail;
+    struct fg_error_slot slots[FG_ERROR_RING_SIZE];
+};
 
 enum client_status {
     UNITIALIZED,
@@ -61,32 +94,269 @@ enum client_status {
     DROPPED
 };
 
+/* Marker, tags and flags of the optional extensions which may follow the
+   payload of a serialized event, see fgevents.c for the layout */
+#define FG_EXT_MARK 0x1F
+
+enum fg_ext_tag {
+    FG_EXT_SEQ = 1,
+    FG_EXT_SENT_TS,
+    FG_EXT_ECHO_TS
+};
+
+#define FG_EXT_HAS_SEQ     (1 << 0)
+#define FG_EXT_HAS_SENT_TS (1 << 1)
+#define FG_EXT_HAS_ECHO_TS (1 << 2)
+
+/* Largest payload, in entries, a frame may announce. Anything larger is
+   taken as a corrupt header and readers look for the next STX instead */
+#define FG_MAX_PAYLOAD_LENGTH (16 * 1024 * 1024)
+
+/* Decoded frame extensions, flags tells which of the fields are present.
+   Timestamps are CLOCK_REALTIME in nanoseconds, sent_ts is taken when the
+   producer sends the event and echo_ts is the sent_ts of the event a
+   writeback answer replies to */
+struct fg_frame_ext {
+    uint32_t flags;
+    uint32_t seq;
+    uint64_t sent_ts;
+    uint64_t echo_ts;
+};
+
+/* Latencies kept when track_latency is set, all of them in nanoseconds */
+enum fg_latency_kind {
+    FG_LATENCY_SERVER_HOP,   /* read by the server until queued for output */
+    FG_LATENCY_END_TO_END,   /* fg_send_event until the receiving callback */
+    FG_LATENCY_WRITEBACK,    /* fg_send_event until the answer arrives */
+    FG_LATENCY_KINDS
+};
+
+/* Summary of a latency histogram, see fg_events_get_latency */
+struct fg_latency {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+};
+
+/* Serialized event kept by the server so that it can be sent again to a
+   client resuming its session */
+struct fg_sent_frame {
+    uint32_t seq;
+    size_t len;
+    unsigned char *buf;
+};
+
+/* Counters of a single connection. They are updated with relaxed atomics,
+   use fg_events_get_conn_stats to take a snapshot */
+struct fg_conn_stats {
+    int8_t   user_id;
+    int      status;
+    uint64_t events_in;
+    uint64_t events_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t output_queued;   /* bytes waiting in the output buffer */
+    uint64_t input_queued;    /* bytes read but not handled yet */
+    uint64_t resume_bytes;    /* bytes kept for session resumption */
+    uint64_t mem_bytes;       /* sum of the three above */
+};
+
+/* Library wide counters. They are updated with relaxed atomics, use
+   fg_events_get_stats to take a snapshot from any thread */
+struct fg_events_stats {
+    uint64_t events_in;
+    uint64_t events_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t parse_failures;
+    uint64_t dispatch_misses; /* events for users which are not known */
+    uint64_t offline_events;  /* FG_USER_OFFLINE events sent */
+    uint64_t reconnects;      /* connection attempts after the first one */
+    uint64_t drops;           /* clients dropped by the liveness check */
+    uint64_t output_queued;   /* bytes waiting in all output buffers */
+    uint64_t input_queued;    /* bytes read but not handled yet */
+    uint64_t resume_bytes;    /* bytes kept for session resumption */
+    uint64_t mem_bytes;       /* sum of the three above, what mem_budget
+                                 is checked against */
+    uint64_t mem_pauses;      /* times producers were paused over budget */
+    uint64_t mem_sheds;       /* clients dropped over budget */
+    uint64_t errors;          /* errors reported */
+    uint64_t errors_dropped;  /* errors lost because the ring was full */
+    uint64_t slow_callbacks;  /* callbacks slower than callback_warn */
+    uint64_t loop_stalls;     /* times the watchdog found the loop stuck */
+    uint64_t io_enters;       /* io_uring_enter calls, with io_uring */
+};
+
+/* Time spent in the event callback for a single event id */
+struct fg_callback_stats {
+    int32_t  id;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t slow;            /* calls slower than callback_warn */
+};
+
+/* Number of event ids callback times are kept for, must be a power of two.
+   Ids seen after the table filled up are not timed */
+#define FG_CALLBACK_STATS_SIZE 64
+
+struct fg_callback_slot {
+    bool                     used;
+    struct fg_callback_stats stats;
+};
+
 /* Struct to carry around connection (client)-specific data. */
 struct client_t {
     int status;    
     int8_t conn_id;
     int8_t user_id;
     uint8_t failed;
+    uint32_t token;
+    uint32_t next_seq;
+    bool ext_ok;   /* the peer parses frame extensions */
+    struct fg_sent_frame *sent;
+    struct event *lingerev;
+    struct evbuffer_cb_entry *outcb;
+    struct fg_uring_conn *uring;  /* transport when io_uring is used */
+    size_t pending_in;  /* start of a frame left in the input buffer */
+    bool congested;     /* consumer pinning the most over the budget */
+    bool mem_paused;    /* not read from, it produces for a congested one */
+    struct fg_conn_stats stats;
     struct bufferevent *bev;
     struct fg_events_data *itdata;    
 };
 
+/* Default liveness policy: ping every second and drop a client after five
+   unanswered pings */
+#define FG_DEFAULT_PING_INTERVAL_SEC 1
+#define FG_DEFAULT_PING_MAX_FAILED   5
+
+/* Default reconnect policy: retry at once, then back off exponentially from
+   100 ms up to 10 seconds, randomly shortening each delay by up to 50% */
+#define FG_DEFAULT_RECONNECT_BASE_MSEC 100
+#define FG_DEFAULT_RECONNECT_MAX_SEC   10
+#define FG_DEFAULT_RECONNECT_JITTER    50
+
+/* Default session resumption policy: disabled, when enabled by setting a
+   window suspended sessions are kept for 10 seconds */
+#define FG_DEFAULT_RESUME_WINDOW     0
+#define FG_DEFAULT_RESUME_LINGER_SEC 10
+
+/* What the server does when its buffers exceed mem_budget. Backpressure
+   marks the consumer pinning the most as congested and stops reading from
+   the connections sending to it, until usage is back under three quarters
+   of the budget or all output is flushed, so those producers block in
+   their socket buffers. A congested consumer which does not read is still
+   dropped by the liveness check. Shedding drops the clients pinning the most
+   memory, which are the slow consumers and sessions kept for resuming.
+   With both, clients are shed before reading is paused */
+enum fg_mem_policy {
+    FG_MEM_BACKPRESSURE = 1 << 0,
+    FG_MEM_SHED         = 1 << 1
+};
+
+#define FG_DEFAULT_MEM_POLICY FG_MEM_BACKPRESSURE
+
+/* Default size of the capture ring, capturing is off unless a path is set */
+#define FG_DEFAULT_CAPTURE_SIZE (4 * 1024 * 1024)
+
+/* Default log level, messages are only logged when a sink is set */
+#define FG_DEFAULT_LOG_LEVEL FG_LOG_INFO
+
+/* Tunables which may be passed to the *_init_opts functions. Always call
+   fg_events_opts_init first so that fields added later get sane defaults. */
+struct fg_events_opts {
+    struct timeval ping_interval;   /* zero disables pinging clients */
+    uint8_t        ping_max_failed; /* zero never drops a client */
+    struct timeval reconnect_base;  /* delay before the second retry */
+    struct timeval reconnect_max;   /* upper bound of the retry delay */
+    uint8_t        reconnect_jitter; /* percent of the delay to randomize */
+    uint16_t       resume_window;   /* events kept per client for resuming,
+                                       zero disables session resumption */
+    struct timeval resume_linger;   /* how long a lost session is kept */
+    bool           track_latency;   /* timestamp events and keep latency
+                                       histograms, end-to-end latencies
+                                       need the clocks of the hosts to be
+                                       synchronized */
+    fg_handle_error_cb error_cb;    /* called on the events thread with
+                                       each error, when not set errors are
+                                       formatted into error and the event
+                                       callback is called without events */
+    fg_log_cb      log_cb;          /* sink of log messages, called on the
+                                       events thread, NULL disables logging */
+    uint8_t        log_level;       /* highest level passed to log_cb */
+    const char     *capture_path;   /* capture every frame read or written
+                                       into this file, kept across
+                                       restarts, see capture.h */
+    size_t         capture_size;    /* bytes of frames kept in the file */
+    struct timeval callback_warn;   /* warn about callbacks running longer,
+                                       zero disables timing callbacks */
+    struct timeval watchdog_timeout; /* report when the loop has not turned
+                                       for this long, zero disables it */
+    fg_handle_stall_cb stall_cb;    /* called from the watchdog thread with
+                                       the event id whose callback is
+                                       running (-1 if none) and how long
+                                       the loop has been stuck */
+    size_t         mem_budget;      /* bytes the server may hold in its
+                                       buffers, zero means no limit */
+    uint8_t        mem_policy;      /* enum fg_mem_policy flags */
+    const char     *metrics_path;   /* unix socket on which the server
+                                       hands out its metrics in the
+                                       Prometheus text format to anyone
+                                       connecting, see metrics.h */
+    struct timeval busy_poll;       /* poll the loop without sleeping until
+                                       it has been idle for this long,
+                                       trading a core for wakeup latency.
+                                       Zero disables it, ignored on an
+                                       event base of the caller */
+    uint32_t       busy_poll_usec;  /* SO_BUSY_POLL on the sockets, zero
+                                       leaves it to the system default */
+    bool           io_uring;        /* move the bytes of the event
+                                       connections with io_uring instead of
+                                       libevent, see uring.h. Falls back to
+                                       libevent with an error when the
+                                       kernel does not support it */
+};
+
 /* Struct to carry around fg events library data. */
 struct fg_events_data { 
     struct event_base     *base;
     struct evconnlistener *listener_inet;
     struct evconnlistener *listener_unix;
+    struct evconnlistener *listener_metrics;
     struct bufferevent    *bev;
     struct event          *exev;
     struct event          *pingev;
+    struct event          *reconnev;
+    struct event          *drainev;
+    struct event          *errev;
+    struct event          *beatev;
+    struct event          *stopev;
+    struct timeval        drain_timeout;
     pthread_t             events_t;
     llist                 clients;
+    llist                 metrics_conns;
+    uint8_t               dropped_users[256 / 8];
     fg_handle_event_cb    cb;
     fg_handle_read_cb     read_cb;
     sem_t                 init_flag;
+    bool                  init_pending;
+    unsigned int          reconnect_attempts;
+    unsigned int          rand_seed;
     int                   connstatus;
     bool                  is_server;
+    bool                  embedded;
     bool                  running;
+    bool                  draining;
+    bool                  drain_unbounded; /* drained without a deadline */
+    unsigned int          cb_depth;   /* callbacks of the caller running */
+    bool                  error_pending;
+    bool                  mem_paused;
     bool                  sigpipe_pending;
     bool                  sigpipe_unblock;
     void                  *user_data;
@@ -94,13 +364,40 @@ struct fg_events_data {
     uint16_t              port;
     int8_t                conn_id;
     int8_t                user_id;
+    uint32_t              resume_token;
+    uint32_t              last_seq;
+    struct fg_events_opts opts;
+    struct client_t       self;
+    struct fg_events_stats stats;
+    uint64_t              rx_mono_ns;
+    struct fg_hist        *latency; /* FG_LATENCY_KINDS histograms, only
+                                       with track_latency */
+    struct fg_error_ring  errors;
+    struct fg_capture     capture;
+    struct fg_uring       *uring;
+    pthread_t             watchdog_t;
+    sem_t                 watchdog_stop;
+    bool                  watchdog_running;
+    uint64_t              heartbeat_ns;
+    int32_t               cb_event_id;
+    bool                  in_callback;
+    struct fgevent        *cb_event;      /* event whose payload the running
+                                             callback may take */
+    struct fg_callback_slot cb_stats[FG_CALLBACK_STATS_SIZE];
     int                   save_errno;
     char                  error[512];     
 };
 
+/* Fill in default values for all tunables */
+extern void fg_events_opts_init (struct fg_events_opts *);
+
 /* Initialize libevent and add asynchronous event listener, register cb */
 extern int fg_events_server_init (struct fg_events_data *, fg_handle_event_cb,
                                   void *, uint16_t, char *, int8_t);
+extern int fg_events_server_init_opts (struct fg_events_data *,
+                                       fg_handle_event_cb, void *, uint16_t,
+                                       char *, int8_t,
+                                       const struct fg_events_opts *);
 
 extern int fg_events_client_init_inet (struct fg_events_data *,
                                        fg_handle_event_cb, fg_handle_read_cb,
@@ -108,24 +405,123 @@ extern int fg_events_client_init_inet (struct fg_events_data *,
 extern int fg_events_client_init_unix (struct fg_events_data *,
                                        fg_handle_event_cb, fg_handle_read_cb,
                                        void *, char *, int8_t);
+extern int fg_events_client_init_inet_opts (struct fg_events_data *,
+                                            fg_handle_event_cb,
+                                            fg_handle_read_cb, void *, char *,
+                                            uint16_t, int8_t,
+                                            const struct fg_events_opts *);
+extern int fg_events_client_init_unix_opts (struct fg_events_data *,
+                                            fg_handle_event_cb,
+                                            fg_handle_read_cb, void *, char *,
+                                            int8_t,
+                                            const struct fg_events_opts *);
+
+/* Variants running on an event base of the caller instead of a thread of
+   their own. Nothing is locked, so every function taking the
+   fg_events_data must be called from the thread running the base, and
+   SIGPIPE has to be ignored or blocked by the application. The client
+   returns before it is connected, the connection is made once the base
+   is dispatched. The base must outlive the shutdown */
+extern int fg_events_server_init_base (struct fg_events_data *,
+                                       struct event_base *,
+                                       fg_handle_event_cb, void *, uint16_t,
+                                       char *, int8_t,
+                                       const struct fg_events_opts *);
+extern int fg_events_client_init_inet_base (struct fg_events_data *,
+                                            struct event_base *,
+                                            fg_handle_event_cb,
+                                            fg_handle_read_cb, void *, char *,
+                                            uint16_t, int8_t,
+                                            const struct fg_events_opts *);
+extern int fg_events_client_init_unix_base (struct fg_events_data *,
+                                            struct event_base *,
+                                            fg_handle_event_cb,
+                                            fg_handle_read_cb, void *, char *,
+                                            int8_t,
+                                            const struct fg_events_opts *);
 
 /* Function to send event to server from client */
 extern int fg_send_event (struct fg_events_data *, struct fgevent *);
 extern int fg_send_data (struct fg_events_data *etdata, unsigned char *buf,
                          size_t len);
 
-/* Tear down event loop and cleanup */
+/* Take over the payload of the event handed to the callback, which saves
+   copying it to keep it around. The payload is the caller's to free from
+   then on. Only callable from the callback, and only for events with ids
+   from ABI on delivered to this instance, since the server still reads the
+   events it passes on. Returns NULL with errno set otherwise, or NULL if
+   the event has no payload */
+extern int32_t *fg_events_take_payload (struct fg_events_data *,
+                                        struct fgevent *);
+
+/* Tear down event loop and cleanup. Instances on an event base of the
+   caller shut down from one of their own callbacks tear down from the loop
+   once the callback has returned */
 extern void fg_events_server_shutdown (struct fg_events_data *);
 extern void fg_events_client_shutdown (struct fg_events_data *);
 
+/* Stop taking new input, flush queued output for at most the given time and
+   then tear down like the shutdown functions. A NULL timeout waits until
+   everything is flushed or the peers have gone, however long a peer takes
+   to read. Instances on an event base of the caller return at once and
+   tear down from the loop, shutting them down after that does nothing */
+extern void fg_events_server_drain (struct fg_events_data *,
+                                    const struct timeval *);
+extern void fg_events_client_drain (struct fg_events_data *,
+                                    const struct timeval *);
+
+/* Take a snapshot of the library wide counters, callable from any thread */
+extern void fg_events_get_stats (struct fg_events_data *,
+                                 struct fg_events_stats *);
+
+/* Take a snapshot of the counters of at most max connections, returns the
+   total number of connections or -1 on error. Runs on the events thread */
+extern ssize_t fg_events_get_conn_stats (struct fg_events_data *,
+                                         struct fg_conn_stats *, size_t);
+
+/* Take a snapshot of the callback times of at most max event ids, returns
+   the number of ids timed so far. Callable from any thread */
+extern size_t fg_events_get_callback_stats (struct fg_events_data *,
+                                            struct fg_callback_stats *,
+                                            size_t);
+
+/* Take at most max errors which were not handed out yet, returns how many
+   were taken. Callable from any thread */
+extern size_t fg_events_drain_errors (struct fg_events_data *,
+                                      struct fg_error *, size_t);
+
+/* Format an error like "fgevents: file: line: msg: strerror" */
+extern int fg_events_format_error (const struct fg_error *, char *, size_t);
+
+/* Summarize one of the latency histograms, callable from any thread.
+   Returns -1 if the kind is unknown or track_latency is not set */
+extern int fg_events_get_latency (struct fg_events_data *,
+                                  enum fg_latency_kind, struct fg_latency *);
+
+/* Copy one of the latency histograms as a whole, for exporting buckets */
+extern int fg_events_get_latency_hist (struct fg_events_data *,
+                                       enum fg_latency_kind, struct fg_hist *);
+
 /* Helper function to parse fgevent delimitted with STX and ETX
-   control characters */
+   control characters. Parsing starts at *p and skips ahead to the first
+   STX. Returns the offset of the ETX of the frame in buffer, with *p
+   pointing at it, and the payload allocated for the caller to free.
+   Returns 0 when no frame starts before len or when the frame is cut
+   short, with *p set to buffer + len; a frame cut short is parsed again
+   from its STX once the rest has arrived. Returns -1 on a corrupt header
+   or when the payload could not be allocated, with *p set where the next
+   frame may be looked for */
 extern int fg_parse_fgevent (struct fgevent *, unsigned char *, size_t,
                              unsigned char **);
+extern int fg_parse_fgevent_ext (struct fgevent *, struct fg_frame_ext *,
+                                 unsigned char *, size_t, unsigned char **);
 
 /* Helper function to buffer fgevent struct to memory that can be sent
    over network */
 extern int create_serialized_fgevent_buffer (unsigned char **,
                                              struct fgevent *);
+extern int create_serialized_fgevent_buffer_ext (unsigned char **,
+                                                 struct fgevent *,
+                                                 const struct fg_frame_ext *);
 
 #endif /* _FGEVENTS_H_ */
\ No newline at end of file
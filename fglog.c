@@ -0,0 +1,43 @@
+/*
+ *  fglog.c
+ *    Formatting of log messages passed to the sink set by the host program
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "fglog.h"
+
+/* Long enough for any message of the library, longer ones are truncated */
+#define FG_LOG_MSG_SIZE 256
+
+void
+fg_log_write (fg_log_cb cb, void *user_data, int level, const char *fmt, ...)
+{
+    va_list ap;
+    char msg[FG_LOG_MSG_SIZE];
+
+    va_start (ap, fmt);
+    vsnprintf (msg, sizeof msg, fmt, ap);
+    va_end (ap);
+
+    cb (user_data, level, msg);
+}
@@ -0,0 +1,63 @@
+/*
+ *  fglog.h
+ *    Log levels and macros used within fgevents
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _FGLOG_H_
+#define _FGLOG_H_
+
+#define FG_LOG_NONE  0
+#define FG_LOG_ERROR 1
+#define FG_LOG_WARN  2
+#define FG_LOG_INFO  3
+#define FG_LOG_DEBUG 4
+
+/* Highest level compiled into the library, messages above it are removed
+   along with their arguments. Build with LOG_LEVEL=4 to get debug output */
+#ifndef FG_LOG_LEVEL
+#define FG_LOG_LEVEL FG_LOG_INFO
+#endif
+
+/* Sink receiving formatted messages, see log_cb in fg_events_opts */
+typedef void (*fg_log_cb)(void *, int, const char *);
+
+/* Format a message and pass it to the sink */
+extern void fg_log_write (fg_log_cb, void *, int, const char *, ...)
+    __attribute__ ((format (printf, 4, 5)));
+
+/* Log a message if its level is compiled in and enabled at runtime. The
+   level check comes first so nothing is formatted when it is disabled */
+#define fg_log(etdata, level, ...)\
+        do\
+          {\
+            if ((level) <= FG_LOG_LEVEL &&\
+                (level) <= (etdata)->opts.log_level &&\
+                (etdata)->opts.log_cb != NULL)\
+                fg_log_write ((etdata)->opts.log_cb, (etdata)->user_data,\
+                              (level), __VA_ARGS__);\
+          } while (0)
+
+#define fg_log_error(etdata, ...) fg_log (etdata, FG_LOG_ERROR, __VA_ARGS__)
+#define fg_log_warn(etdata, ...)  fg_log (etdata, FG_LOG_WARN, __VA_ARGS__)
+#define fg_log_info(etdata, ...)  fg_log (etdata, FG_LOG_INFO, __VA_ARGS__)
+#define fg_log_debug(etdata, ...) fg_log (etdata, FG_LOG_DEBUG, __VA_ARGS__)
+
+#endif /* _FGLOG_H_ */
@@ -0,0 +1,63 @@
+/*
+ *  fgprobes.h
+ *    Static tracepoints placed within fgevents
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _FGPROBES_H_
+#define _FGPROBES_H_
+
+/* USDT probes of provider fgevents, built in whenever sys/sdt.h (from
+   systemtap-sdt-dev) is found, make SDT=0 leaves them out and SDT=1 insists
+   on them. An unused probe is a single nop, list them with e.g.
+   "bpftrace -l 'usdt:libfg-events.so.1:fgevents:*'".
+
+     frame_parsed  (user_id, id, length)     read from a connection
+     event_routed  (sender, receiver, id, status)
+                                              dispatched by the server,
+                                              status is the one of the
+                                              receiver or -1 if unknown
+     data_enqueued (user_id, len, queued)    written to an output buffer
+     connect       (user_id, resumed)        client connected
+     disconnect    (user_id)                 connection closed
+     drop          (user_id, failed)         dropped by the liveness check
+
+   Without SDT the probes and their arguments are compiled out */
+#if !defined(FG_HAVE_SDT) && !defined(FG_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define FG_HAVE_SDT
+#endif
+#endif
+
+#ifdef FG_HAVE_SDT
+#include <sys/sdt.h>
+
+#define FG_PROBE1(name, a)          DTRACE_PROBE1 (fgevents, name, a)
+#define FG_PROBE2(name, a, b)       DTRACE_PROBE2 (fgevents, name, a, b)
+#define FG_PROBE3(name, a, b, c)    DTRACE_PROBE3 (fgevents, name, a, b, c)
+#define FG_PROBE4(name, a, b, c, d) DTRACE_PROBE4 (fgevents, name, a, b, c, d)
+#else
+#define FG_PROBE1(name, a)          do {} while (0)
+#define FG_PROBE2(name, a, b)       do {} while (0)
+#define FG_PROBE3(name, a, b, c)    do {} while (0)
+#define FG_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif /* _FGPROBES_H_ */
@@ -0,0 +1,130 @@
+/*
+ *  hist.c
+ *    Log-linear histograms used to keep track of latencies without
+ *    allocating or locking on the events thread
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hist.h"
+
+static int
+bucket_index (uint64_t value)
+{
+    int msb, shift;
+
+    if (value >= (uint64_t) 1 << FG_HIST_MAX_BITS)
+        value = ((uint64_t) 1 << FG_HIST_MAX_BITS) - 1;
+
+    if (value < FG_HIST_SUB_COUNT)
+        return value;
+
+    msb = 63 - __builtin_clzll (value);
+    shift = msb - FG_HIST_SUB_BITS;
+
+    return (shift + 1) * FG_HIST_SUB_COUNT +
+           (int) ((value >> shift) - FG_HIST_SUB_COUNT);
+}
+
+uint64_t
+fg_hist_bucket_upper (int index)
+{
+    int shift;
+    uint64_t sub;
+
+    if (index < FG_HIST_SUB_COUNT)
+        return index;
+
+    shift = index / FG_HIST_SUB_COUNT - 1;
+    sub = index % FG_HIST_SUB_COUNT + FG_HIST_SUB_COUNT;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+void
+fg_hist_record (struct fg_hist *hist, uint64_t value)
+{
+    uint64_t count = __atomic_load_n (&hist->count, __ATOMIC_RELAXED);
+
+    /* Single writer, so plain read-modify-write is fine as long as each
+       store is atomic towards readers */
+    if (count == 0 || value < __atomic_load_n (&hist->min, __ATOMIC_RELAXED))
+        __atomic_store_n (&hist->min, value, __ATOMIC_RELAXED);
+    if (value > __atomic_load_n (&hist->max, __ATOMIC_RELAXED))
+        __atomic_store_n (&hist->max, value, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add (&hist->buckets[bucket_index (value)], 1,
+                        __ATOMIC_RELAXED);
+    __atomic_fetch_add (&hist->sum, value, __ATOMIC_RELAXED);
+    __atomic_store_n (&hist->count, count + 1, __ATOMIC_RELEASE);
+}
+
+void
+fg_hist_snapshot (const struct fg_hist *hist, struct fg_hist *snapshot)
+{
+    uint64_t count = 0;
+
+    snapshot->count = __atomic_load_n (&hist->count, __ATOMIC_ACQUIRE);
+    snapshot->sum = __atomic_load_n (&hist->sum, __ATOMIC_RELAXED);
+    snapshot->min = __atomic_load_n (&hist->min, __ATOMIC_RELAXED);
+    snapshot->max = __atomic_load_n (&hist->max, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < FG_HIST_BUCKETS; i++)
+      {
+        snapshot->buckets[i] = __atomic_load_n (&hist->buckets[i],
+                                                __ATOMIC_RELAXED);
+        count += snapshot->buckets[i];
+      }
+
+    /* Values recorded while copying make the buckets run ahead of count,
+       let the buckets decide so percentiles stay consistent */
+    snapshot->count = count;
+}
+
+uint64_t
+fg_hist_percentile (const struct fg_hist *hist, double percentile)
+{
+    uint64_t rank, seen = 0;
+
+    if (hist->count == 0)
+        return 0;
+
+    if (percentile >= 100.0)
+        return hist->max;
+
+    rank = (uint64_t) (percentile / 100.0 * hist->count);
+    if (rank == 0)
+        rank = 1;
+
+    for (int i = 0; i < FG_HIST_BUCKETS; i++)
+      {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+          {
+            uint64_t upper = fg_hist_bucket_upper (i);
+            return upper < hist->max ? upper : hist->max;
+          }
+      }
+
+    return hist->max;
+}
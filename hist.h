@@ -0,0 +1,60 @@
+/*
+ *  hist.h
+ *    The names of functions callable from within latency histograms
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdint.h>
+
+/* Values are recorded into log-linear buckets like HDR histograms do: every
+   power of two is split into 2^FG_HIST_SUB_BITS buckets, so any value is
+   off by at most 1/16th. Values from 2^FG_HIST_MAX_BITS ns (about 18
+   minutes) and up are counted in the last bucket */
+#define FG_HIST_SUB_BITS  4
+#define FG_HIST_SUB_COUNT (1 << FG_HIST_SUB_BITS)
+#define FG_HIST_MAX_BITS  40
+#define FG_HIST_BUCKETS   ((FG_HIST_MAX_BITS - FG_HIST_SUB_BITS + 1) *\
+                           FG_HIST_SUB_COUNT)
+
+struct fg_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[FG_HIST_BUCKETS];
+};
+
+/* Record a value, there may only be one thread recording into a histogram
+   but any thread may take snapshots at the same time */
+extern void fg_hist_record (struct fg_hist *, uint64_t);
+
+/* Copy a histogram which may be recorded into concurrently */
+extern void fg_hist_snapshot (const struct fg_hist *, struct fg_hist *);
+
+/* Highest value that is equivalent to the given percentile (0 - 100) */
+extern uint64_t fg_hist_percentile (const struct fg_hist *, double);
+
+/* Highest value counted in a bucket */
+extern uint64_t fg_hist_bucket_upper (int);
+
+#endif /* _HIST_H_ */
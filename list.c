@@ -66,7 +66,8 @@ int list_remove (llist *head, void *value)
 	if (head[0]->value == value)
 		return list_pop (head, NULL);
 
-	prev = curr = head[0]->next;
+	prev = *head;
+	curr = prev->next;
 	while (curr)
 	  {
 	  	if (curr->value == value)
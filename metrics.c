@@ -0,0 +1,248 @@
+/*
+ *  metrics.c
+ *    Export of the library counters and histograms in the Prometheus text
+ *    format, to be scraped by node exporters
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "metrics.h"
+
+#define NS_PER_SEC 1e9
+
+/* Connections are keyed by an int8_t user id, there can't be more */
+#define MAX_CONNS 256
+
+struct metric {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t     offset;
+};
+
+#define STAT(field, type, help)\
+        { "fgevents_" #field, type, help,\
+          offsetof (struct fg_events_stats, field) }
+#define CONN_STAT(field, type, help)\
+        { "fgevents_conn_" #field, type, help,\
+          offsetof (struct fg_conn_stats, field) }
+
+static const struct metric stats_metrics[] = {
+    STAT (events_in, "counter", "Events read."),
+    STAT (events_out, "counter", "Events written."),
+    STAT (bytes_in, "counter", "Bytes read."),
+    STAT (bytes_out, "counter", "Bytes written."),
+    STAT (parse_failures, "counter", "Frames which could not be parsed."),
+    STAT (dispatch_misses, "counter", "Events for users which are not known."),
+    STAT (offline_events, "counter", "FG_USER_OFFLINE events sent."),
+    STAT (reconnects, "counter", "Connection attempts after the first one."),
+    STAT (drops, "counter", "Clients dropped by the liveness check."),
+    STAT (output_queued, "gauge", "Bytes waiting in output buffers."),
+    STAT (input_queued, "gauge", "Bytes read but not handled yet."),
+    STAT (resume_bytes, "gauge", "Bytes kept for session resumption."),
+    STAT (mem_bytes, "gauge", "Bytes checked against the memory budget."),
+    STAT (mem_pauses, "counter", "Times producers were paused over budget."),
+    STAT (mem_sheds, "counter", "Clients dropped over budget."),
+    STAT (errors, "counter", "Errors reported."),
+    STAT (errors_dropped, "counter", "Errors lost because the ring was full."),
+    STAT (slow_callbacks, "counter", "Callbacks slower than callback_warn."),
+    STAT (loop_stalls, "counter", "Times the watchdog found the loop stuck."),
+    STAT (io_enters, "counter", "io_uring_enter calls.")
+};
+
+static const struct metric conn_metrics[] = {
+    CONN_STAT (events_in, "counter", "Events read from the connection."),
+    CONN_STAT (events_out, "counter", "Events written to the connection."),
+    CONN_STAT (bytes_in, "counter", "Bytes read from the connection."),
+    CONN_STAT (bytes_out, "counter", "Bytes written to the connection."),
+    CONN_STAT (output_queued, "gauge", "Bytes waiting in the output buffer."),
+    CONN_STAT (mem_bytes, "gauge", "Bytes pinned by the connection.")
+};
+
+static const char *latency_kinds[FG_LATENCY_KINDS] = {
+    [FG_LATENCY_SERVER_HOP] = "server_hop",
+    [FG_LATENCY_END_TO_END] = "end_to_end",
+    [FG_LATENCY_WRITEBACK]  = "writeback"
+};
+
+static inline uint64_t
+field (const void *stats, size_t offset)
+{
+    return *(const uint64_t *) ((const char *) stats + offset);
+}
+
+static void
+format_header (struct evbuffer *out, const char *name, const char *type,
+               const char *help)
+{
+    evbuffer_add_printf (out, "# HELP %s %s\n# TYPE %s %s\n", name, help,
+                         name, type);
+}
+
+static void
+format_callbacks (struct fg_events_data *etdata, struct evbuffer *out)
+{
+    size_t n;
+    struct fg_callback_stats stats[FG_CALLBACK_STATS_SIZE];
+
+    n = fg_events_get_callback_stats (etdata, stats, FG_CALLBACK_STATS_SIZE);
+    if (n == 0)
+        return;
+    if (n > FG_CALLBACK_STATS_SIZE)
+        n = FG_CALLBACK_STATS_SIZE;
+
+    format_header (out, "fgevents_callback_calls_total", "counter",
+                   "Calls of the event callback.");
+    for (size_t i = 0; i < n; i++)
+        evbuffer_add_printf (out,
+                             "fgevents_callback_calls_total{id=\"%d\"} %llu\n",
+                             stats[i].id,
+                             (unsigned long long) stats[i].count);
+
+    format_header (out, "fgevents_callback_seconds_total", "counter",
+                   "Time spent in the event callback.");
+    for (size_t i = 0; i < n; i++)
+        evbuffer_add_printf (out,
+                             "fgevents_callback_seconds_total{id=\"%d\"} %.9f\n",
+                             stats[i].id, stats[i].total_ns / NS_PER_SEC);
+
+    format_header (out, "fgevents_callback_max_seconds", "gauge",
+                   "Longest call of the event callback.");
+    for (size_t i = 0; i < n; i++)
+        evbuffer_add_printf (out,
+                             "fgevents_callback_max_seconds{id=\"%d\"} %.9f\n",
+                             stats[i].id, stats[i].max_ns / NS_PER_SEC);
+
+    format_header (out, "fgevents_callback_slow_total", "counter",
+                   "Calls slower than callback_warn.");
+    for (size_t i = 0; i < n; i++)
+        evbuffer_add_printf (out,
+                             "fgevents_callback_slow_total{id=\"%d\"} %llu\n",
+                             stats[i].id,
+                             (unsigned long long) stats[i].slow);
+}
+
+/* Helper function to fold a log-linear histogram into the fixed power of
+   two buckets. Bucket index (n - FG_HIST_SUB_BITS + 1) * FG_HIST_SUB_COUNT
+   is the first one holding values from 2^n ns */
+static int
+format_latency (struct fg_events_data *etdata, struct evbuffer *out)
+{
+    struct fg_hist *hist;
+    const char *name = "fgevents_latency_seconds";
+
+    /* Too large for the stacks of the threads we are usually called on */
+    hist = malloc (sizeof (struct fg_hist));
+    if (hist == NULL)
+        return -1;
+
+    format_header (out, name, "histogram", "Latency of events.");
+    for (int kind = 0; kind < FG_LATENCY_KINDS; kind++)
+      {
+        int i = 0;
+        uint64_t count = 0;
+
+        fg_events_get_latency_hist (etdata, kind, hist);
+
+        for (int n = FG_METRICS_LE_MIN; n <= FG_METRICS_LE_MAX; n++)
+          {
+            int end = (n - FG_HIST_SUB_BITS + 1) * FG_HIST_SUB_COUNT;
+
+            for (; i < end; i++)
+                count += hist->buckets[i];
+            evbuffer_add_printf (out, "%s_bucket{kind=\"%s\",le=\"%.9g\"} "
+                                 "%llu\n", name, latency_kinds[kind],
+                                 (double) (1ULL << n) / NS_PER_SEC,
+                                 (unsigned long long) count);
+          }
+        evbuffer_add_printf (out, "%s_bucket{kind=\"%s\",le=\"+Inf\"} %llu\n",
+                             name, latency_kinds[kind],
+                             (unsigned long long) hist->count);
+        evbuffer_add_printf (out, "%s_sum{kind=\"%s\"} %.9f\n", name,
+                             latency_kinds[kind], hist->sum / NS_PER_SEC);
+        evbuffer_add_printf (out, "%s_count{kind=\"%s\"} %llu\n", name,
+                             latency_kinds[kind],
+                             (unsigned long long) hist->count);
+      }
+
+    free (hist);
+
+    return 0;
+}
+
+int
+fg_metrics_format (struct fg_events_data *etdata, struct evbuffer *out)
+{
+    ssize_t n;
+    struct fg_events_stats stats;
+    struct fg_conn_stats *conns;
+
+    fg_events_get_stats (etdata, &stats);
+    for (size_t i = 0; i < sizeof (stats_metrics) / sizeof (struct metric); i++)
+      {
+        const struct metric *m = &stats_metrics[i];
+        const char *suffix = m->type[0] == 'c' ? "_total" : "";
+
+        evbuffer_add_printf (out, "# HELP %s%s %s\n# TYPE %s%s %s\n%s%s %llu\n",
+                             m->name, suffix, m->help, m->name, suffix,
+                             m->type, m->name, suffix,
+                             (unsigned long long) field (&stats, m->offset));
+      }
+
+    conns = malloc (MAX_CONNS * sizeof (struct fg_conn_stats));
+    if (conns == NULL)
+        return -1;
+
+    n = fg_events_get_conn_stats (etdata, conns, MAX_CONNS);
+    if (n > MAX_CONNS)
+        n = MAX_CONNS;
+    for (size_t i = 0; n > 0 &&
+                       i < sizeof (conn_metrics) / sizeof (struct metric); i++)
+      {
+        const struct metric *m = &conn_metrics[i];
+        const char *suffix = m->type[0] == 'c' ? "_total" : "";
+
+        evbuffer_add_printf (out, "# HELP %s%s %s\n# TYPE %s%s %s\n",
+                             m->name, suffix, m->help, m->name, suffix,
+                             m->type);
+        for (ssize_t j = 0; j < n; j++)
+          {
+            /* Only one connection at a time is announced as a user, the
+               others would repeat its series or share user_id 0 */
+            if (conns[j].status != CONNECTED)
+                continue;
+            evbuffer_add_printf (out, "%s%s{user_id=\"%d\"} %llu\n", m->name,
+                                 suffix, conns[j].user_id,
+                                 (unsigned long long)
+                                 field (&conns[j], m->offset));
+          }
+      }
+    free (conns);
+
+    format_callbacks (etdata, out);
+
+    if (etdata->opts.track_latency)
+        return format_latency (etdata, out);
+
+    return 0;
+}
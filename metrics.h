@@ -0,0 +1,42 @@
+/*
+ *  metrics.h
+ *    The names of functions callable from within metrics export
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <event2/buffer.h>
+
+#include "fgevents.h"
+
+/* Latency histograms are exported with a bucket for every power of two
+   nanoseconds from 2^FG_METRICS_LE_MIN (about 1 us) up to 2^FG_METRICS_LE_MAX
+   (about 17 s), which keeps the series the same from scrape to scrape */
+#define FG_METRICS_LE_MIN 10
+#define FG_METRICS_LE_MAX 34
+
+/* Append the counters, connections, callback times and latency histograms
+   of etdata to out in the Prometheus text format. Safe to call from any
+   thread, including the events thread */
+extern int fg_metrics_format (struct fg_events_data *, struct evbuffer *);
+
+#endif /* _METRICS_H_ */
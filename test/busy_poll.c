@@ -0,0 +1,144 @@
+/*
+ *  busy_poll.c
+ *    Integration test to check if events keep flowing with the events
+ *    threads polling their loops, and that an idle loop goes back to
+ *    blocking once the spin budget is used up.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define EVENT_ID (ABI + 1)
+#define SERVER_ID 1
+#define CLIENT_ID 2
+#define NUM_EVENTS 1000
+
+/* A loop spinning through the idle period would take its whole share of
+   the CPU, a blocked one next to nothing */
+#define IDLE_MSEC 1000
+#define MAX_IDLE_CPU_PERCENT 20
+
+static sem_t answered;
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent *fgev,
+                 struct fgevent *ansev)
+{
+    if (fgev == NULL || fgev->id != EVENT_ID)
+        return 0;
+
+    ansev->id = EVENT_ID;
+    ansev->receiver = fgev->sender;
+    ansev->writeback = 0;
+    ansev->length = 0;
+    ansev->payload = NULL;
+
+    return 1;
+}
+
+static int
+client_callback (void * UNUSED(arg), struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    if (fgev != NULL && fgev->id == EVENT_ID)
+        sem_post (&answered);
+
+    return 0;
+}
+
+static uint64_t
+ns_of (clockid_t cid)
+{
+    struct timespec ts;
+
+    clock_gettime (cid, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int
+main (void)
+{
+    clockid_t cid;
+    uint64_t cpu, wall;
+    struct timespec deadline;
+    struct fg_events_opts opts;
+    struct fg_events_data server, client;
+    struct fgevent fgev = {EVENT_ID, 0, SERVER_ID, 1, 0, NULL};
+
+    sem_init (&answered, 0, 0);
+
+    fg_events_opts_init (&opts);
+    opts.busy_poll.tv_usec = 20 * 1000;
+    opts.busy_poll_usec = 50;
+    timerclear (&opts.ping_interval);
+
+    if (fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                    NULL, SERVER_ID, &opts) < 0 ||
+        fg_events_client_init_inet_opts (&client, &client_callback, NULL,
+                                         NULL, "127.0.0.1", server.port,
+                                         CLIENT_ID, &opts) < 0)
+      {
+        PRINT_FAIL ("init");
+        exit (EXIT_FAILURE);
+      }
+
+    for (int i = 0; i < NUM_EVENTS; i++)
+      {
+        fg_send_event (&client, &fgev);
+
+        clock_gettime (CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 5;
+        if (sem_timedwait (&answered, &deadline) < 0)
+          {
+            PRINT_FAIL ("answer to event %d", i);
+            exit (EXIT_FAILURE);
+          }
+      }
+
+    /* Nothing happens from now on, the server thread should block */
+    usleep (100 * 1000);
+    pthread_getcpuclockid (server.events_t, &cid);
+    cpu = ns_of (cid);
+    wall = ns_of (CLOCK_MONOTONIC);
+    usleep (IDLE_MSEC * 1000);
+    cpu = ns_of (cid) - cpu;
+    wall = ns_of (CLOCK_MONOTONIC) - wall;
+    if (cpu * 100 > wall * MAX_IDLE_CPU_PERCENT)
+      {
+        PRINT_FAIL ("idle server used %llu of %llu ns",
+                    (unsigned long long) cpu, (unsigned long long) wall);
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_client_shutdown (&client);
+    fg_events_server_shutdown (&server);
+    sem_destroy (&answered);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,275 @@
+/*
+ *  capture.c
+ *    Integration test to check if a server captures the frames it reads
+ *    and writes into its ring file, keeping the newest ones when the ring
+ *    wraps around.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/capture.sock"
+#define CAPTURE_PATH "/tmp/capture.fgcap"
+#define ROTATED_PATH CAPTURE_PATH ".1"
+#define CAPTURE_SIZE 8192
+#define EVENT_ID ABI
+#define SENDER_ID 2
+#define RECEIVER_ID 3
+#define NUM_EVENTS 200
+
+struct test_struct {
+    int received_count;
+    sem_t *sem;
+    pthread_mutex_t *mutex;
+};
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+client_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    if (fgev == NULL)
+        return 0;
+
+    pthread_mutex_lock (test_data->mutex);
+    if (fgev->id == EVENT_ID && ++test_data->received_count == NUM_EVENTS)
+        sem_post (test_data->sem);
+    pthread_mutex_unlock (test_data->mutex);
+
+    return 0;
+}
+
+/* The records of the sender and the receiver carry the conn_id the server
+   confirmed to them */
+static int
+check_capture (int8_t sender_conn, int8_t receiver_conn)
+{
+    int s, in_count = 0, out_count = 0, bad_conn = 0;
+    int32_t last_in = -1, last_out = -1;
+    uint64_t last_ts = 0;
+    struct fg_capture_reader reader;
+    const struct fg_capture_record *rec;
+    const unsigned char *frame;
+
+    if (fg_capture_reader_open (&reader, CAPTURE_PATH) < 0)
+      {
+        PRINT_FAIL ("fg_capture_reader_open");
+        return -1;
+      }
+
+    while ((s = fg_capture_reader_next (&reader, &rec, &frame)) > 0)
+      {
+        struct fgevent fgev;
+        unsigned char *buf, *ptr;
+
+        buf = malloc (rec->len);
+        memcpy (buf, frame, rec->len);
+        ptr = buf;
+        if (rec->ts < last_ts ||
+            fg_parse_fgevent (&fgev, buf, rec->len, &ptr) <= 0)
+          {
+            PRINT_FAIL ("corrupt record");
+            return -1;
+          }
+        last_ts = rec->ts;
+
+        if (fgev.id == EVENT_ID)
+          {
+            if (rec->dir == FG_CAPTURE_IN && rec->user_id == SENDER_ID)
+              {
+                in_count++, last_in = fgev.payload[0];
+                bad_conn += rec->conn_id != sender_conn;
+              }
+            else if (rec->dir == FG_CAPTURE_OUT &&
+                     rec->user_id == RECEIVER_ID)
+              {
+                out_count++, last_out = fgev.payload[0];
+                bad_conn += rec->conn_id != receiver_conn;
+              }
+          }
+
+        if (fgev.length > 0)
+            free (fgev.payload);
+        free (buf);
+      }
+
+    /* The ring is far too small for everything, only the tail is left */
+    if (s < 0 || reader.hdr->tail == 0 || in_count == 0 || out_count == 0 ||
+        in_count >= NUM_EVENTS || last_in != NUM_EVENTS - 1 ||
+        last_out != NUM_EVENTS - 1 || bad_conn > 0 ||
+        sender_conn == receiver_conn)
+      {
+        PRINT_FAIL ("capture contents ([%d, %d, %d, %d, %d])", in_count,
+                    out_count, last_in, last_out, bad_conn);
+        return -1;
+      }
+
+    fg_capture_reader_close (&reader);
+
+    return 0;
+}
+
+/* Head of the ring in the file at path, 0 when there is none */
+static uint64_t
+capture_head (const char *path)
+{
+    uint64_t head;
+    struct fg_capture_reader reader;
+
+    if (fg_capture_reader_open (&reader, path) < 0)
+        return 0;
+    head = reader.hdr->head;
+    fg_capture_reader_close (&reader);
+
+    return head;
+}
+
+/* Open the capture again as a restart would, the frames from before must
+   still be there. A ring of another size must not be lost either */
+static int
+check_restart (void)
+{
+    uint64_t head = capture_head (CAPTURE_PATH);
+    struct fg_capture cap;
+    unsigned char frame[] = {0x02, 0x03};
+
+    if (fg_capture_open (&cap, CAPTURE_PATH, CAPTURE_SIZE) < 0)
+      {
+        PRINT_FAIL ("fg_capture_open on an existing capture");
+        return -1;
+      }
+    fg_capture_frame (&cap, FG_CAPTURE_IN, 0, SENDER_ID, frame,
+                      sizeof (frame));
+    fg_capture_close (&cap);
+
+    if (head == 0 || capture_head (CAPTURE_PATH) <= head)
+      {
+        PRINT_FAIL ("capture continued after a restart");
+        return -1;
+      }
+    head = capture_head (CAPTURE_PATH);
+
+    unlink (ROTATED_PATH);
+    if (fg_capture_open (&cap, CAPTURE_PATH, 2 * CAPTURE_SIZE) < 0)
+      {
+        PRINT_FAIL ("fg_capture_open with another size");
+        return -1;
+      }
+    fg_capture_close (&cap);
+
+    if (capture_head (ROTATED_PATH) != head ||
+        capture_head (CAPTURE_PATH) != 0)
+      {
+        PRINT_FAIL ("capture of another size rotated");
+        return -1;
+      }
+
+    unlink (ROTATED_PATH);
+    return 0;
+}
+
+int
+main (void)
+{
+    int i, s;
+    sem_t pass_test_sem;
+    pthread_mutex_t mutex;
+    struct timespec ts;
+    struct test_struct test_data;
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+    struct fg_events_data sender, receiver;
+    struct fgevent fgev;
+
+    sem_init (&pass_test_sem, 0, 0);
+
+    memset (&test_data, 0, sizeof (test_data));
+    test_data.sem = &pass_test_sem;
+
+    pthread_mutex_init (&mutex, NULL);
+    test_data.mutex = &mutex;
+
+    /* Nothing left over from an earlier run */
+    unlink (CAPTURE_PATH);
+
+    fg_events_opts_init (&opts);
+    opts.capture_path = CAPTURE_PATH;
+    opts.capture_size = CAPTURE_SIZE;
+    fg_events_server_init_opts (&server, &server_callback, NULL, 0, SOCK_PATH,
+                                1, &opts);
+    fg_events_client_init_unix (&receiver, &client_callback, NULL,
+                                &test_data, SOCK_PATH, RECEIVER_ID);
+    fg_events_client_init_unix (&sender, &client_callback, NULL, &test_data,
+                                SOCK_PATH, SENDER_ID);
+
+    usleep (100 * 1000); // make sure all clients are connected
+
+    for (i = 0; i < NUM_EVENTS; i++)
+      {
+        int32_t index = i;
+
+        fgev.id = EVENT_ID;
+        fgev.receiver = RECEIVER_ID;
+        fgev.writeback = 0;
+        fgev.length = 1;
+        fgev.payload = &index;
+        fg_send_event (&sender, &fgev);
+      }
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += 2;
+    s = sem_timedwait (&pass_test_sem, &ts);
+    if (s < 0)
+      {
+        PRINT_FAIL ("only %d events received", test_data.received_count);
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_client_shutdown (&sender);
+    fg_events_client_shutdown (&receiver);
+    fg_events_server_shutdown (&server);
+
+    if (check_capture (sender.conn_id, receiver.conn_id) < 0 ||
+        check_restart () < 0)
+        exit (EXIT_FAILURE);
+
+    unlink (CAPTURE_PATH);
+    sem_destroy (&pass_test_sem);
+    pthread_mutex_destroy (&mutex);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,213 @@
+/*
+ *  client_churn.c
+ *    Integration test to check that connecting and disconnecting over and
+ *    over again leaves neither clients in the list nor memory behind.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/client_churn.sock"
+#define SERVER_ID 1
+#define FIRST_USER_ID 2
+
+/* Connections opened at once, each announcing a user id of its own */
+#define BATCH 100
+
+/* Plain connections, which are cheap, and library clients, which take a
+   thread each. The first rounds are not measured so the allocator and the
+   libevent tables have grown to their working size */
+#define SOCKET_ROUNDS 300
+#define CLIENT_ROUNDS 300
+#define WARMUP_ROUNDS 50
+
+/* A single leaked client_t per connection would be several megabytes */
+#define MAX_GROWTH (512 * 1024)
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+client_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static long
+rss_bytes (void)
+{
+    long pages = 0;
+    FILE *fp = fopen ("/proc/self/statm", "r");
+
+    if (fp == NULL)
+        return 0;
+    if (fscanf (fp, "%*d %ld", &pages) != 1)
+        pages = 0;
+    fclose (fp);
+
+    return pages * sysconf (_SC_PAGESIZE);
+}
+
+/* Wait until the server has let go of every connection */
+static int
+wait_empty (struct fg_events_data *server)
+{
+    for (int i = 0; i < 5000; i++)
+      {
+        if (fg_events_get_conn_stats (server, NULL, 0) == 0)
+            return 0;
+        usleep (1000);
+      }
+
+    return -1;
+}
+
+/* Open a batch of connections which announce themselves and hang up */
+static int
+churn_sockets (struct fg_events_data *server)
+{
+    int fds[BATCH];
+    int32_t payload[] = {-1};
+    struct fgevent fgev = {FG_CONNECTED, 0, 0, 0, 1, &(payload[0])};
+    struct sockaddr_un sun;
+
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_LOCAL;
+    strncpy (sun.sun_path, SOCK_PATH, sizeof (sun.sun_path) - 1);
+
+    for (int i = 0; i < BATCH; i++)
+      {
+        int len;
+        unsigned char *buf;
+
+        fds[i] = socket (AF_LOCAL, SOCK_STREAM, 0);
+        if (fds[i] < 0 ||
+            connect (fds[i], (struct sockaddr *) &sun, sizeof (sun)) < 0)
+            return -1;
+
+        fgev.sender = FIRST_USER_ID + i;
+        len = create_serialized_fgevent_buffer (&buf, &fgev);
+        if (len < 0)
+            return -1;
+        if (write (fds[i], buf, len) != len)
+          {
+            free (buf);
+            return -1;
+          }
+        free (buf);
+      }
+
+    /* Half of them are closed before the server had a chance to see the
+       announcement, the other half after */
+    for (int i = 0; i < BATCH; i += 2)
+        close (fds[i]);
+    usleep (1000);
+    for (int i = 1; i < BATCH; i += 2)
+        close (fds[i]);
+
+    return wait_empty (server);
+}
+
+static int
+churn_client (struct fg_events_data *server, int round)
+{
+    struct fg_events_data client;
+
+    if (fg_events_client_init_unix (&client, &client_callback, NULL, NULL,
+                                    SOCK_PATH,
+                                    FIRST_USER_ID + round % BATCH) < 0)
+        return -1;
+    fg_events_client_shutdown (&client);
+
+    return wait_empty (server);
+}
+
+int
+main (void)
+{
+    long start_rss = 0, end_rss;
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+
+    /* A server listening on inet only comes and goes as well */
+    if (fg_events_server_init (&server, &server_callback, NULL, 0, NULL,
+                               SERVER_ID) < 0)
+      {
+        PRINT_FAIL ("inet only server init");
+        exit (EXIT_FAILURE);
+      }
+    fg_events_server_shutdown (&server);
+
+    fg_events_opts_init (&opts);
+    /* Pings would race the connections going away */
+    timerclear (&opts.ping_interval);
+    if (fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                    SOCK_PATH, SERVER_ID, &opts) < 0)
+      {
+        PRINT_FAIL ("server init");
+        exit (EXIT_FAILURE);
+      }
+
+    for (int i = 0; i < SOCKET_ROUNDS; i++)
+      {
+        if (i == WARMUP_ROUNDS)
+            start_rss = rss_bytes ();
+        if (churn_sockets (&server) < 0)
+          {
+            PRINT_FAIL ("socket churn round %d", i);
+            exit (EXIT_FAILURE);
+          }
+      }
+
+    for (int i = 0; i < CLIENT_ROUNDS; i++)
+      {
+        if (churn_client (&server, i) < 0)
+          {
+            PRINT_FAIL ("client churn round %d", i);
+            exit (EXIT_FAILURE);
+          }
+      }
+
+    end_rss = rss_bytes ();
+    if (end_rss - start_rss > MAX_GROWTH)
+      {
+        PRINT_FAIL ("rss grew from %ld to %ld bytes over %d connections",
+                    start_rss, end_rss,
+                    (SOCKET_ROUNDS - WARMUP_ROUNDS) * BATCH + CLIENT_ROUNDS);
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_server_shutdown (&server);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
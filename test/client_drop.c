@@ -0,0 +1,184 @@
+/*
+ *  client_drop.c
+ *    Integration test to check if a server with a custom liveness policy
+ *    drops and reclaims an unresponsive client in time, and that senders are
+ *    still told the dropped user is offline.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define EVENT_ID ABI
+#define SENDER_ID 2
+#define DROPPED_ID 3
+int32_t payload[] = {0x01, 0x02, 0x03};
+struct fgevent event = {EVENT_ID, 0, DROPPED_ID, 0, 3, &(payload[0])};
+sem_t silence_gate;
+
+struct test_struct {
+    int has_been_rejected;
+    sem_t *sem;
+    pthread_mutex_t *mutex;
+};
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+client_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    pthread_mutex_lock (test_data->mutex);
+    if (fgev == NULL)
+      {
+        PRINT_FAIL ("fgevent error");
+        exit (EXIT_FAILURE);
+      }
+
+    switch (fgev->id)
+      {
+        case FG_CONFIRMED:
+            break;
+        case FG_ALIVE:
+            break;
+        case FG_USER_OFFLINE:
+            test_data->has_been_rejected = 1;
+            sem_post (test_data->sem);
+            break;
+        default:
+            goto FAIL;
+            break;
+      }
+
+    pthread_mutex_unlock (test_data->mutex);
+
+    return 0;
+
+    FAIL:
+    PRINT_FAIL ("test");
+    exit (EXIT_FAILURE);
+}
+
+/* Blocks the events thread of the second client in its first callback, so
+   it stops answering pings without closing its socket */
+static int
+silenced_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                   struct fgevent * UNUSED(ansev))
+{
+    sem_wait (&silence_gate);
+    sem_post (&silence_gate);
+
+    return 0;
+}
+
+/* Start a server pinging every ping_usec and dropping after max_failed
+   unanswered pings, and check that the silenced client goes */
+static void
+run_drop (long ping_usec, uint8_t max_failed)
+{
+    int s;
+    sem_t pass_test_sem;
+    pthread_mutex_t mutex;
+    struct timespec ts;
+    struct test_struct test_data;
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+    struct fg_events_data clients[2];
+    struct fgevent fgev;
+
+    sem_init (&pass_test_sem, 0, 0);
+    sem_init (&silence_gate, 0, 0);
+
+    memset (&test_data, 0, sizeof (test_data));
+    test_data.sem = &pass_test_sem;
+
+    pthread_mutex_init (&mutex, NULL);
+    test_data.mutex = &mutex;
+
+    fg_events_opts_init (&opts);
+    opts.ping_interval.tv_sec = 0;
+    opts.ping_interval.tv_usec = ping_usec;
+    opts.ping_max_failed = max_failed;
+
+    fg_events_server_init_opts (&server, &server_callback, &test_data, 0,
+                                "/tmp/client_drop.sock", 1, &opts);
+
+    fg_events_client_init_unix (&clients[0], &client_callback, NULL,
+                                &test_data, server.addr, SENDER_ID);
+    fg_events_client_init_unix (&clients[1], &silenced_callback, NULL,
+                                NULL, server.addr, DROPPED_ID);
+
+    usleep (100 * 1000); // make sure all clients are connected
+
+    usleep (ping_usec * (max_failed + 8)); // well above max_failed pings
+
+    pthread_mutex_lock (test_data.mutex);
+    memcpy (&fgev, &event, sizeof (struct fgevent));
+    fg_send_event (&clients[0], &fgev);
+    pthread_mutex_unlock (test_data.mutex);
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+
+    ts.tv_sec += 1;
+    s = sem_timedwait (&pass_test_sem, &ts);
+    if (s < 0)
+      {
+        if (errno == ETIMEDOUT)
+            PRINT_FAIL ("test timeout (%d pings)", max_failed);
+        else
+            PRINT_FAIL ("unknown error");
+        exit (EXIT_FAILURE);
+      }
+    fg_events_client_shutdown (&clients[0]);
+    fg_events_server_shutdown (&server);
+    sem_post (&silence_gate);
+    fg_events_client_shutdown (&clients[1]);
+
+    sem_destroy (&pass_test_sem);
+    sem_destroy (&silence_gate);
+    pthread_mutex_destroy (&mutex);
+}
+
+int
+main (void)
+{
+    /* Ping every 50 ms and drop after two unanswered pings */
+    run_drop (50 * 1000, 2);
+
+    /* The largest limit there is, the counter must not wrap before it */
+    run_drop (2 * 1000, UINT8_MAX);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
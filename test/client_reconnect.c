@@ -0,0 +1,174 @@
+/*
+ *  client_reconnect.c
+ *    Integration test to check if a client reconnects quickly after the
+ *    server restarts, and that shutting down a client waiting to reconnect
+ *    does not block.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/client_reconnect.sock"
+#define CLIENT_ID 2
+
+struct test_struct {
+    int confirmed_count;
+    sem_t *sem;
+    pthread_mutex_t *mutex;
+};
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+client_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    /* Failed connection attempts while the server is down are reported as
+       errors, these are expected here */
+    if (fgev == NULL)
+        return 0;
+
+    pthread_mutex_lock (test_data->mutex);
+    if (fgev->id == FG_CONFIRMED)
+      {
+        test_data->confirmed_count++;
+        sem_post (test_data->sem);
+      }
+    pthread_mutex_unlock (test_data->mutex);
+
+    return 0;
+}
+
+static int
+wait_confirmed (sem_t *sem, int timeout_ms)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+      {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+
+    return sem_timedwait (sem, &ts);
+}
+
+static long
+elapsed_ms (struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int
+main (void)
+{
+    sem_t confirmed_sem;
+    pthread_mutex_t mutex;
+    struct timespec start;
+    struct test_struct test_data;
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+    struct fg_events_data client;
+
+    sem_init (&confirmed_sem, 0, 0);
+
+    memset (&test_data, 0, sizeof (test_data));
+    test_data.sem = &confirmed_sem;
+
+    pthread_mutex_init (&mutex, NULL);
+    test_data.mutex = &mutex;
+
+    fg_events_server_init (&server, &server_callback, NULL, 0, SOCK_PATH, 1);
+
+    fg_events_opts_init (&opts);
+    opts.reconnect_base.tv_sec = 0;
+    opts.reconnect_base.tv_usec = 50 * 1000;
+    opts.reconnect_max.tv_sec = 0;
+    opts.reconnect_max.tv_usec = 200 * 1000;
+    fg_events_client_init_unix_opts (&client, &client_callback, NULL,
+                                     &test_data, SOCK_PATH, CLIENT_ID, &opts);
+
+    if (wait_confirmed (&confirmed_sem, 1000) < 0)
+      {
+        PRINT_FAIL ("initial connect");
+        exit (EXIT_FAILURE);
+      }
+
+    /* Restart the server, the client must be back well before the old fixed
+       10 second delay */
+    fg_events_server_shutdown (&server);
+    usleep (300 * 1000);
+    fg_events_server_init (&server, &server_callback, NULL, 0, SOCK_PATH, 1);
+
+    if (wait_confirmed (&confirmed_sem, 2000) < 0)
+      {
+        PRINT_FAIL ("reconnect after server restart");
+        exit (EXIT_FAILURE);
+      }
+
+    /* Take the server away again and shut the client down while it is
+       backing off, this must not wait for the retry timer */
+    fg_events_server_shutdown (&server);
+    usleep (100 * 1000);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    fg_events_client_shutdown (&client);
+    if (elapsed_ms (&start) > 500)
+      {
+        PRINT_FAIL ("shutdown while reconnecting took %ld ms",
+                    elapsed_ms (&start));
+        exit (EXIT_FAILURE);
+      }
+
+    sem_destroy (&confirmed_sem);
+    pthread_mutex_destroy (&mutex);
+
+    if (test_data.confirmed_count != 2)
+      {
+        PRINT_FAIL ("expected 2 confirmed events, got %d",
+                    test_data.confirmed_count);
+        exit (EXIT_FAILURE);
+      }
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
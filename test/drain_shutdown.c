@@ -0,0 +1,181 @@
+/*
+ *  drain_shutdown.c
+ *    Integration test to check if draining a client delivers everything it
+ *    queued, including its FG_DISCONNECTED event, and if draining returns
+ *    as soon as all output is flushed.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/drain_shutdown.sock"
+#define EVENT_ID ABI
+#define SENDER_ID 2
+#define RECEIVER_ID 3
+#define NUM_EVENTS 200
+#define PAYLOAD_LEN 4096    /* int32_t values, more than goes out at once */
+
+struct test_struct {
+    int received_count;
+    int disconnected_count;
+    sem_t *sem;
+    pthread_mutex_t *mutex;
+};
+
+static int
+server_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    if (fgev == NULL)
+        return 0;
+
+    pthread_mutex_lock (test_data->mutex);
+    if (fgev->id == FG_DISCONNECTED && fgev->sender == SENDER_ID)
+      {
+        test_data->disconnected_count++;
+        sem_post (test_data->sem);
+      }
+    pthread_mutex_unlock (test_data->mutex);
+
+    return 0;
+}
+
+static int
+client_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    if (fgev == NULL)
+        return 0;
+
+    pthread_mutex_lock (test_data->mutex);
+    if (fgev->id == EVENT_ID)
+      {
+        if (fgev->length != PAYLOAD_LEN ||
+            fgev->payload[0] != test_data->received_count)
+          {
+            PRINT_FAIL ("event %d out of order", test_data->received_count);
+            exit (EXIT_FAILURE);
+          }
+        if (++test_data->received_count == NUM_EVENTS)
+            sem_post (test_data->sem);
+      }
+    pthread_mutex_unlock (test_data->mutex);
+
+    return 0;
+}
+
+static long
+elapsed_ms (struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int
+main (void)
+{
+    int i, s;
+    sem_t pass_test_sem;
+    pthread_mutex_t mutex;
+    struct timespec ts, start;
+    struct timeval deadline = { 2, 0 };
+    struct test_struct test_data;
+    struct fg_events_data server;
+    struct fg_events_data sender, receiver;
+    struct fgevent fgev;
+    static int32_t payload[PAYLOAD_LEN];
+
+    sem_init (&pass_test_sem, 0, 0);
+
+    memset (&test_data, 0, sizeof (test_data));
+    test_data.sem = &pass_test_sem;
+
+    pthread_mutex_init (&mutex, NULL);
+    test_data.mutex = &mutex;
+
+    fg_events_server_init (&server, &server_callback, &test_data, 0,
+                           SOCK_PATH, 1);
+
+    fg_events_client_init_unix (&receiver, &client_callback, NULL,
+                                &test_data, SOCK_PATH, RECEIVER_ID);
+    fg_events_client_init_unix (&sender, &client_callback, NULL, &test_data,
+                                SOCK_PATH, SENDER_ID);
+
+    usleep (100 * 1000); // make sure all clients are connected
+
+    /* Queue a burst and drain right away without a deadline, nothing may
+       be lost although it takes many turns of the loop to write */
+    for (i = 0; i < NUM_EVENTS; i++)
+      {
+        payload[0] = i;
+
+        fgev.id = EVENT_ID;
+        fgev.receiver = RECEIVER_ID;
+        fgev.writeback = 0;
+        fgev.length = PAYLOAD_LEN;
+        fgev.payload = payload;
+        fg_send_event (&sender, &fgev);
+      }
+    fg_events_client_drain (&sender, NULL);
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += 2;
+    s = sem_timedwait (&pass_test_sem, &ts);
+    if (s == 0)
+        s = sem_timedwait (&pass_test_sem, &ts);
+    if (s < 0)
+      {
+        PRINT_FAIL ("drain lost events ([%d, %d])", test_data.received_count,
+                    test_data.disconnected_count);
+        exit (EXIT_FAILURE);
+      }
+
+    /* Nothing is queued anymore, draining must not wait for the deadline */
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    fg_events_client_drain (&receiver, &deadline);
+    fg_events_server_drain (&server, &deadline);
+    if (elapsed_ms (&start) > 1000)
+      {
+        PRINT_FAIL ("drain of idle connections took %ld ms",
+                    elapsed_ms (&start));
+        exit (EXIT_FAILURE);
+      }
+
+    sem_destroy (&pass_test_sem);
+    pthread_mutex_destroy (&mutex);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,238 @@
+/*
+ *  embedded_base.c
+ *    Integration test to check if a server and clients run on an event base
+ *    of the application, without any thread of their own.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <dirent.h>
+#include <errno.h>
+
+#include <event2/event.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/embedded_base.sock"
+#define EVENT_ID (ABI + 1)
+#define STOP_ID (ABI + 2)
+#define SERVER_ID 1
+#define SENDER_ID 2
+#define RECEIVER_ID 3
+#define NUM_EVENTS 100
+
+static struct event_base *base;
+static struct fg_events_data server, sender, receiver;
+static pthread_t main_thread;
+static int received;
+static bool wrong_thread;
+
+static int
+count_threads (void)
+{
+    int n = 0;
+    DIR *dir = opendir ("/proc/self/task");
+    struct dirent *entry;
+
+    if (dir == NULL)
+        return -1;
+    while ((entry = readdir (dir)) != NULL)
+        n += entry->d_name[0] != '.';
+    closedir (dir);
+
+    return n;
+}
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    if (!pthread_equal (pthread_self (), main_thread))
+        wrong_thread = true;
+
+    /* The connection the event came in on is still being read from */
+    if (fgev != NULL && fgev->id == STOP_ID && fgev->receiver == SERVER_ID)
+      {
+        struct timeval linger = {0, 50 * 1000};
+
+        fg_events_server_shutdown (&server);
+        event_base_loopexit (base, &linger);
+      }
+
+    return 0;
+}
+
+static int
+receiver_callback (void * UNUSED(arg), struct fgevent *fgev,
+                   struct fgevent * UNUSED(ansev))
+{
+    if (!pthread_equal (pthread_self (), main_thread))
+        wrong_thread = true;
+
+    if (fgev == NULL || fgev->id != EVENT_ID)
+        return 0;
+
+    if (fgev->length != 1 || fgev->payload[0] != received)
+      {
+        PRINT_FAIL ("event %d out of order", received);
+        exit (EXIT_FAILURE);
+      }
+
+    /* Shutting down from the callback must not free the bufferevent which
+       is running it, the loop gets a moment to tear the receiver down */
+    if (++received == NUM_EVENTS)
+      {
+        struct timeval linger = {0, 50 * 1000};
+
+        fg_events_client_shutdown (&receiver);
+        event_base_loopexit (base, &linger);
+      }
+
+    return 0;
+}
+
+static void
+send_cb (evutil_socket_t UNUSED(fd), short UNUSED(what), void * UNUSED(arg))
+{
+    int32_t payload[1];
+    struct fgevent fgev = {EVENT_ID, 0, RECEIVER_ID, 0, 1, &(payload[0])};
+
+    for (int i = 0; i < NUM_EVENTS; i++)
+      {
+        payload[0] = i;
+        fg_send_event (&sender, &fgev);
+      }
+}
+
+static void
+stop_cb (evutil_socket_t UNUSED(fd), short UNUSED(what), void * UNUSED(arg))
+{
+    struct fgevent fgev = {STOP_ID, 0, SERVER_ID, 0, 0, NULL};
+
+    fg_send_event (&sender, &fgev);
+}
+
+static void
+timeout_cb (evutil_socket_t UNUSED(fd), short UNUSED(what), void * UNUSED(arg))
+{
+    PRINT_FAIL ("received %d of %d events in time", received, NUM_EVENTS);
+    exit (EXIT_FAILURE);
+}
+
+int
+main (void)
+{
+    int threads;
+    struct fg_events_opts opts;
+    struct timeval send_delay = {0, 100 * 1000};
+    struct timeval timeout = {10, 0};
+    struct timeval drain_timeout = {1, 0};
+
+    signal (SIGPIPE, SIG_IGN);
+    main_thread = pthread_self ();
+
+    base = event_base_new ();
+    if (base == NULL)
+      {
+        PRINT_FAIL ("event_base_new");
+        exit (EXIT_FAILURE);
+      }
+
+    threads = count_threads ();
+
+    fg_events_opts_init (&opts);
+    if (fg_events_server_init_base (&server, base, &server_callback, NULL, 0,
+                                    SOCK_PATH, SERVER_ID, &opts) != 0 ||
+        fg_events_client_init_unix_base (&receiver, base, &receiver_callback,
+                                         NULL, NULL, SOCK_PATH, RECEIVER_ID,
+                                         &opts) != 0 ||
+        fg_events_client_init_unix_base (&sender, base, &receiver_callback,
+                                         NULL, NULL, SOCK_PATH, SENDER_ID,
+                                         &opts) != 0)
+      {
+        PRINT_FAIL ("init on the event base");
+        exit (EXIT_FAILURE);
+      }
+
+    if (count_threads () != threads)
+      {
+        PRINT_FAIL ("no threads started");
+        exit (EXIT_FAILURE);
+      }
+
+    /* Give the clients time to connect before sending */
+    event_base_once (base, -1, EV_TIMEOUT, send_cb, NULL, &send_delay);
+    event_base_once (base, -1, EV_TIMEOUT, timeout_cb, NULL, &timeout);
+    event_base_dispatch (base);
+
+    if (received != NUM_EVENTS || wrong_thread)
+      {
+        PRINT_FAIL ("events delivered on the thread running the base");
+        exit (EXIT_FAILURE);
+      }
+
+    if (fg_events_get_conn_stats (&receiver, NULL, 0) != -1 ||
+        errno != EINVAL)
+      {
+        PRINT_FAIL ("receiver torn down after shutting down from a callback");
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_client_shutdown (&sender);
+    fg_events_client_shutdown (&receiver);
+
+    /* Draining returns at once, the server goes away from the loop */
+    fg_events_server_drain (&server, &drain_timeout);
+    event_base_loop (base, EVLOOP_NONBLOCK);
+    if (fg_events_get_conn_stats (&server, NULL, 0) != -1 || errno != EINVAL)
+      {
+        PRINT_FAIL ("server torn down after draining");
+        exit (EXIT_FAILURE);
+      }
+    fg_events_server_shutdown (&server);
+
+    /* A server shut down by its own callback */
+    if (fg_events_server_init_base (&server, base, &server_callback, NULL, 0,
+                                    SOCK_PATH, SERVER_ID, &opts) != 0 ||
+        fg_events_client_init_unix_base (&sender, base, &receiver_callback,
+                                         NULL, NULL, SOCK_PATH, SENDER_ID,
+                                         &opts) != 0)
+      {
+        PRINT_FAIL ("init on the event base again");
+        exit (EXIT_FAILURE);
+      }
+    event_base_once (base, -1, EV_TIMEOUT, stop_cb, NULL, &send_delay);
+    event_base_dispatch (base);
+    if (fg_events_get_conn_stats (&server, NULL, 0) != -1 || errno != EINVAL)
+      {
+        PRINT_FAIL ("server torn down after shutting down from a callback");
+        exit (EXIT_FAILURE);
+      }
+    fg_events_client_shutdown (&sender);
+
+    event_base_free (base);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+/*
+ *  error_reporting.c
+ *    Integration test to check if errors of a client which can't connect
+ *    are handed to the error callback as codes, and never to the event
+ *    callback when an error callback is set.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/error_reporting_missing.sock"
+#define CLIENT_ID 2
+#define NUM_ERRORS 3
+
+struct test_struct {
+    int error_count;
+    int null_events;
+    sem_t *sem;
+    pthread_mutex_t *mutex;
+};
+
+static int
+client_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    if (fgev == NULL)
+      {
+        pthread_mutex_lock (test_data->mutex);
+        test_data->null_events++;
+        pthread_mutex_unlock (test_data->mutex);
+      }
+
+    return 0;
+}
+
+static void
+error_callback (void *arg, const struct fg_error *error)
+{
+    char buf[256];
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    if (error->msg == NULL || error->file == NULL || error->line <= 0 ||
+        error->user_id != -1 ||
+        fg_events_format_error (error, buf, sizeof buf) <= 0 ||
+        strstr (buf, error->msg) == NULL)
+      {
+        PRINT_FAIL ("malformed error");
+        exit (EXIT_FAILURE);
+      }
+
+    pthread_mutex_lock (test_data->mutex);
+    if (++test_data->error_count == NUM_ERRORS)
+        sem_post (test_data->sem);
+    pthread_mutex_unlock (test_data->mutex);
+}
+
+int
+main (void)
+{
+    int s;
+    sem_t pass_test_sem;
+    pthread_mutex_t mutex;
+    struct timespec ts;
+    struct test_struct test_data;
+    struct fg_events_opts opts;
+    struct fg_events_data client;
+    struct fg_events_stats stats;
+    struct fg_error errors[4];
+
+    sem_init (&pass_test_sem, 0, 0);
+
+    memset (&test_data, 0, sizeof (test_data));
+    test_data.sem = &pass_test_sem;
+
+    pthread_mutex_init (&mutex, NULL);
+    test_data.mutex = &mutex;
+
+    unlink (SOCK_PATH);
+
+    /* Every failed attempt reports an error, retry quickly */
+    fg_events_opts_init (&opts);
+    opts.reconnect_base.tv_sec = 0;
+    opts.reconnect_base.tv_usec = 10 * 1000;
+    opts.reconnect_max.tv_sec = 0;
+    opts.reconnect_max.tv_usec = 20 * 1000;
+    opts.error_cb = &error_callback;
+    fg_events_client_init_unix_opts (&client, &client_callback, NULL,
+                                     &test_data, SOCK_PATH, CLIENT_ID, &opts);
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += 2;
+    s = sem_timedwait (&pass_test_sem, &ts);
+    if (s < 0)
+      {
+        PRINT_FAIL ("only %d errors reported", test_data.error_count);
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_client_shutdown (&client);
+
+    fg_events_get_stats (&client, &stats);
+    if (stats.errors < NUM_ERRORS || test_data.null_events != 0)
+      {
+        PRINT_FAIL ("errors counted ([%llu, %d])",
+                    (unsigned long long) stats.errors,
+                    test_data.null_events);
+        exit (EXIT_FAILURE);
+      }
+
+    /* Everything was handed to the callback, or is still queued */
+    if (fg_events_drain_errors (&client, errors, LEN(errors)) +
+        test_data.error_count + stats.errors_dropped < stats.errors)
+      {
+        PRINT_FAIL ("errors lost");
+        exit (EXIT_FAILURE);
+      }
+
+    sem_destroy (&pass_test_sem);
+    pthread_mutex_destroy (&mutex);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
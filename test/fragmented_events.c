@@ -0,0 +1,377 @@
+/*
+ *  fragmented_events.c
+ *    Integration test to check that events arrive intact and in order when
+ *    the byte stream is cut into pieces, at every possible boundary and at
+ *    random ones.
+ *
+ *    Every piece is written on its own and the next one waits until the
+ *    server has read it out of the socket, so each cut is seen by the
+ *    receive path as a separate read. Set FG_TEST_SEED to replay a run of random cuts.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/sockios.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/fragmented_events.sock"
+#define SERVER_ID 1
+#define SENDER_ID 2
+#define FIRST_EVENT (ABI + 1)
+
+/* A large event arrives in many reads, putting it together must not copy
+   it over and over again */
+#define LARGE_EVENT (ABI + 100)
+#define LARGE_LEN (4 * 1024 * 1024)     /* int32_t values, 16 MiB */
+#define LARGE_MSEC 5000
+
+#define RANDOM_ROUNDS 200
+#define RANDOM_COPIES 4     /* streams sent back to back in a random round */
+#define MAX_PIECE 48
+
+/* Payload lengths of the events in one stream, odd ones carry extensions */
+static const int32_t lengths[] = {0, 1, 3, 0, 17, 2, 64, 5};
+#define NUM_EVENTS ((int) (LEN (lengths)))
+
+static unsigned char stream[4096];
+static size_t stream_len;
+
+static int received;    /* events seen by the server callback */
+static int failed;      /* first event which did not match, or -1 */
+static int large_ok;    /* the large event arrived intact */
+
+static int32_t
+payload_value (int event, int i)
+{
+    return (int32_t) ((event + 1) * 0x01000193u ^ i * 0x61C88647u);
+}
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    int n = __atomic_load_n (&received, __ATOMIC_RELAXED);
+    int event = n % NUM_EVENTS;
+    bool ok;
+
+    /* The announcement of the sender is handed out as well */
+    if (fgev == NULL || fgev->id < ABI)
+        return 0;
+
+    if (fgev->id == LARGE_EVENT)
+      {
+        ok = fgev->length == LARGE_LEN;
+        for (int i = 0; ok && i < LARGE_LEN; i += 4093)
+            ok = fgev->payload[i] == payload_value (LARGE_EVENT, i);
+        __atomic_store_n (&large_ok, ok ? 1 : -1, __ATOMIC_RELEASE);
+        return 0;
+      }
+
+    ok = fgev->id == FIRST_EVENT + event && fgev->sender == SENDER_ID &&
+         fgev->receiver == SERVER_ID && fgev->length == lengths[event];
+    for (int i = 0; ok && i < fgev->length; i++)
+        ok = fgev->payload[i] == payload_value (event, i);
+
+    if (!ok && __atomic_load_n (&failed, __ATOMIC_RELAXED) < 0)
+        __atomic_store_n (&failed, n, __ATOMIC_RELAXED);
+    __atomic_store_n (&received, n + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static int
+build_stream (void)
+{
+    int32_t payload[64];
+
+    for (int e = 0; e < NUM_EVENTS; e++)
+      {
+        int len;
+        unsigned char *buf;
+        struct fgevent fgev = {FIRST_EVENT + e, SENDER_ID, SERVER_ID, 0,
+                               lengths[e], &(payload[0])};
+        struct fg_frame_ext ext = {FG_EXT_HAS_SEQ | FG_EXT_HAS_SENT_TS,
+                                   e + 1, 0x0102030405060708ULL, 0};
+
+        for (int i = 0; i < lengths[e]; i++)
+            payload[i] = payload_value (e, i);
+
+        if (e % 2)
+            len = create_serialized_fgevent_buffer_ext (&buf, &fgev, &ext);
+        else
+            len = create_serialized_fgevent_buffer (&buf, &fgev);
+        if (len < 0 || stream_len + len > sizeof (stream))
+            return -1;
+        memcpy (stream + stream_len, buf, len);
+        stream_len += len;
+        free (buf);
+      }
+
+    return 0;
+}
+
+/* Wait until the server has taken everything written so far out of its
+   socket. With a frame pending the server may not look at the bytes before
+   the rest of the frame is there, but they were read all the same */
+static int
+wait_read (int fd)
+{
+    int queued;
+
+    for (int i = 0; i < 100000; i++)
+      {
+        if (ioctl (fd, SIOCOUTQ, &queued) < 0)
+            return -1;
+        if (queued == 0)
+            return 0;
+        usleep (10);
+      }
+
+    return -1;
+}
+
+static int
+wait_received (int expected)
+{
+    for (int i = 0; i < 100000; i++)
+      {
+        if (__atomic_load_n (&received, __ATOMIC_ACQUIRE) >= expected)
+            return 0;
+        usleep (10);
+      }
+
+    return -1;
+}
+
+/* Write a piece of the stream and wait for the server to read all of it */
+static int
+send_piece (int fd, const unsigned char *buf, size_t len)
+{
+    if (write (fd, buf, len) != (ssize_t) len)
+        return -1;
+
+    return wait_read (fd);
+}
+
+static int
+connect_sender (void)
+{
+    int fd, len;
+    unsigned char *buf;
+    int32_t payload[] = {-1};
+    struct fgevent fgev = {FG_CONNECTED, SENDER_ID, 0, 0, 1, &(payload[0])};
+    struct sockaddr_un sun;
+
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_LOCAL;
+    strncpy (sun.sun_path, SOCK_PATH, sizeof (sun.sun_path) - 1);
+
+    fd = socket (AF_LOCAL, SOCK_STREAM, 0);
+    if (fd < 0 || connect (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0)
+        return -1;
+
+    len = create_serialized_fgevent_buffer (&buf, &fgev);
+    if (len < 0 || send_piece (fd, buf, len) < 0)
+        return -1;
+    free (buf);
+
+    return fd;
+}
+
+/* Send one large event in a single write and return how long it took to
+   arrive in milliseconds, or -1 */
+static long
+send_large (int fd)
+{
+    int len;
+    unsigned char *buf;
+    int32_t *payload;
+    struct timespec start, now;
+    struct fgevent fgev = {LARGE_EVENT, SENDER_ID, SERVER_ID, 0, LARGE_LEN,
+                           NULL};
+
+    payload = malloc (LARGE_LEN * sizeof (int32_t));
+    if (payload == NULL)
+        return -1;
+    for (int i = 0; i < LARGE_LEN; i++)
+        payload[i] = payload_value (LARGE_EVENT, i);
+    fgev.payload = payload;
+
+    len = create_serialized_fgevent_buffer (&buf, &fgev);
+    free (payload);
+    if (len < 0)
+        return -1;
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    if (write (fd, buf, len) != len)
+      {
+        free (buf);
+        return -1;
+      }
+    free (buf);
+
+    for (;;)
+      {
+        long msec;
+
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        msec = (now.tv_sec - start.tv_sec) * 1000 +
+               (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (__atomic_load_n (&large_ok, __ATOMIC_ACQUIRE) != 0)
+            return large_ok > 0 ? msec : -1;
+        if (msec > LARGE_MSEC)
+            return -1;
+        usleep (1000);
+      }
+}
+
+static int
+check (const char *what, size_t at, unsigned int seed)
+{
+    int f = __atomic_load_n (&failed, __ATOMIC_RELAXED);
+
+    if (f >= 0)
+      {
+        PRINT_FAIL ("%s cut at %zu (seed %u): event %d", what, at, seed, f);
+        return -1;
+      }
+
+    return 0;
+}
+
+int
+main (void)
+{
+    int fd, expected = 0;
+    unsigned int seed;
+    const char *env;
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+
+    env = getenv ("FG_TEST_SEED");
+    seed = env != NULL ? strtoul (env, NULL, 10) : (unsigned int) time (NULL);
+    failed = -1;
+
+    if (build_stream () < 0)
+      {
+        PRINT_FAIL ("build stream");
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_opts_init (&opts);
+    timerclear (&opts.ping_interval);
+    if (fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                    SOCK_PATH, SERVER_ID, &opts) < 0)
+      {
+        PRINT_FAIL ("server init");
+        exit (EXIT_FAILURE);
+      }
+
+    fd = connect_sender ();
+    if (fd < 0)
+      {
+        PRINT_FAIL ("connect sender");
+        exit (EXIT_FAILURE);
+      }
+
+    /* Every boundary, the stream in two pieces */
+    for (size_t cut = 1; cut < stream_len; cut++)
+      {
+        expected += NUM_EVENTS;
+        if (send_piece (fd, stream, cut) < 0 ||
+            send_piece (fd, stream + cut, stream_len - cut) < 0 ||
+            wait_received (expected) < 0)
+          {
+            PRINT_FAIL ("stream cut at %zu not received", cut);
+            exit (EXIT_FAILURE);
+          }
+        if (check ("stream", cut, 0) < 0)
+            exit (EXIT_FAILURE);
+      }
+
+    /* Byte by byte */
+    expected += NUM_EVENTS;
+    for (size_t i = 0; i < stream_len; i++)
+      {
+        if (send_piece (fd, stream + i, 1) < 0)
+          {
+            PRINT_FAIL ("byte %zu not read", i);
+            exit (EXIT_FAILURE);
+          }
+      }
+    if (wait_received (expected) < 0 || check ("single byte", 1, 0) < 0)
+      {
+        PRINT_FAIL ("single byte stream");
+        exit (EXIT_FAILURE);
+      }
+
+    /* Random cuts across several streams sent back to back */
+    for (int round = 0; round < RANDOM_ROUNDS; round++)
+      {
+        unsigned int round_seed = seed + round;
+        size_t total = stream_len * RANDOM_COPIES, off = 0;
+
+        expected += NUM_EVENTS * RANDOM_COPIES;
+        while (off < total)
+          {
+            unsigned char piece[MAX_PIECE];
+            size_t len = 1 + rand_r (&round_seed) % MAX_PIECE;
+
+            if (len > total - off)
+                len = total - off;
+            for (size_t i = 0; i < len; i++)
+                piece[i] = stream[(off + i) % stream_len];
+            if (send_piece (fd, piece, len) < 0)
+              {
+                PRINT_FAIL ("random cut at %zu (seed %u) not read", off,
+                            seed + round);
+                exit (EXIT_FAILURE);
+              }
+            off += len;
+          }
+        if (wait_received (expected) < 0)
+          {
+            PRINT_FAIL ("random cuts (seed %u) not received", seed + round);
+            exit (EXIT_FAILURE);
+          }
+        if (check ("random", off, seed + round) < 0)
+            exit (EXIT_FAILURE);
+      }
+
+    if (send_large (fd) < 0)
+      {
+        PRINT_FAIL ("large event not received within %d ms", LARGE_MSEC);
+        exit (EXIT_FAILURE);
+      }
+
+    close (fd);
+    fg_events_server_shutdown (&server);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
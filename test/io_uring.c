@@ -0,0 +1,220 @@
+/*
+ *  io_uring.c
+ *    Integration test to check that events make it through intact in both
+ *    directions when every peer moves its bytes with io_uring.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <semaphore.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/io_uring.sock"
+#define EVENT_ID (ABI + 1)
+#define REPLY_ID (ABI + 2)
+#define SERVER_ID 1
+#define SENDER_ID 2
+#define RECEIVER_ID 3
+
+#define NUM_EVENTS 200
+#define PAYLOAD_LEN 4096    /* int32_t values, more than a send buffer */
+
+static sem_t done, replied;
+static int received;
+static int failed = -1;
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+sender_callback (void * UNUSED(arg), struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    if (fgev != NULL && fgev->id == REPLY_ID && fgev->sender == RECEIVER_ID)
+        sem_post (&replied);
+
+    return 0;
+}
+
+static int
+receiver_callback (void * UNUSED(arg), struct fgevent *fgev,
+                   struct fgevent * UNUSED(ansev))
+{
+    bool ok;
+
+    if (fgev == NULL || fgev->id != EVENT_ID)
+        return 0;
+
+    ok = fgev->length == PAYLOAD_LEN;
+    for (int i = 0; ok && i < PAYLOAD_LEN; i++)
+        ok = fgev->payload[i] == received * PAYLOAD_LEN + i;
+    if (!ok && failed < 0)
+        failed = received;
+
+    if (++received == NUM_EVENTS)
+        sem_post (&done);
+
+    return 0;
+}
+
+static int
+wait_sem (sem_t *sem)
+{
+    struct timespec deadline;
+
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 10;
+
+    return sem_timedwait (sem, &deadline);
+}
+
+/* Send the events from one client to the other through the server and an
+   answer back. Returns 1 when the ring could not be set up, 0 when
+   everything arrived and -1 otherwise */
+static int
+run (bool inet, struct fg_events_stats *stats)
+{
+    int s = 0;
+    int32_t *payload;
+    struct fg_events_opts opts;
+    struct fg_events_data server, sender, receiver;
+    struct fgevent fgev = {EVENT_ID, 0, RECEIVER_ID, 0, PAYLOAD_LEN, NULL};
+    struct fgevent reply = {REPLY_ID, 0, SENDER_ID, 0, 0, NULL};
+
+    payload = malloc (PAYLOAD_LEN * sizeof (int32_t));
+    if (payload == NULL)
+        return -1;
+    fgev.payload = payload;
+    received = 0;
+
+    fg_events_opts_init (&opts);
+    timerclear (&opts.ping_interval);
+    opts.io_uring = true;
+    if (fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                    SOCK_PATH, SERVER_ID, &opts) < 0)
+        return -1;
+
+    /* Without io_uring in the kernel the server goes on with libevent */
+    if (!server.opts.io_uring)
+      {
+        fg_events_server_shutdown (&server);
+        free (payload);
+        return 1;
+      }
+
+    if (inet)
+        s = fg_events_client_init_inet_opts (&receiver, &receiver_callback,
+                                             NULL, NULL, "127.0.0.1",
+                                             server.port, RECEIVER_ID,
+                                             &opts) < 0 ||
+            fg_events_client_init_inet_opts (&sender, &sender_callback,
+                                             NULL, NULL, "127.0.0.1",
+                                             server.port, SENDER_ID,
+                                             &opts) < 0;
+    else
+        s = fg_events_client_init_unix_opts (&receiver, &receiver_callback,
+                                             NULL, NULL, SOCK_PATH,
+                                             RECEIVER_ID, &opts) < 0 ||
+            fg_events_client_init_unix_opts (&sender, &sender_callback,
+                                             NULL, NULL, SOCK_PATH,
+                                             SENDER_ID, &opts) < 0;
+    if (s)
+        return -1;
+
+    usleep (100 * 1000); // make sure both clients are confirmed
+
+    for (int e = 0; e < NUM_EVENTS; e++)
+      {
+        for (int i = 0; i < PAYLOAD_LEN; i++)
+            payload[i] = e * PAYLOAD_LEN + i;
+        fg_send_event (&sender, &fgev);
+      }
+
+    if (wait_sem (&done) < 0 || failed >= 0)
+        s = -1;
+    else
+      {
+        fg_send_event (&receiver, &reply);
+        if (wait_sem (&replied) < 0)
+            s = -1;
+      }
+
+    fg_events_get_stats (&server, stats);
+
+    fg_events_client_shutdown (&sender);
+    fg_events_client_shutdown (&receiver);
+    fg_events_server_shutdown (&server);
+    free (payload);
+
+    return s;
+}
+
+int
+main (void)
+{
+    int s;
+    struct fg_events_stats stats;
+
+    sem_init (&done, 0, 0);
+    sem_init (&replied, 0, 0);
+
+    s = run (false, &stats);
+    if (s == 1)
+      {
+        PRINT_SUCCESS ("io_uring is not available, nothing to test");
+        return EXIT_SUCCESS;
+      }
+    if (s < 0)
+      {
+        PRINT_FAIL ("events over unix sockets (event %d of %d)", failed,
+                    received);
+        exit (EXIT_FAILURE);
+      }
+
+    /* The server wrote every event out again, all through its ring */
+    if (stats.io_enters == 0 || stats.events_in < NUM_EVENTS + 1 ||
+        stats.events_out < NUM_EVENTS + 1)
+      {
+        PRINT_FAIL ("server stats with io_uring");
+        exit (EXIT_FAILURE);
+      }
+
+    if (run (true, &stats) != 0)
+      {
+        PRINT_FAIL ("events over inet sockets (event %d of %d)", failed,
+                    received);
+        exit (EXIT_FAILURE);
+      }
+
+    sem_destroy (&done);
+    sem_destroy (&replied);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
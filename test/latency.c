@@ -0,0 +1,309 @@
+/*
+ *  latency.c
+ *    Integration test to check if timestamped events and writeback answers
+ *    end up in the latency histograms of every party, and if percentiles
+ *    of a histogram stay within its precision.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/latency.sock"
+#define EVENT_ID ABI
+#define ANSWER_ID 43
+#define SENDER_ID 2
+#define RECEIVER_ID 3
+#define BASELINE_ID 4
+#define NUM_EVENTS 50
+
+struct test_struct {
+    int answered_count;
+    sem_t *sem;
+    pthread_mutex_t *mutex;
+};
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+receiver_callback (void * UNUSED(arg), struct fgevent *fgev,
+                   struct fgevent *ansev)
+{
+    if (fgev == NULL || fgev->id != EVENT_ID)
+        return 0;
+
+    ansev->id = ANSWER_ID;
+    ansev->sender = RECEIVER_ID;
+    ansev->receiver = fgev->sender;
+    ansev->writeback = 0;
+    ansev->length = 0;
+
+    return 1;
+}
+
+static int
+sender_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    if (fgev == NULL)
+        return 0;
+
+    pthread_mutex_lock (test_data->mutex);
+    if (fgev->id == ANSWER_ID && ++test_data->answered_count == NUM_EVENTS)
+        sem_post (test_data->sem);
+    pthread_mutex_unlock (test_data->mutex);
+
+    return 0;
+}
+
+static int
+check_hist (void)
+{
+    uint64_t p50, p99;
+    struct fg_hist *hist;
+
+    hist = calloc (1, sizeof (struct fg_hist));
+    if (hist == NULL)
+        return -1;
+
+    /* 1 to 10000 us, percentiles may only be rounded up by 1/16th */
+    for (uint64_t v = 1; v <= 10000; v++)
+        fg_hist_record (hist, v * 1000);
+
+    p50 = fg_hist_percentile (hist, 50.0);
+    p99 = fg_hist_percentile (hist, 99.0);
+    free (hist);
+
+    if (p50 < 5000000 || p50 > 5000000 + 5000000 / 16 ||
+        p99 < 9900000 || p99 > 10000000)
+      {
+        PRINT_FAIL ("percentiles ([%llu, %llu])", (unsigned long long) p50,
+                    (unsigned long long) p99);
+        return -1;
+      }
+
+    return 0;
+}
+
+static int
+check_latency (struct fg_events_data *etdata, enum fg_latency_kind kind,
+               uint64_t min_count, const char *name)
+{
+    struct fg_latency latency;
+
+    if (fg_events_get_latency (etdata, kind, &latency) < 0)
+      {
+        PRINT_FAIL ("%s fg_events_get_latency", name);
+        return -1;
+      }
+
+    if (latency.count < min_count || latency.p50 > latency.p99 ||
+        latency.p99 > latency.max || latency.min > latency.p50 ||
+        latency.max > 1000000000)
+      {
+        PRINT_FAIL ("%s latency ([%llu, %llu, %llu, %llu])", name,
+                    (unsigned long long) latency.count,
+                    (unsigned long long) latency.min,
+                    (unsigned long long) latency.p99,
+                    (unsigned long long) latency.max);
+        return -1;
+      }
+
+    return 0;
+}
+
+/* A peer announcing itself like readers predating frame extensions must
+   get frames with ETX right after the payload, timestamps or not */
+static int
+check_baseline_reader (struct fg_events_data *sender)
+{
+    int fd, len;
+    ssize_t n;
+    size_t got = 0;
+    unsigned char *buf;
+    unsigned char frame[256];
+    struct sockaddr_un sun;
+    struct pollfd pfd;
+    int32_t conn_payload[] = {-1};
+    int32_t payload[] = {1, 2, 3, 4};
+    struct fgevent connev = {FG_CONNECTED, BASELINE_ID, 0, 0, 1,
+                             &(conn_payload[0])};
+    struct fgevent fgev = {EVENT_ID, 0, BASELINE_ID, 0, 4, &(payload[0])};
+    size_t expected = 2 + FGEVENT_HEADER_SIZE + sizeof (payload);
+
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_LOCAL;
+    strncpy (sun.sun_path, SOCK_PATH, sizeof (sun.sun_path) - 1);
+
+    fd = socket (AF_LOCAL, SOCK_STREAM, 0);
+    if (fd < 0 || connect (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0)
+      {
+        PRINT_FAIL ("baseline reader connect");
+        return -1;
+      }
+
+    len = create_serialized_fgevent_buffer (&buf, &connev);
+    if (len < 0 || send (fd, buf, len, MSG_NOSIGNAL) != len)
+      {
+        PRINT_FAIL ("baseline reader announce");
+        return -1;
+      }
+    free (buf);
+    usleep (100 * 1000); // make sure the peer is announced
+
+    fg_send_event (sender, &fgev);
+
+    /* Skip FG_CONFIRMED and pings, which never carry extensions */
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (poll (&pfd, 1, 2000) > 0 &&
+           (n = read (fd, frame + got, sizeof (frame) - got)) > 0)
+      {
+        unsigned char *ptr = frame;
+
+        got += n;
+        for (;;)
+          {
+            struct fgevent ev;
+            unsigned char *start;
+            int s;
+
+            while (ptr < frame + got && ptr[0] != 0x02)
+                ptr++;
+            start = ptr;
+            s = fg_parse_fgevent (&ev, frame, got, &ptr);
+            if (s <= 0)
+              {
+                got -= start - frame;
+                memmove (frame, start, got);
+                break;
+              }
+            if (ev.length > 0)
+                free (ev.payload);
+            if (ev.id == EVENT_ID)
+              {
+                close (fd);
+                if ((size_t) (ptr + 1 - start) != expected)
+                  {
+                    PRINT_FAIL ("baseline reader got %zu byte frame",
+                                (size_t) (ptr + 1 - start));
+                    return -1;
+                  }
+                return 0;
+              }
+            ptr++;
+          }
+      }
+
+    close (fd);
+    PRINT_FAIL ("baseline reader got no event");
+    return -1;
+}
+
+int
+main (void)
+{
+    int i, s;
+    sem_t pass_test_sem;
+    pthread_mutex_t mutex;
+    struct timespec ts;
+    struct test_struct test_data;
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+    struct fg_events_data sender, receiver;
+    int32_t payload[] = {1, 2, 3, 4};
+    struct fgevent fgev = {EVENT_ID, 0, RECEIVER_ID, 1, 4, &(payload[0])};
+
+    if (check_hist () < 0)
+        exit (EXIT_FAILURE);
+
+    sem_init (&pass_test_sem, 0, 0);
+
+    memset (&test_data, 0, sizeof (test_data));
+    test_data.sem = &pass_test_sem;
+
+    pthread_mutex_init (&mutex, NULL);
+    test_data.mutex = &mutex;
+
+    fg_events_opts_init (&opts);
+    opts.track_latency = true;
+    fg_events_server_init_opts (&server, &server_callback, NULL, 0, SOCK_PATH,
+                                1, &opts);
+    fg_events_client_init_unix_opts (&receiver, &receiver_callback, NULL,
+                                     &test_data, SOCK_PATH, RECEIVER_ID,
+                                     &opts);
+    fg_events_client_init_unix_opts (&sender, &sender_callback, NULL,
+                                     &test_data, SOCK_PATH, SENDER_ID, &opts);
+
+    usleep (100 * 1000); // make sure all clients are connected
+
+    for (i = 0; i < NUM_EVENTS; i++)
+      {
+        fgev.receiver = RECEIVER_ID;
+        fg_send_event (&sender, &fgev);
+      }
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += 2;
+    s = sem_timedwait (&pass_test_sem, &ts);
+    if (s < 0)
+      {
+        PRINT_FAIL ("only %d answers received", test_data.answered_count);
+        exit (EXIT_FAILURE);
+      }
+
+    if (check_latency (&receiver, FG_LATENCY_END_TO_END, NUM_EVENTS,
+                       "end-to-end") < 0 ||
+        check_latency (&sender, FG_LATENCY_WRITEBACK, NUM_EVENTS,
+                       "writeback") < 0 ||
+        check_latency (&server, FG_LATENCY_SERVER_HOP, 2 * NUM_EVENTS,
+                       "server hop") < 0)
+        exit (EXIT_FAILURE);
+
+    if (check_baseline_reader (&sender) < 0)
+        exit (EXIT_FAILURE);
+
+    fg_events_client_shutdown (&sender);
+    fg_events_client_shutdown (&receiver);
+    fg_events_server_shutdown (&server);
+
+    sem_destroy (&pass_test_sem);
+    pthread_mutex_destroy (&mutex);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
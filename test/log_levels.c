@@ -0,0 +1,129 @@
+/*
+ *  log_levels.c
+ *    Integration test to check if log messages reach the sink set by the
+ *    host program and if messages above the runtime level are left out.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/log_levels.sock"
+#define CLIENT_ID 2
+
+struct test_struct {
+    int counts[FG_LOG_DEBUG + 1];
+    int disconnected;
+    sem_t *sem;
+    pthread_mutex_t *mutex;
+};
+
+static int
+event_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static void
+log_callback (void *arg, int level, const char *msg)
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    if (level < FG_LOG_ERROR || level > FG_LOG_DEBUG || msg == NULL)
+      {
+        PRINT_FAIL ("log level %d", level);
+        exit (EXIT_FAILURE);
+      }
+
+    pthread_mutex_lock (test_data->mutex);
+    test_data->counts[level]++;
+    if (strstr (msg, "disconnected") != NULL)
+      {
+        test_data->disconnected++;
+        sem_post (test_data->sem);
+      }
+    pthread_mutex_unlock (test_data->mutex);
+}
+
+int
+main (void)
+{
+    int s;
+    sem_t pass_test_sem;
+    pthread_mutex_t mutex;
+    struct timespec ts;
+    struct test_struct test_data;
+    struct fg_events_opts opts;
+    struct fg_events_data server, client;
+
+    sem_init (&pass_test_sem, 0, 0);
+
+    memset (&test_data, 0, sizeof (test_data));
+    test_data.sem = &pass_test_sem;
+
+    pthread_mutex_init (&mutex, NULL);
+    test_data.mutex = &mutex;
+
+    fg_events_opts_init (&opts);
+    opts.log_cb = &log_callback;
+    opts.log_level = FG_LOG_INFO;
+    fg_events_server_init_opts (&server, &event_callback, &test_data, 0,
+                                SOCK_PATH, 1, &opts);
+
+    /* The client logs nothing without a sink */
+    fg_events_client_init_unix (&client, &event_callback, NULL, &test_data,
+                                SOCK_PATH, CLIENT_ID);
+
+    usleep (100 * 1000); // make sure the client is connected
+
+    fg_events_client_shutdown (&client);
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += 2;
+    s = sem_timedwait (&pass_test_sem, &ts);
+    if (s < 0)
+      {
+        PRINT_FAIL ("disconnect not logged");
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_server_shutdown (&server);
+
+    if (test_data.counts[FG_LOG_DEBUG] != 0 || test_data.disconnected != 1)
+      {
+        PRINT_FAIL ("log counts ([%d, %d])", test_data.counts[FG_LOG_DEBUG],
+                    test_data.disconnected);
+        exit (EXIT_FAILURE);
+      }
+
+    sem_destroy (&pass_test_sem);
+    pthread_mutex_destroy (&mutex);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
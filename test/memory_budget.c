@@ -0,0 +1,350 @@
+/*
+ *  memory_budget.c
+ *    Integration test to check if a server over its memory budget sheds the
+ *    slow consumer, or pauses reading and keeps its buffers bounded.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/memory_budget.sock"
+#define EVENT_ID ABI
+#define SENDER_ID 2
+#define STALLED_ID 3
+#define SELF_ID 5
+#define BYSTANDER_ID 6
+#define LISTENER_ID 7
+#define NUM_BYSTANDER_EVENTS 10
+#define PAYLOAD_LEN 4096
+#define NUM_EVENTS 256
+#define BUDGET (256 * 1024)
+
+struct test_struct {
+    int offline_count;
+    pthread_mutex_t *mutex;
+};
+
+static int32_t payload[PAYLOAD_LEN];
+static sem_t stall_gate;
+static sem_t heard;
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+client_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    if (fgev == NULL || test_data == NULL)
+        return 0;
+
+    pthread_mutex_lock (test_data->mutex);
+    if (fgev->id == FG_USER_OFFLINE)
+        test_data->offline_count++;
+    pthread_mutex_unlock (test_data->mutex);
+
+    return 0;
+}
+
+/* Blocks the events thread of the receiver in its first callback, so it
+   stops reading its socket until the gate is opened */
+static int
+stalled_callback (void * UNUSED(arg), struct fgevent *fgev,
+                  struct fgevent * UNUSED(ansev))
+{
+    if (fgev != NULL && fgev->id == EVENT_ID)
+      {
+        sem_wait (&stall_gate);
+        sem_post (&stall_gate);
+      }
+
+    return 0;
+}
+
+static int
+listener_callback (void * UNUSED(arg), struct fgevent *fgev,
+                   struct fgevent * UNUSED(ansev))
+{
+    if (fgev != NULL && fgev->id == EVENT_ID && fgev->sender == BYSTANDER_ID)
+        sem_post (&heard);
+
+    return 0;
+}
+
+/* Flood a stalled consumer under backpressure while two other clients talk
+   to each other. Only the flooding producer may be paused, and the stalled
+   consumer is dropped once it misses its pings. Returns how many of the
+   events between the others arrived in time */
+static int
+flood_with_bystanders (struct fg_events_stats *stats)
+{
+    int heard_count = 0;
+    struct timespec ts;
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+    struct fg_events_data sender, stalled, bystander, listener;
+    struct fgevent fgev = {EVENT_ID, 0, STALLED_ID, 0, PAYLOAD_LEN,
+                           &(payload[0])};
+    struct fgevent chat = {EVENT_ID, 0, LISTENER_ID, 0, 0, NULL};
+
+    fg_events_opts_init (&opts);
+    opts.mem_budget = BUDGET;
+    opts.mem_policy = FG_MEM_BACKPRESSURE;
+    opts.ping_interval.tv_sec = 0;
+    opts.ping_interval.tv_usec = 200 * 1000;
+    fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                SOCK_PATH, 1, &opts);
+
+    sem_init (&stall_gate, 0, 0);
+    sem_init (&heard, 0, 0);
+    fg_events_client_init_unix (&sender, &client_callback, NULL, NULL,
+                                SOCK_PATH, SENDER_ID);
+    fg_events_client_init_unix (&stalled, &stalled_callback, NULL, NULL,
+                                SOCK_PATH, STALLED_ID);
+    fg_events_client_init_unix (&bystander, &client_callback, NULL, NULL,
+                                SOCK_PATH, BYSTANDER_ID);
+    fg_events_client_init_unix (&listener, &listener_callback, NULL, NULL,
+                                SOCK_PATH, LISTENER_ID);
+
+    usleep (100 * 1000); // make sure all clients are connected
+
+    for (int i = 0; i < NUM_EVENTS; i++)
+        fg_send_event (&sender, &fgev);
+
+    usleep (200 * 1000); // let the server go over the budget
+
+    for (int i = 0; i < NUM_BYSTANDER_EVENTS; i++)
+        fg_send_event (&bystander, &chat);
+
+    /* Well before the stalled consumer misses enough pings to be dropped */
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_nsec += 500 * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+      {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+    while (heard_count < NUM_BYSTANDER_EVENTS &&
+           sem_timedwait (&heard, &ts) == 0)
+        heard_count++;
+
+    /* Five missed pings at 200 ms */
+    usleep (1500 * 1000);
+
+    fg_events_get_stats (&server, stats);
+
+    fg_events_server_shutdown (&server);
+    fg_events_client_shutdown (&sender);
+    fg_events_client_shutdown (&bystander);
+    fg_events_client_shutdown (&listener);
+    sem_post (&stall_gate);
+    fg_events_client_shutdown (&stalled);
+    sem_destroy (&stall_gate);
+    sem_destroy (&heard);
+
+    return heard_count;
+}
+
+/* Start a server with the given policy and flood a client which stops
+   reading its socket. Returns the server stats once the flood has
+   settled */
+static void
+flood_stalled_client (uint8_t policy, struct test_struct *test_data,
+                      struct fg_events_stats *stats)
+{
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+    struct fg_events_data sender, stalled;
+    struct fgevent fgev = {EVENT_ID, 0, STALLED_ID, 0, PAYLOAD_LEN,
+                           &(payload[0])};
+
+    fg_events_opts_init (&opts);
+    opts.mem_budget = BUDGET;
+    opts.mem_policy = policy;
+    fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                SOCK_PATH, 1, &opts);
+
+    fg_events_client_init_unix (&sender, &client_callback, NULL, test_data,
+                                SOCK_PATH, SENDER_ID);
+    fg_events_client_init_unix (&stalled, &stalled_callback, NULL, NULL,
+                                SOCK_PATH, STALLED_ID);
+
+    usleep (100 * 1000); // make sure all clients are connected
+
+    sem_init (&stall_gate, 0, 0);
+    for (int i = 0; i < NUM_EVENTS; i++)
+        fg_send_event (&sender, &fgev);
+
+    usleep (500 * 1000); // let the server work through what it can
+
+    fg_events_get_stats (&server, stats);
+
+    fg_events_server_shutdown (&server);
+    fg_events_client_shutdown (&sender);
+    sem_post (&stall_gate);
+    fg_events_client_shutdown (&stalled);
+    sem_destroy (&stall_gate);
+}
+
+/* Connect without the library, announce user SELF_ID and flood it with
+   events to itself without ever reading. The server sheds the connection
+   while it is reading from it, and has to stop touching it right there.
+   Returns the server stats once the flood is over */
+static int
+flood_self (struct fg_events_stats *stats)
+{
+    int fd, len;
+    unsigned char *buf;
+    int32_t announce[] = {-1};
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+    struct fgevent fgev = {FG_CONNECTED, SELF_ID, 0, 0, 1, &(announce[0])};
+    struct sockaddr_un sun;
+
+    fg_events_opts_init (&opts);
+    opts.mem_budget = BUDGET / 4;
+    opts.mem_policy = FG_MEM_SHED;
+    if (fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                    SOCK_PATH, 1, &opts) < 0)
+        return -1;
+
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_LOCAL;
+    strncpy (sun.sun_path, SOCK_PATH, sizeof (sun.sun_path) - 1);
+
+    fd = socket (AF_LOCAL, SOCK_STREAM, 0);
+    if (fd < 0 || connect (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0)
+        return -1;
+
+    len = create_serialized_fgevent_buffer (&buf, &fgev);
+    if (len < 0 || send (fd, buf, len, MSG_NOSIGNAL) != len)
+        return -1;
+    free (buf);
+
+    fgev.id = EVENT_ID;
+    fgev.receiver = SELF_ID;
+    fgev.length = PAYLOAD_LEN;
+    fgev.payload = payload;
+    len = create_serialized_fgevent_buffer (&buf, &fgev);
+    if (len < 0)
+        return -1;
+
+    /* Stop once the server hangs up on us */
+    for (int i = 0; i < NUM_EVENTS; i++)
+      {
+        if (send (fd, buf, len, MSG_NOSIGNAL) != len)
+            break;
+      }
+    free (buf);
+
+    usleep (200 * 1000); // let the server work through what it can
+
+    fg_events_get_stats (&server, stats);
+    close (fd);
+    fg_events_server_shutdown (&server);
+
+    return 0;
+}
+
+int
+main (void)
+{
+    int s;
+    pthread_mutex_t mutex;
+    struct test_struct test_data;
+    struct fg_events_stats stats;
+
+    memset (&test_data, 0, sizeof (test_data));
+
+    pthread_mutex_init (&mutex, NULL);
+    test_data.mutex = &mutex;
+
+    /* Shedding drops the stalled receiver and tells the sender about it */
+    flood_stalled_client (FG_MEM_SHED, &test_data, &stats);
+    if (stats.mem_sheds == 0 || stats.mem_pauses != 0 ||
+        stats.mem_bytes > BUDGET)
+      {
+        PRINT_FAIL ("shedding ([%llu, %llu, %llu])",
+                    (unsigned long long) stats.mem_sheds,
+                    (unsigned long long) stats.mem_pauses,
+                    (unsigned long long) stats.mem_bytes);
+        exit (EXIT_FAILURE);
+      }
+
+    if (test_data.offline_count == 0)
+      {
+        PRINT_FAIL ("sender not told the shed user is offline");
+        exit (EXIT_FAILURE);
+      }
+
+    /* Backpressure keeps everyone connected and the buffers within reach of
+       the budget, only one read may overshoot it */
+    flood_stalled_client (FG_MEM_BACKPRESSURE, &test_data, &stats);
+    if (stats.mem_pauses == 0 || stats.mem_sheds != 0 || stats.drops != 0 ||
+        stats.mem_bytes > 2 * BUDGET)
+      {
+        PRINT_FAIL ("backpressure ([%llu, %llu, %llu])",
+                    (unsigned long long) stats.mem_pauses,
+                    (unsigned long long) stats.mem_sheds,
+                    (unsigned long long) stats.mem_bytes);
+        exit (EXIT_FAILURE);
+      }
+
+    /* Backpressure only holds up the producers of the stalled consumer,
+       which is dropped in the end */
+    s = flood_with_bystanders (&stats);
+    if (s != NUM_BYSTANDER_EVENTS || stats.mem_pauses == 0 ||
+        stats.drops == 0)
+      {
+        PRINT_FAIL ("bystanders ([%d, %llu, %llu])", s,
+                    (unsigned long long) stats.mem_pauses,
+                    (unsigned long long) stats.drops);
+        exit (EXIT_FAILURE);
+      }
+
+    /* Shedding the connection whose input is being read */
+    if (flood_self (&stats) < 0 || stats.mem_sheds == 0)
+      {
+        PRINT_FAIL ("shedding the reading connection ([%llu])",
+                    (unsigned long long) stats.mem_sheds);
+        exit (EXIT_FAILURE);
+      }
+
+    pthread_mutex_destroy (&mutex);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
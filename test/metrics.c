@@ -0,0 +1,185 @@
+/*
+ *  metrics.c
+ *    Integration test to check if the metrics socket hands out the counters
+ *    of the server in the Prometheus text format.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/metrics.sock"
+#define METRICS_PATH "/tmp/metrics_prom.sock"
+#define EVENT_ID ABI
+#define SENDER_ID 2
+#define RECEIVER_ID 3
+#define NUM_EVENTS 10
+
+static char scrape_buf[64 * 1024];
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+client_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+/* Read everything the metrics socket has to say until it is closed */
+static ssize_t
+scrape (void)
+{
+    int fd;
+    ssize_t n, len = 0;
+    struct sockaddr_un sun;
+
+    fd = socket (AF_LOCAL, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_LOCAL;
+    strncpy (sun.sun_path, METRICS_PATH, sizeof (sun.sun_path) - 1);
+    if (connect (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0)
+      {
+        close (fd);
+        return -1;
+      }
+
+    while ((n = read (fd, scrape_buf + len,
+                      sizeof (scrape_buf) - 1 - len)) > 0)
+        len += n;
+    close (fd);
+    scrape_buf[len] = '\0';
+
+    return n < 0 ? -1 : len;
+}
+
+static int
+count_lines (const char *prefix)
+{
+    int n = 0;
+
+    for (const char *line = scrape_buf; line != NULL && *line != '\0';)
+      {
+        if (strncmp (line, prefix, strlen (prefix)) == 0)
+            n++;
+        line = strchr (line, '\n');
+        if (line != NULL)
+            line++;
+      }
+
+    return n;
+}
+
+int
+main (void)
+{
+    int fd;
+    struct sockaddr_un sun;
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+    struct fg_events_data sender, receiver;
+    int32_t payload[] = {1, 2, 3, 4};
+    struct fgevent fgev = {EVENT_ID, 0, RECEIVER_ID, 0, 4, &(payload[0])};
+    const char *expected[] = {
+        "# TYPE fgevents_events_in_total counter\n",
+        "fgevents_mem_bytes ",
+        "fgevents_conn_events_out_total{user_id=\"3\"} ",
+        "# TYPE fgevents_latency_seconds histogram\n",
+        "fgevents_latency_seconds_bucket{kind=\"server_hop\",le=\"+Inf\"} 10\n",
+    };
+
+    fg_events_opts_init (&opts);
+    opts.track_latency = true;
+    opts.metrics_path = METRICS_PATH;
+    fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                SOCK_PATH, 1, &opts);
+    fg_events_client_init_unix (&receiver, &client_callback, NULL, NULL,
+                                SOCK_PATH, RECEIVER_ID);
+    fg_events_client_init_unix (&sender, &client_callback, NULL, NULL,
+                                SOCK_PATH, SENDER_ID);
+
+    /* A connection which never announces itself has no series of its own */
+    fd = socket (AF_LOCAL, SOCK_STREAM, 0);
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_LOCAL;
+    strncpy (sun.sun_path, SOCK_PATH, sizeof (sun.sun_path) - 1);
+    if (fd < 0 || connect (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0)
+      {
+        PRINT_FAIL ("unannounced connect");
+        exit (EXIT_FAILURE);
+      }
+
+    usleep (100 * 1000); // make sure all clients are connected
+
+    for (int i = 0; i < NUM_EVENTS; i++)
+        fg_send_event (&sender, &fgev);
+
+    usleep (100 * 1000); // let the events pass the server
+
+    if (scrape () <= 0)
+      {
+        PRINT_FAIL ("could not scrape metrics");
+        exit (EXIT_FAILURE);
+      }
+
+    for (size_t i = 0; i < LEN (expected); i++)
+      {
+        if (strstr (scrape_buf, expected[i]) == NULL)
+          {
+            PRINT_FAIL ("metrics lack %s", expected[i]);
+            exit (EXIT_FAILURE);
+          }
+      }
+
+    if (count_lines ("fgevents_conn_events_out_total{") != 2)
+      {
+        PRINT_FAIL ("expected one series per announced client");
+        exit (EXIT_FAILURE);
+      }
+
+    /* A second scrape is served just like the first one */
+    if (scrape () <= 0 || strstr (scrape_buf, expected[0]) == NULL)
+      {
+        PRINT_FAIL ("second scrape");
+        exit (EXIT_FAILURE);
+      }
+
+    close (fd);
+    fg_events_client_shutdown (&sender);
+    fg_events_client_shutdown (&receiver);
+    fg_events_server_shutdown (&server);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
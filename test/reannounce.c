@@ -0,0 +1,170 @@
+/*
+ *  reannounce.c
+ *    Integration test to check that a peer may announce itself again on the
+ *    connection it disconnected on, and is reachable afterwards.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/reannounce.sock"
+#define EVENT_ID (ABI + 1)
+#define SERVER_ID 1
+#define PEER_ID 5
+#define SENDER_ID 6
+
+static int
+callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+          struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+send_event (int fd, int32_t id)
+{
+    int len, s;
+    unsigned char *buf;
+    int32_t payload[] = {-1};
+    struct fgevent fgev = {id, PEER_ID, 0, 0, 1, &(payload[0])};
+
+    len = create_serialized_fgevent_buffer (&buf, &fgev);
+    if (len < 0)
+        return -1;
+    s = send (fd, buf, len, MSG_NOSIGNAL) == len ? 0 : -1;
+    free (buf);
+
+    return s;
+}
+
+/* Read from the peer until an event with the given id turns up */
+static int
+wait_event (int fd, int32_t id)
+{
+    unsigned char buf[4096];
+    size_t len = 0;
+
+    for (;;)
+      {
+        ssize_t n;
+        unsigned char *ptr = buf;
+        struct pollfd pfd = {fd, POLLIN, 0};
+
+        if (poll (&pfd, 1, 2000) <= 0)
+            return -1;
+        n = read (fd, buf + len, sizeof (buf) - len);
+        if (n <= 0)
+            return -1;
+        len += n;
+
+        for (;;)
+          {
+            struct fgevent fgev;
+            unsigned char *start = ptr;
+            int s = fg_parse_fgevent (&fgev, buf, len, &ptr);
+
+            if (s == 0)
+              {
+                /* Keep a frame cut short for the next read */
+                while (start < buf + len && start[0] != 0x02)
+                    start++;
+                len -= start - buf;
+                memmove (buf, start, len);
+                break;
+              }
+            if (s < 0)
+                continue;
+            if (fgev.length > 0)
+                free (fgev.payload);
+            if (fgev.id == id)
+                return 0;
+          }
+      }
+}
+
+int
+main (void)
+{
+    int fd;
+    struct sockaddr_un sun;
+    struct fg_events_opts opts;
+    struct fg_events_data server, sender;
+    struct fgevent fgev = {EVENT_ID, 0, PEER_ID, 0, 0, NULL};
+
+    fg_events_opts_init (&opts);
+    timerclear (&opts.ping_interval);
+    if (fg_events_server_init_opts (&server, &callback, NULL, 0, SOCK_PATH,
+                                    SERVER_ID, &opts) < 0)
+      {
+        PRINT_FAIL ("server init");
+        exit (EXIT_FAILURE);
+      }
+
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_LOCAL;
+    strncpy (sun.sun_path, SOCK_PATH, sizeof (sun.sun_path) - 1);
+
+    /* Connected, disconnected and connected again, all on one socket */
+    fd = socket (AF_LOCAL, SOCK_STREAM, 0);
+    if (fd < 0 || connect (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0 ||
+        send_event (fd, FG_CONNECTED) < 0 ||
+        send_event (fd, FG_DISCONNECTED) < 0 ||
+        send_event (fd, FG_CONNECTED) < 0)
+      {
+        PRINT_FAIL ("announce the peer");
+        exit (EXIT_FAILURE);
+      }
+
+    if (fg_events_client_init_unix_opts (&sender, &callback, NULL, NULL,
+                                         SOCK_PATH, SENDER_ID, &opts) < 0)
+      {
+        PRINT_FAIL ("sender init");
+        exit (EXIT_FAILURE);
+      }
+    usleep (100 * 1000); // make sure the sender is confirmed
+
+    fg_send_event (&sender, &fgev);
+    if (wait_event (fd, EVENT_ID) < 0)
+      {
+        PRINT_FAIL ("event for the announced peer");
+        exit (EXIT_FAILURE);
+      }
+
+    if (fg_events_get_conn_stats (&server, NULL, 0) != 2)
+      {
+        PRINT_FAIL ("connections left on the server");
+        exit (EXIT_FAILURE);
+      }
+
+    close (fd);
+    fg_events_client_shutdown (&sender);
+    fg_events_server_shutdown (&server);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+/*
+ *  replay.c
+ *    Integration test to check that tools/fgreplay parses a capture file and
+ *    delivers the frames it holds to a server over a unix socket.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <libgen.h>
+#include <time.h>
+#include <semaphore.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/replay.sock"
+#define CAPTURE_PATH "/tmp/replay.fgcap"
+#define EVENT_ID (ABI + 1)
+#define SERVER_ID 1
+#define SENDER_ID 2
+#define RECEIVER_ID 3
+#define NUM_EVENTS 50
+
+static sem_t done;
+static int received;
+static int out_of_order = -1;
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+receiver_callback (void * UNUSED(arg), struct fgevent *fgev,
+                   struct fgevent * UNUSED(ansev))
+{
+    if (fgev == NULL || fgev->id != EVENT_ID)
+        return 0;
+
+    if ((fgev->length != 1 || fgev->payload[0] != received) &&
+        out_of_order < 0)
+        out_of_order = received;
+    if (++received == NUM_EVENTS)
+        sem_post (&done);
+
+    return 0;
+}
+
+/* Write a capture of the sender sending NUM_EVENTS events to the receiver,
+   with a frame the parser must reject in between */
+static int
+write_capture (void)
+{
+    struct fg_capture cap;
+    unsigned char garbage[] = {0xff, 0xff, 0xff, 0xff};
+
+    unlink (CAPTURE_PATH);
+    if (fg_capture_open (&cap, CAPTURE_PATH, 64 * 1024) < 0)
+        return -1;
+
+    for (int i = 0; i < NUM_EVENTS; i++)
+      {
+        ssize_t len;
+        unsigned char *buf;
+        int32_t index = i;
+        struct fgevent fgev = {EVENT_ID, SENDER_ID, RECEIVER_ID, 0, 1,
+                               &index};
+
+        len = create_serialized_fgevent_buffer (&buf, &fgev);
+        if (len < 0)
+          {
+            fg_capture_close (&cap);
+            return -1;
+          }
+        fg_capture_frame (&cap, FG_CAPTURE_IN, 0, SENDER_ID, buf, len);
+        free (buf);
+
+        if (i == NUM_EVENTS / 2)
+            fg_capture_frame (&cap, FG_CAPTURE_IN, 0, SENDER_ID, garbage,
+                              sizeof (garbage));
+      }
+
+    fg_capture_close (&cap);
+    return 0;
+}
+
+/* Run fgreplay, built next to the tests, and keep the last line it
+   printed */
+static int
+run_fgreplay (const char *test_path, const char *args, char *line,
+              size_t size)
+{
+    int s;
+    FILE *fp;
+    char *dir, cmd[512];
+
+    dir = strdup (test_path);
+    if (dir == NULL)
+        return -1;
+    snprintf (cmd, sizeof (cmd), "%s/../tools/fgreplay %s %s",
+              dirname (dir), args, CAPTURE_PATH);
+    free (dir);
+
+    fp = popen (cmd, "r");
+    if (fp == NULL)
+        return -1;
+    line[0] = '\0';
+    while (fgets (line, size, fp) != NULL)
+        ;
+    s = pclose (fp);
+
+    return WIFEXITED (s) && WEXITSTATUS (s) == 0 ? 0 : -1;
+}
+
+int
+main (int UNUSED(argc), char *argv[])
+{
+    char line[256], expect[64];
+    struct timespec ts;
+    struct fg_events_opts opts;
+    struct fg_events_data server, receiver;
+
+    sem_init (&done, 0, 0);
+
+    if (write_capture () < 0)
+      {
+        PRINT_FAIL ("write capture");
+        exit (EXIT_FAILURE);
+      }
+
+    /* Every record is parsed, the garbage one is counted as such */
+    snprintf (expect, sizeof (expect), "replayed %d frames", NUM_EVENTS);
+    if (run_fgreplay (argv[0], "-p -s 0", line, sizeof (line)) < 0 ||
+        strncmp (line, expect, strlen (expect)) != 0 ||
+        strstr (line, ", 1 unparsable)") == NULL)
+      {
+        PRINT_FAIL ("fgreplay --parse: %s", line);
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_opts_init (&opts);
+    timerclear (&opts.ping_interval);
+    if (fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                    SOCK_PATH, SERVER_ID, &opts) < 0 ||
+        fg_events_client_init_unix_opts (&receiver, &receiver_callback, NULL,
+                                         NULL, SOCK_PATH, RECEIVER_ID,
+                                         &opts) < 0)
+      {
+        PRINT_FAIL ("init");
+        exit (EXIT_FAILURE);
+      }
+
+    usleep (100 * 1000); // make sure the receiver is confirmed
+
+    /* The sender never connected, fgreplay announces it and the server
+       passes its events on to the receiver in order */
+    if (run_fgreplay (argv[0], "-u " SOCK_PATH " -s 0", line,
+                      sizeof (line)) < 0)
+      {
+        PRINT_FAIL ("fgreplay --unix: %s", line);
+        exit (EXIT_FAILURE);
+      }
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += 2;
+    if (sem_timedwait (&done, &ts) < 0 || out_of_order >= 0)
+      {
+        PRINT_FAIL ("replayed events ([%d, %d])", received, out_of_order);
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_client_shutdown (&receiver);
+    fg_events_server_shutdown (&server);
+
+    unlink (CAPTURE_PATH);
+    sem_destroy (&done);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
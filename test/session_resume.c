@@ -0,0 +1,396 @@
+/*
+ *  session_resume.c
+ *    Integration test to check if a client which loses its connection
+ *    resumes its session and receives exactly the events it missed.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/session_resume.sock"
+#define EVENT_ID ABI
+#define SENDER_ID 2
+#define RECEIVER_ID 3
+#define PEER_ID 4
+#define NUM_EVENTS 6
+
+/* A client speaking the protocol by hand, so its previous connection can
+   be left open when it reconnects */
+struct raw_peer {
+    int fd;
+    size_t len;
+    unsigned char buf[4096];
+};
+
+struct test_struct {
+    int received[NUM_EVENTS];
+    int received_count;
+    int confirmed_count;
+    int offline_count;
+    int out_of_order;
+    sem_t *sem;
+    pthread_mutex_t *mutex;
+};
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+client_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    if (fgev == NULL)
+        return 0;
+
+    pthread_mutex_lock (test_data->mutex);
+    switch (fgev->id)
+      {
+        case FG_CONFIRMED:
+            if (fgev->length < 2)
+              {
+                PRINT_FAIL ("confirmed event without resume token");
+                exit (EXIT_FAILURE);
+              }
+            test_data->confirmed_count++;
+            break;
+        case FG_USER_OFFLINE:
+            test_data->offline_count++;
+            break;
+        case EVENT_ID:
+            if (fgev->length != 1 || fgev->payload[0] < 0 ||
+                fgev->payload[0] >= NUM_EVENTS)
+              {
+                PRINT_FAIL ("corrupt event");
+                exit (EXIT_FAILURE);
+              }
+            if (fgev->payload[0] != test_data->received_count)
+                test_data->out_of_order++;
+            test_data->received[fgev->payload[0]]++;
+            test_data->received_count++;
+            sem_post (test_data->sem);
+            break;
+        default:
+            break;
+      }
+    pthread_mutex_unlock (test_data->mutex);
+
+    return 0;
+}
+
+static int
+wait_event (sem_t *sem, int timeout_ms)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+      {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+
+    return sem_timedwait (sem, &ts);
+}
+
+static void
+send_indexed_event (struct fg_events_data *sender, int32_t index)
+{
+    struct fgevent fgev;
+
+    fgev.id = EVENT_ID;
+    fgev.receiver = RECEIVER_ID;
+    fgev.writeback = 0;
+    fgev.length = 1;
+    fgev.payload = &index;
+    fg_send_event (sender, &fgev);
+}
+
+static int
+raw_connect (struct raw_peer *peer, uint32_t token, uint32_t last_seq)
+{
+    int len, s;
+    unsigned char *buf;
+    struct sockaddr_un sun;
+    int32_t payload[] = {-1, (int32_t) token, (int32_t) last_seq};
+    struct fgevent fgev = {FG_CONNECTED, PEER_ID, 0, 0, 3, &(payload[0])};
+
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_LOCAL;
+    strncpy (sun.sun_path, SOCK_PATH, sizeof (sun.sun_path) - 1);
+
+    peer->len = 0;
+    peer->fd = socket (AF_LOCAL, SOCK_STREAM, 0);
+    if (peer->fd < 0 ||
+        connect (peer->fd, (struct sockaddr *) &sun, sizeof (sun)) < 0)
+        return -1;
+
+    len = create_serialized_fgevent_buffer (&buf, &fgev);
+    if (len < 0)
+        return -1;
+    s = send (peer->fd, buf, len, MSG_NOSIGNAL) == len ? 0 : -1;
+    free (buf);
+
+    return s;
+}
+
+/* Returns 1 with the next event read by the peer, 0 once the server closed
+   the connection and -1 on timeout */
+static int
+raw_next_event (struct raw_peer *peer, struct fgevent *fgev,
+                struct fg_frame_ext *ext)
+{
+    for (;;)
+      {
+        ssize_t n;
+        unsigned char *ptr;
+        struct pollfd pfd = {peer->fd, POLLIN, 0};
+
+        while (peer->len > 0)
+          {
+            int s;
+
+            ptr = peer->buf;
+            s = fg_parse_fgevent_ext (fgev, ext, peer->buf, peer->len, &ptr);
+            if (s > 0)
+                ptr++;
+            else if (s == 0)
+              {
+                /* Keep a frame cut short for the next read */
+                ptr = peer->buf;
+                while (ptr < peer->buf + peer->len && ptr[0] != 0x02)
+                    ptr++;
+              }
+            peer->len -= ptr - peer->buf;
+            memmove (peer->buf, ptr, peer->len);
+            if (s > 0)
+                return 1;
+            if (s == 0)
+                break;
+          }
+
+        if (poll (&pfd, 1, 2000) <= 0)
+            return -1;
+        n = read (peer->fd, peer->buf + peer->len,
+                  sizeof (peer->buf) - peer->len);
+        if (n <= 0)
+            return 0;
+        peer->len += n;
+      }
+}
+
+/* Reconnect while the server still thinks the first connection is up, the
+   session moves to the new one and the old one gets closed */
+static void
+test_half_open (struct fg_events_data *sender)
+{
+    int i;
+    uint32_t token = 0, last_seq = 0;
+    struct fgevent fgev;
+    struct fg_frame_ext ext;
+    struct raw_peer first, second;
+
+    if (raw_connect (&first, 0, 0) < 0)
+      {
+        PRINT_FAIL ("half-open connect");
+        exit (EXIT_FAILURE);
+      }
+    usleep (100 * 1000); // make sure the peer is announced
+
+    fgev.id = EVENT_ID;
+    fgev.receiver = PEER_ID;
+    fgev.writeback = 0;
+    fgev.length = 1;
+    for (i = 0; i < NUM_EVENTS; i++)
+      {
+        int32_t index = i;
+        fgev.payload = &index;
+        fg_send_event (sender, &fgev);
+      }
+
+    /* Read the token and the first event only, the rest stays unread on
+       the first connection */
+    while (last_seq == 0 && raw_next_event (&first, &fgev, &ext) == 1)
+      {
+        if (fgev.id == FG_CONFIRMED && fgev.length >= 2)
+            token = (uint32_t) fgev.payload[1];
+        else if (fgev.id == EVENT_ID && (ext.flags & FG_EXT_HAS_SEQ))
+            last_seq = ext.seq;
+        if (fgev.length > 0)
+            free (fgev.payload);
+      }
+    if (token == 0 || last_seq == 0)
+      {
+        PRINT_FAIL ("half-open token or first event");
+        exit (EXIT_FAILURE);
+      }
+
+    if (raw_connect (&second, token, last_seq) < 0)
+      {
+        PRINT_FAIL ("half-open reconnect");
+        exit (EXIT_FAILURE);
+      }
+
+    for (i = 1; i < NUM_EVENTS;)
+      {
+        if (raw_next_event (&second, &fgev, &ext) != 1)
+          {
+            PRINT_FAIL ("half-open resume got %d of %d events", i,
+                        NUM_EVENTS);
+            exit (EXIT_FAILURE);
+          }
+        if (fgev.id == EVENT_ID)
+          {
+            if (fgev.length != 1 || fgev.payload[0] != i)
+              {
+                PRINT_FAIL ("half-open resume event %d out of order", i);
+                exit (EXIT_FAILURE);
+              }
+            i++;
+          }
+        if (fgev.length > 0)
+            free (fgev.payload);
+      }
+
+    /* Whatever was still queued, the first connection has to be closed */
+    for (;;)
+      {
+        int s = raw_next_event (&first, &fgev, &ext);
+        if (s == 0)
+            break;
+        if (s < 0)
+          {
+            PRINT_FAIL ("half-open connection left open");
+            exit (EXIT_FAILURE);
+          }
+        if (fgev.length > 0)
+            free (fgev.payload);
+      }
+
+    close (first.fd);
+    close (second.fd);
+}
+
+int
+main (void)
+{
+    int i;
+    sem_t event_sem;
+    pthread_mutex_t mutex;
+    struct test_struct test_data;
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+    struct fg_events_data sender, receiver;
+
+    sem_init (&event_sem, 0, 0);
+
+    memset (&test_data, 0, sizeof (test_data));
+    test_data.sem = &event_sem;
+
+    pthread_mutex_init (&mutex, NULL);
+    test_data.mutex = &mutex;
+
+    fg_events_opts_init (&opts);
+    opts.resume_window = 16;
+    opts.resume_linger.tv_sec = 5;
+    fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                SOCK_PATH, 1, &opts);
+
+    fg_events_client_init_unix (&sender, &client_callback, NULL, &test_data,
+                                SOCK_PATH, SENDER_ID);
+    fg_events_client_init_unix (&receiver, &client_callback, NULL,
+                                &test_data, SOCK_PATH, RECEIVER_ID);
+
+    usleep (100 * 1000); // make sure all clients are connected
+
+    send_indexed_event (&sender, 0);
+    if (wait_event (&event_sem, 1000) < 0)
+      {
+        PRINT_FAIL ("first event");
+        exit (EXIT_FAILURE);
+      }
+
+    /* Cut the connection of the receiver without a FG_DISCONNECTED event,
+       the rest of the events are sent while it is away */
+    shutdown (bufferevent_getfd (receiver.bev), SHUT_RDWR);
+    for (i = 1; i < NUM_EVENTS; i++)
+        send_indexed_event (&sender, i);
+
+    for (i = 1; i < NUM_EVENTS; i++)
+      {
+        if (wait_event (&event_sem, 2000) < 0)
+          {
+            PRINT_FAIL ("only %d of %d events received",
+                        test_data.received_count, NUM_EVENTS);
+            exit (EXIT_FAILURE);
+          }
+      }
+
+    usleep (100 * 1000); // catch duplicates which arrive late
+
+    test_half_open (&sender);
+
+    fg_events_client_shutdown (&sender);
+    fg_events_client_shutdown (&receiver);
+    fg_events_server_shutdown (&server);
+
+    sem_destroy (&event_sem);
+    pthread_mutex_destroy (&mutex);
+
+    for (i = 0; i < NUM_EVENTS; i++)
+      {
+        if (test_data.received[i] != 1)
+          {
+            PRINT_FAIL ("event %d received %d times", i,
+                        test_data.received[i]);
+            exit (EXIT_FAILURE);
+          }
+      }
+
+    if (test_data.out_of_order != 0 || test_data.offline_count != 0 ||
+        test_data.confirmed_count < 3)
+      {
+        PRINT_FAIL ("some events missed ([%d, %d, %d])",
+                    test_data.out_of_order, test_data.offline_count,
+                    test_data.confirmed_count);
+        exit (EXIT_FAILURE);
+      }
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
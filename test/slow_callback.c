@@ -0,0 +1,274 @@
+/*
+ *  slow_callback.c
+ *    Integration test to check if a slow event callback is timed against
+ *    its event id and if the watchdog reports the stalled loop while the
+ *    callback is still running.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <semaphore.h>
+
+#include <event2/event.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/slow_callback.sock"
+#define FAST_ID ABI
+#define SLOW_ID (ABI + 1)
+#define SERVER_ID 1
+#define SENDER_ID 2
+#define NUM_EVENTS 10
+#define EMBEDDED_PATH "/tmp/slow_callback_base.sock"
+
+static struct event_base *base;
+static struct fg_events_data embedded_sender;
+static pthread_t main_thread;
+static int embedded_stalls;
+static bool wrong_thread;
+
+struct test_struct {
+    int fast_count;
+    int32_t stalled_id;
+    sem_t *sem;
+    pthread_mutex_t *mutex;
+};
+
+static int
+server_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    if (fgev == NULL)
+        return 0;
+
+    if (fgev->id == SLOW_ID)
+      {
+        usleep (300 * 1000);
+        sem_post (test_data->sem);
+      }
+    else if (fgev->id == FAST_ID)
+      {
+        pthread_mutex_lock (test_data->mutex);
+        test_data->fast_count++;
+        pthread_mutex_unlock (test_data->mutex);
+      }
+
+    return 0;
+}
+
+static int
+client_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static void
+stall_callback (void *arg, int32_t id, uint64_t UNUSED(stalled_ns))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    pthread_mutex_lock (test_data->mutex);
+    test_data->stalled_id = id;
+    pthread_mutex_unlock (test_data->mutex);
+}
+
+static int
+embedded_callback (void * UNUSED(arg), struct fgevent *fgev,
+                   struct fgevent * UNUSED(ansev))
+{
+    if (fgev != NULL && fgev->id == SLOW_ID)
+      {
+        struct timeval linger = {0, 300 * 1000};
+
+        usleep (300 * 1000);
+        event_base_loopexit (base, &linger);
+      }
+
+    return 0;
+}
+
+static void
+embedded_error_callback (void * UNUSED(arg), const struct fg_error *error)
+{
+    if (!pthread_equal (pthread_self (), main_thread))
+        wrong_thread = true;
+    if (strcmp (error->msg, "events loop stalled") == 0)
+        embedded_stalls++;
+}
+
+static void
+send_slow_cb (evutil_socket_t UNUSED(fd), short UNUSED(what),
+              void * UNUSED(arg))
+{
+    struct fgevent fgev = {SLOW_ID, 0, SERVER_ID, 0, 0, NULL};
+
+    fg_send_event (&embedded_sender, &fgev);
+}
+
+/* A stall of an instance on the caller's base is reported from the loop,
+   whose base is not thread safe. Runs before any threaded instance, those
+   make libevent lock every base created afterwards */
+static int
+test_embedded (void)
+{
+    struct fg_events_opts opts;
+    struct fg_events_data server;
+    struct timeval send_delay = {0, 100 * 1000};
+
+    main_thread = pthread_self ();
+    base = event_base_new ();
+    if (base == NULL)
+      {
+        PRINT_FAIL ("event_base_new");
+        return -1;
+      }
+
+    fg_events_opts_init (&opts);
+    opts.watchdog_timeout.tv_usec = 100 * 1000;
+    opts.error_cb = &embedded_error_callback;
+    if (fg_events_server_init_base (&server, base, &embedded_callback, NULL,
+                                    0, EMBEDDED_PATH, SERVER_ID, &opts) != 0 ||
+        fg_events_client_init_unix_base (&embedded_sender, base,
+                                         &client_callback, NULL, NULL,
+                                         EMBEDDED_PATH, SENDER_ID,
+                                         NULL) != 0)
+      {
+        PRINT_FAIL ("init on the event base");
+        return -1;
+      }
+
+    event_base_once (base, -1, EV_TIMEOUT, send_slow_cb, NULL, &send_delay);
+    event_base_dispatch (base);
+
+    fg_events_client_shutdown (&embedded_sender);
+    fg_events_server_shutdown (&server);
+    event_base_free (base);
+
+    if (embedded_stalls != 1 || wrong_thread)
+      {
+        PRINT_FAIL ("embedded stall reported %d times", embedded_stalls);
+        return -1;
+      }
+
+    return 0;
+}
+
+int
+main (void)
+{
+    int i, s;
+    size_t n;
+    sem_t pass_test_sem;
+    pthread_mutex_t mutex;
+    struct timespec ts;
+    struct test_struct test_data;
+    struct fg_events_opts opts;
+    struct fg_events_data server, sender;
+    struct fg_events_stats stats;
+    struct fg_callback_stats cbstats[FG_CALLBACK_STATS_SIZE];
+    struct fgevent fgev = {FAST_ID, 0, SERVER_ID, 0, 0, NULL};
+
+    signal (SIGPIPE, SIG_IGN);
+    if (test_embedded () < 0)
+        exit (EXIT_FAILURE);
+
+    sem_init (&pass_test_sem, 0, 0);
+
+    memset (&test_data, 0, sizeof (test_data));
+    test_data.stalled_id = -1;
+    test_data.sem = &pass_test_sem;
+
+    pthread_mutex_init (&mutex, NULL);
+    test_data.mutex = &mutex;
+
+    fg_events_opts_init (&opts);
+    opts.callback_warn.tv_usec = 50 * 1000;
+    opts.watchdog_timeout.tv_usec = 100 * 1000;
+    opts.stall_cb = &stall_callback;
+    fg_events_server_init_opts (&server, &server_callback, &test_data, 0,
+                                SOCK_PATH, SERVER_ID, &opts);
+    fg_events_client_init_unix (&sender, &client_callback, NULL, NULL,
+                                SOCK_PATH, SENDER_ID);
+
+    usleep (100 * 1000); // make sure the client is connected
+
+    for (i = 0; i < NUM_EVENTS; i++)
+        fg_send_event (&sender, &fgev);
+    fgev.id = SLOW_ID;
+    fg_send_event (&sender, &fgev);
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += 2;
+    s = sem_timedwait (&pass_test_sem, &ts);
+    if (s < 0)
+      {
+        PRINT_FAIL ("slow event never handled");
+        exit (EXIT_FAILURE);
+      }
+    usleep (50 * 1000); // let the callback return
+
+    fg_events_get_stats (&server, &stats);
+    if (stats.slow_callbacks != 1 || stats.loop_stalls < 1 ||
+        test_data.stalled_id != SLOW_ID)
+      {
+        PRINT_FAIL ("slow callback not reported ([%llu, %llu, %d])",
+                    (unsigned long long) stats.slow_callbacks,
+                    (unsigned long long) stats.loop_stalls,
+                    test_data.stalled_id);
+        exit (EXIT_FAILURE);
+      }
+
+    n = fg_events_get_callback_stats (&server, cbstats, LEN(cbstats));
+    for (i = 0; i < (int) n; i++)
+      {
+        if (cbstats[i].id == SLOW_ID &&
+            (cbstats[i].slow != 1 || cbstats[i].max_ns < 300 * 1000000ULL))
+          {
+            PRINT_FAIL ("slow event timed at %llu ns",
+                        (unsigned long long) cbstats[i].max_ns);
+            exit (EXIT_FAILURE);
+          }
+        if (cbstats[i].id == FAST_ID &&
+            (cbstats[i].count != NUM_EVENTS || cbstats[i].slow != 0))
+          {
+            PRINT_FAIL ("fast events timed %llu times",
+                        (unsigned long long) cbstats[i].count);
+            exit (EXIT_FAILURE);
+          }
+      }
+
+    fg_events_client_shutdown (&sender);
+    fg_events_server_shutdown (&server);
+
+    sem_destroy (&pass_test_sem);
+    pthread_mutex_destroy (&mutex);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+/*
+ *  stats.c
+ *    Integration test to check if the library wide and per connection
+ *    counters add up after a known amount of traffic.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/stats.sock"
+#define EVENT_ID ABI
+#define SENDER_ID 2
+#define RECEIVER_ID 3
+#define UNKNOWN_ID 42
+#define NUM_EVENTS 50
+
+struct test_struct {
+    int received_count;
+    sem_t *sem;
+    pthread_mutex_t *mutex;
+};
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+client_callback (void *arg, struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    struct test_struct *test_data = (struct test_struct *) arg;
+
+    if (fgev == NULL)
+        return 0;
+
+    pthread_mutex_lock (test_data->mutex);
+    if (fgev->id == EVENT_ID && ++test_data->received_count == NUM_EVENTS)
+        sem_post (test_data->sem);
+    pthread_mutex_unlock (test_data->mutex);
+
+    return 0;
+}
+
+int
+main (void)
+{
+    int i, s;
+    ssize_t n;
+    sem_t pass_test_sem;
+    pthread_mutex_t mutex;
+    struct timespec ts;
+    struct test_struct test_data;
+    struct fg_events_data server;
+    struct fg_events_data sender, receiver;
+    struct fg_events_stats stats;
+    struct fg_conn_stats conns[4];
+    int32_t payload[] = {1, 2, 3, 4};
+    struct fgevent fgev = {EVENT_ID, 0, RECEIVER_ID, 0, 4, &(payload[0])};
+
+    sem_init (&pass_test_sem, 0, 0);
+
+    memset (&test_data, 0, sizeof (test_data));
+    test_data.sem = &pass_test_sem;
+
+    pthread_mutex_init (&mutex, NULL);
+    test_data.mutex = &mutex;
+
+    fg_events_server_init (&server, &server_callback, NULL, 0, SOCK_PATH, 1);
+    fg_events_client_init_unix (&receiver, &client_callback, NULL,
+                                &test_data, SOCK_PATH, RECEIVER_ID);
+    fg_events_client_init_unix (&sender, &client_callback, NULL, &test_data,
+                                SOCK_PATH, SENDER_ID);
+
+    usleep (100 * 1000); // make sure all clients are connected
+
+    for (i = 0; i < NUM_EVENTS; i++)
+      {
+        fgev.receiver = RECEIVER_ID;
+        fg_send_event (&sender, &fgev);
+      }
+    fgev.receiver = UNKNOWN_ID;
+    fg_send_event (&sender, &fgev);
+
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec += 2;
+    s = sem_timedwait (&pass_test_sem, &ts);
+    if (s < 0)
+      {
+        PRINT_FAIL ("only %d events received", test_data.received_count);
+        exit (EXIT_FAILURE);
+      }
+    usleep (100 * 1000); // let the last event to the unknown user arrive
+
+    fg_events_get_stats (&sender, &stats);
+    if (stats.events_out < NUM_EVENTS + 1 || stats.bytes_out == 0)
+      {
+        PRINT_FAIL ("sender counted %llu events",
+                    (unsigned long long) stats.events_out);
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_get_stats (&receiver, &stats);
+    if (stats.events_in < NUM_EVENTS || stats.parse_failures != 0)
+      {
+        PRINT_FAIL ("receiver counted %llu events",
+                    (unsigned long long) stats.events_in);
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_get_stats (&server, &stats);
+    if (stats.events_in < NUM_EVENTS + 1 || stats.dispatch_misses != 1 ||
+        stats.output_queued != 0)
+      {
+        PRINT_FAIL ("server counters ([%llu, %llu, %llu])",
+                    (unsigned long long) stats.events_in,
+                    (unsigned long long) stats.dispatch_misses,
+                    (unsigned long long) stats.output_queued);
+        exit (EXIT_FAILURE);
+      }
+
+    n = fg_events_get_conn_stats (&server, conns, LEN(conns));
+    if (n != 2)
+      {
+        PRINT_FAIL ("server has %zd connections", n);
+        exit (EXIT_FAILURE);
+      }
+    for (i = 0; i < n; i++)
+      {
+        if (conns[i].user_id == RECEIVER_ID &&
+            conns[i].events_out < NUM_EVENTS)
+          {
+            PRINT_FAIL ("receiver connection counted %llu events",
+                        (unsigned long long) conns[i].events_out);
+            exit (EXIT_FAILURE);
+          }
+        if (conns[i].user_id == SENDER_ID &&
+            conns[i].events_in < NUM_EVENTS + 1)
+          {
+            PRINT_FAIL ("sender connection counted %llu events",
+                        (unsigned long long) conns[i].events_in);
+            exit (EXIT_FAILURE);
+          }
+      }
+
+    fg_events_client_shutdown (&sender);
+    fg_events_client_shutdown (&receiver);
+    fg_events_server_shutdown (&server);
+
+    sem_destroy (&pass_test_sem);
+    pthread_mutex_destroy (&mutex);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
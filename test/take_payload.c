@@ -0,0 +1,218 @@
+/*
+ *  take_payload.c
+ *    Integration test to check that a callback may take over the payload of
+ *    an event and hand it to another thread without copying, and that it may
+ *    not take the payload of an event the server passes on.
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <semaphore.h>
+
+#define INTEGRATION_TEST
+#include "test_common.h"
+
+#define SOCK_PATH "/tmp/take_payload.sock"
+#define EVENT_ID (ABI + 1)
+#define SERVER_ID 1
+#define SENDER_ID 2
+#define RECEIVER_ID 3
+
+#define NUM_EVENTS 1000
+#define MAX_LEN 8
+
+/* Payloads taken by the receiver, waiting for the writer thread */
+struct taken {
+    int32_t *payload;
+    int32_t length;
+};
+
+static struct taken queue[NUM_EVENTS];
+static int queued;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+static struct fg_events_data server, sender, receiver;
+static bool server_took, empty_taken, taken_twice;
+static sem_t done;
+
+static int32_t
+event_length (int event)
+{
+    return event % (MAX_LEN + 1);
+}
+
+static int
+server_callback (void * UNUSED(arg), struct fgevent *fgev,
+                 struct fgevent * UNUSED(ansev))
+{
+    /* The server still has to pass these on */
+    if (fgev != NULL && fgev->id == EVENT_ID &&
+        (fg_events_take_payload (&server, fgev) != NULL || errno != EINVAL))
+        server_took = true;
+
+    return 0;
+}
+
+static int
+sender_callback (void * UNUSED(arg), struct fgevent * UNUSED(fgev),
+                 struct fgevent * UNUSED(ansev))
+{
+    return 0;
+}
+
+static int
+receiver_callback (void * UNUSED(arg), struct fgevent *fgev,
+                   struct fgevent * UNUSED(ansev))
+{
+    int32_t length;
+    int32_t *payload;
+
+    if (fgev == NULL || fgev->id != EVENT_ID)
+        return 0;
+
+    length = fgev->length;
+    payload = fg_events_take_payload (&receiver, fgev);
+    if (length == 0 && payload != NULL)
+        empty_taken = true;
+    if (fg_events_take_payload (&receiver, fgev) != NULL)
+        taken_twice = true;
+
+    pthread_mutex_lock (&lock);
+    queue[queued].payload = payload;
+    queue[queued].length = length;
+    queued++;
+    pthread_cond_signal (&cond);
+    pthread_mutex_unlock (&lock);
+
+    return 0;
+}
+
+/* Stands in for the background writer of an application, checks every
+   payload long after the callback returned and frees it */
+static void *
+writer_thread (void * UNUSED(arg))
+{
+    intptr_t failed = -1;
+
+    for (int e = 0; e < NUM_EVENTS; e++)
+      {
+        struct taken t;
+
+        pthread_mutex_lock (&lock);
+        while (queued <= e)
+            pthread_cond_wait (&cond, &lock);
+        t = queue[e];
+        pthread_mutex_unlock (&lock);
+
+        if (t.length != event_length (e) ||
+            (t.length > 0 && t.payload == NULL))
+            failed = failed < 0 ? e : failed;
+        for (int i = 0; t.payload != NULL && i < t.length; i++)
+          {
+            if (t.payload[i] != e * MAX_LEN + i)
+                failed = failed < 0 ? e : failed;
+          }
+        free (t.payload);
+      }
+
+    sem_post (&done);
+    return (void *) failed;
+}
+
+int
+main (void)
+{
+    void *failed;
+    pthread_t writer;
+    struct timespec deadline;
+    struct fg_events_opts opts;
+    int32_t payload[MAX_LEN];
+    struct fgevent fgev = {EVENT_ID, 0, RECEIVER_ID, 0, 0, &(payload[0])};
+
+    sem_init (&done, 0, 0);
+    pthread_create (&writer, NULL, writer_thread, NULL);
+
+    fg_events_opts_init (&opts);
+    timerclear (&opts.ping_interval);
+    if (fg_events_server_init_opts (&server, &server_callback, NULL, 0,
+                                    SOCK_PATH, SERVER_ID, &opts) < 0 ||
+        fg_events_client_init_unix_opts (&receiver, &receiver_callback, NULL,
+                                         NULL, SOCK_PATH, RECEIVER_ID,
+                                         &opts) < 0 ||
+        fg_events_client_init_unix_opts (&sender, &sender_callback, NULL,
+                                         NULL, SOCK_PATH, SENDER_ID,
+                                         &opts) < 0)
+      {
+        PRINT_FAIL ("init");
+        exit (EXIT_FAILURE);
+      }
+
+    /* Outside of a callback there is nothing to take */
+    if (fg_events_take_payload (&receiver, &fgev) != NULL || errno != EINVAL)
+      {
+        PRINT_FAIL ("payload taken outside of the callback");
+        exit (EXIT_FAILURE);
+      }
+
+    usleep (100 * 1000); // make sure both clients are confirmed
+
+    for (int e = 0; e < NUM_EVENTS; e++)
+      {
+        fgev.length = event_length (e);
+        for (int i = 0; i < fgev.length; i++)
+            payload[i] = e * MAX_LEN + i;
+        fg_send_event (&sender, &fgev);
+      }
+
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 10;
+    if (sem_timedwait (&done, &deadline) < 0)
+      {
+        PRINT_FAIL ("writer got %d of %d payloads", queued, NUM_EVENTS);
+        exit (EXIT_FAILURE);
+      }
+    pthread_join (writer, &failed);
+
+    if ((intptr_t) failed >= 0)
+      {
+        PRINT_FAIL ("payload of event %ld", (long) (intptr_t) failed);
+        exit (EXIT_FAILURE);
+      }
+
+    if (server_took || empty_taken || taken_twice)
+      {
+        PRINT_FAIL ("taken by the server %d, empty %d, twice %d",
+                    server_took, empty_taken, taken_twice);
+        exit (EXIT_FAILURE);
+      }
+
+    fg_events_client_shutdown (&sender);
+    fg_events_client_shutdown (&receiver);
+    fg_events_server_shutdown (&server);
+    sem_destroy (&done);
+
+    PRINT_SUCCESS ("all tests passed");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,496 @@
+/*
+ *  fgreplay.c
+ *    Replay frames captured by fgevents (see capture.h) into a server,
+ *    into a client or straight into the parser, at the original pace or as
+ *    fast as possible.
+ *
+ *    Usage: fgreplay [options] capture-file
+ *
+ *      -u, --unix PATH     connect to a server on a unix socket and send
+ *                          the frames it read, one connection per sender
+ *      -i, --inet HOST:PORT
+ *                          same as --unix over tcp
+ *      -l, --listen PATH   wait for a client on a unix socket and send it
+ *                          the frames the server wrote
+ *      -p, --parse         only run the frames through fg_parse_fgevent
+ *      -s, --speed FACTOR  pace relative to the capture, 0 is as fast as
+ *                          possible (default 1)
+ *      -U, --user ID       only replay frames of this user id
+ *      -n, --loops N       replay the capture N times (default 1)
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "fgevents.h"
+
+enum replay_mode {
+    MODE_NONE,
+    MODE_UNIX,
+    MODE_INET,
+    MODE_LISTEN,
+    MODE_PARSE
+};
+
+struct replay_opts {
+    enum replay_mode mode;
+    char   *target;
+    double speed;
+    int    user_id;      // -1 for all users
+    int    loops;
+};
+
+struct replay_stats {
+    unsigned long long frames;
+    unsigned long long bytes;
+    unsigned long long parse_failures;
+};
+
+/* One connection per user id replaying frames read by the server */
+static int user_fds[256];
+
+static uint64_t
+timespec_ns (const struct timespec *ts)
+{
+    return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static uint64_t
+monotonic_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return timespec_ns (&ts);
+}
+
+/* Wait until the frame is due, relative to the first frame of the loop */
+static void
+pace (const struct replay_opts *opts, uint64_t start, uint64_t first_ts,
+      uint64_t ts)
+{
+    struct timespec due;
+    uint64_t at;
+
+    if (opts->speed <= 0 || ts <= first_ts)
+        return;
+
+    at = start + (uint64_t) ((ts - first_ts) / opts->speed);
+    due.tv_sec = at / 1000000000;
+    due.tv_nsec = at % 1000000000;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) ==
+           EINTR)
+        ;
+}
+
+static int
+connect_target (const struct replay_opts *opts)
+{
+    int fd;
+
+    if (opts->mode == MODE_UNIX)
+      {
+        struct sockaddr_un sun;
+
+        memset (&sun, 0, sizeof (sun));
+        sun.sun_family = AF_LOCAL;
+        strncpy (sun.sun_path, opts->target, sizeof (sun.sun_path) - 1);
+        fd = socket (AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        if (connect (fd, (struct sockaddr *) &sun, sizeof (sun)) < 0)
+          {
+            close (fd);
+            return -1;
+          }
+      }
+    else
+      {
+        char host[64];
+        char *colon;
+        struct sockaddr_in sin;
+
+        strncpy (host, opts->target, sizeof (host) - 1);
+        host[sizeof (host) - 1] = '\0';
+        colon = strrchr (host, ':');
+        if (colon == NULL)
+          {
+            errno = EINVAL;
+            return -1;
+          }
+        *colon = '\0';
+
+        memset (&sin, 0, sizeof (sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = inet_addr (host);
+        sin.sin_port = htons (atoi (colon + 1));
+        fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            return -1;
+        if (connect (fd, (struct sockaddr *) &sin, sizeof (sin)) < 0)
+          {
+            close (fd);
+            return -1;
+          }
+      }
+
+    return fd;
+}
+
+static int
+listen_target (const struct replay_opts *opts)
+{
+    int lfd, fd;
+    struct sockaddr_un sun;
+
+    memset (&sun, 0, sizeof (sun));
+    sun.sun_family = AF_LOCAL;
+    strncpy (sun.sun_path, opts->target, sizeof (sun.sun_path) - 1);
+    unlink (opts->target);
+
+    lfd = socket (AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0)
+        return -1;
+    if (bind (lfd, (struct sockaddr *) &sun, sizeof (sun)) < 0 ||
+        listen (lfd, 1) < 0)
+      {
+        close (lfd);
+        return -1;
+      }
+
+    fprintf (stderr, "fgreplay: waiting for a client on %s\n", opts->target);
+    fd = accept4 (lfd, NULL, NULL, SOCK_CLOEXEC);
+    close (lfd);
+
+    return fd;
+}
+
+static int
+write_all (int fd, const unsigned char *buf, size_t len)
+{
+    while (len > 0)
+      {
+        ssize_t n = write (fd, buf, len);
+        if (n < 0)
+          {
+            if (errno == EINTR)
+                continue;
+            return -1;
+          }
+        buf += n;
+        len -= n;
+      }
+
+    return 0;
+}
+
+/* Helper function to close a connection once the peer has read all of it.
+   Closing with the answers of the peer unread resets the connection, and
+   the peer may find out before it has read the last frames. Gives up after
+   a second of silence */
+static void
+close_peer (int fd)
+{
+    unsigned char buf[4096];
+    struct pollfd pfd = {fd, POLLIN, 0};
+
+    shutdown (fd, SHUT_WR);
+    while (poll (&pfd, 1, 1000) > 0 && recv (fd, buf, sizeof buf, 0) > 0)
+        ;
+    close (fd);
+}
+
+/* Throw away what the peer sends us so that it never blocks on us */
+static void
+discard_input (int fd)
+{
+    unsigned char buf[4096];
+
+    while (recv (fd, buf, sizeof buf, MSG_DONTWAIT) > 0)
+        ;
+}
+
+/* Helper function to open the connection of a sender on its first frame.
+   If the capture began after the sender connected, its FG_CONNECTED frame
+   is made up so the server accepts the rest */
+static int
+user_fd (const struct replay_opts *opts, struct fgevent *fgev)
+{
+    uint8_t slot = (uint8_t) fgev->sender;
+    int fd = user_fds[slot];
+
+    if (fd >= 0)
+        return fd;
+
+    fd = connect_target (opts);
+    if (fd < 0)
+        return -1;
+    user_fds[slot] = fd;
+
+    if (fgev->id != FG_CONNECTED)
+      {
+        ssize_t n;
+        unsigned char *buf;
+        int32_t payload[] = { -1 };
+        struct fgevent hello = { FG_CONNECTED, fgev->sender, 0, 0, 1,
+                                 payload };
+
+        n = create_serialized_fgevent_buffer (&buf, &hello);
+        if (n < 0 || write_all (fd, buf, n) < 0)
+            fd = -1;
+        if (n >= 0)
+            free (buf);
+      }
+
+    return fd;
+}
+
+static int
+replay_frame (const struct replay_opts *opts, struct replay_stats *stats,
+              int listen_fd, const struct fg_capture_record *rec,
+              const unsigned char *frame)
+{
+    int fd;
+    ssize_t s;
+    struct fgevent fgev;
+    unsigned char *buf, *ptr;
+
+    /* The parser may scan up to the end, work on a private copy */
+    buf = malloc (rec->len);
+    if (buf == NULL)
+        return -1;
+    memcpy (buf, frame, rec->len);
+
+    ptr = buf;
+    s = fg_parse_fgevent (&fgev, buf, rec->len, &ptr);
+    if (s <= 0)
+      {
+        stats->parse_failures++;
+        free (buf);
+        return 0;
+      }
+
+    switch (opts->mode)
+      {
+        case MODE_PARSE:
+            fd = -1;
+            break;
+        case MODE_LISTEN:
+            fd = listen_fd;
+            break;
+        default:
+            fd = user_fd (opts, &fgev);
+            if (fd < 0)
+              {
+                perror ("fgreplay: connect");
+                goto fail;
+              }
+            break;
+      }
+
+    if (fd >= 0)
+      {
+        if (write_all (fd, frame, rec->len) < 0)
+          {
+            perror ("fgreplay: write");
+            goto fail;
+          }
+        discard_input (fd);
+      }
+
+    stats->frames++;
+    stats->bytes += rec->len;
+
+    if (fgev.length > 0)
+        free (fgev.payload);
+    free (buf);
+    return 0;
+
+    fail:
+    if (fgev.length > 0)
+        free (fgev.payload);
+    free (buf);
+    return -1;
+}
+
+static int
+replay (const struct replay_opts *opts, const char *path,
+        struct replay_stats *stats)
+{
+    int s, listen_fd = -1;
+    int dir = opts->mode == MODE_LISTEN ? FG_CAPTURE_OUT : FG_CAPTURE_IN;
+    struct fg_capture_reader reader;
+    const struct fg_capture_record *rec;
+    const unsigned char *frame;
+
+    if (fg_capture_reader_open (&reader, path) < 0)
+      {
+        perror ("fgreplay: could not open capture");
+        return -1;
+      }
+
+    if (opts->mode == MODE_LISTEN)
+      {
+        listen_fd = listen_target (opts);
+        if (listen_fd < 0)
+          {
+            perror ("fgreplay: listen");
+            fg_capture_reader_close (&reader);
+            return -1;
+          }
+      }
+
+    for (int loop = 0; loop < opts->loops; loop++)
+      {
+        uint64_t start = monotonic_ns ();
+        uint64_t first_ts = 0;
+
+        reader.pos = reader.hdr->tail;
+        while ((s = fg_capture_reader_next (&reader, &rec, &frame)) > 0)
+          {
+            if (rec->dir != dir && opts->mode != MODE_PARSE)
+                continue;
+            if (opts->user_id >= 0 && rec->user_id != opts->user_id)
+                continue;
+
+            if (first_ts == 0)
+                first_ts = rec->ts;
+            pace (opts, start, first_ts, rec->ts);
+
+            if (replay_frame (opts, stats, listen_fd, rec, frame) < 0)
+              {
+                s = -1;
+                break;
+              }
+          }
+
+        if (s < 0)
+            break;
+      }
+
+    if (listen_fd >= 0)
+        close_peer (listen_fd);
+    fg_capture_reader_close (&reader);
+
+    return s;
+}
+
+static void
+usage (const char *name)
+{
+    fprintf (stderr, "usage: %s [-u path | -i host:port | -l path | -p] "
+                     "[-s speed] [-U user] [-n loops] capture-file\n", name);
+}
+
+int
+main (int argc, char *argv[])
+{
+    int c, s;
+    uint64_t start, elapsed;
+    struct replay_opts opts;
+    struct replay_stats stats;
+    static const struct option long_opts[] = {
+        { "unix",   required_argument, NULL, 'u' },
+        { "inet",   required_argument, NULL, 'i' },
+        { "listen", required_argument, NULL, 'l' },
+        { "parse",  no_argument,       NULL, 'p' },
+        { "speed",  required_argument, NULL, 's' },
+        { "user",   required_argument, NULL, 'U' },
+        { "loops",  required_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    memset (&opts, 0, sizeof (opts));
+    opts.speed = 1.0;
+    opts.user_id = -1;
+    opts.loops = 1;
+
+    while ((c = getopt_long (argc, argv, "u:i:l:ps:U:n:", long_opts,
+                             NULL)) != -1)
+      {
+        switch (c)
+          {
+            case 'u':
+                opts.mode = MODE_UNIX;
+                opts.target = optarg;
+                break;
+            case 'i':
+                opts.mode = MODE_INET;
+                opts.target = optarg;
+                break;
+            case 'l':
+                opts.mode = MODE_LISTEN;
+                opts.target = optarg;
+                break;
+            case 'p':
+                opts.mode = MODE_PARSE;
+                break;
+            case 's':
+                opts.speed = atof (optarg);
+                break;
+            case 'U':
+                opts.user_id = atoi (optarg);
+                break;
+            case 'n':
+                opts.loops = atoi (optarg);
+                break;
+            default:
+                usage (argv[0]);
+                return EXIT_FAILURE;
+          }
+      }
+
+    if (opts.mode == MODE_NONE || optind != argc - 1)
+      {
+        usage (argv[0]);
+        return EXIT_FAILURE;
+      }
+
+    signal (SIGPIPE, SIG_IGN);
+    memset (user_fds, -1, sizeof (user_fds));
+    memset (&stats, 0, sizeof (stats));
+
+    start = monotonic_ns ();
+    s = replay (&opts, argv[optind], &stats);
+    elapsed = monotonic_ns () - start;
+
+    for (int i = 0; i < 256; i++)
+        if (user_fds[i] >= 0)
+            close_peer (user_fds[i]);
+
+    fprintf (stdout, "replayed %llu frames (%llu bytes, %llu unparsable) "
+                     "in %.3f s, %.0f frames/s\n", stats.frames, stats.bytes,
+             stats.parse_failures, elapsed / 1e9,
+             elapsed > 0 ? stats.frames * 1e9 / elapsed : 0.0);
+
+    return s < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1125 @@
+/*
+ *  uring.c
+ *    Transport moving the bytes of connections with io_uring instead of a
+ *    system call per read and write, driven from the libevent loop
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <event2/buffer.h>
+
+#include "fgevents.h"
+#include "uring.h"
+
+#ifdef FG_HAVE_URING
+
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Submission queue entries, the completion queue is larger since every
+   connection has a multishot recv which may post to it */
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+
+/* Buffers the kernel picks from for multishot receives, shared by all
+   connections. Their contents are copied out right away, so a few are
+   enough. The count must be a power of two */
+#define URING_RECV_BUFS  128
+#define URING_RECV_SIZE  4096
+#define URING_RECV_GROUP 0
+
+/* Registered buffers output is written from. A connection holds one while
+   its write is in flight and waits for one to be returned otherwise */
+#define URING_SEND_SLOTS 32
+#define URING_SEND_SIZE  16384
+
+/* Kind of operation in the low bits of user_data, the rest points to the
+   connection. Cancellations are submitted without one */
+enum uring_op {
+    URING_OP_NONE,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_CONNECT
+};
+
+#define URING_OP_MASK 3
+
+struct fg_uring_conn {
+    struct fg_uring          *ring;
+    struct bufferevent       *bev;
+    struct evbuffer_cb_entry *outcb;
+    evutil_socket_t          fd;
+    bool                     closed;     /* the bufferevent is gone */
+    bool                     connected;
+    bool                     connecting; /* connect in flight */
+    int                      connect_err;
+    bool                     recv_armed; /* multishot recv in flight */
+    bool                     recv_cancel;
+    bool                     kick;       /* run the read callback again */
+    short                    fail_what;  /* error to deliver from the loop */
+    int                      fail_err;
+    int                      slot;       /* send buffer in flight or -1 */
+    uint32_t                 send_off;
+    uint32_t                 send_len;
+    unsigned int             busy;       /* callbacks running */
+    bool                     dirty;      /* on the dirty stack */
+    struct fg_uring_conn     *dirty_next;
+    bool                     waiting;    /* waiting for a send buffer */
+    struct fg_uring_conn     *wait_next;
+    struct fg_uring_conn     *prev;
+    struct fg_uring_conn     *next;
+};
+
+struct fg_uring {
+    int                      fd;
+    int                      efd;
+    uint64_t                 *enters;
+    struct event             *cqev;
+    struct event             *flushev;
+    void                     *rings;
+    size_t                   rings_size;
+    struct io_uring_sqe      *sqes;
+    size_t                   sqes_size;
+    unsigned int             sq_entries;
+    unsigned int             sq_local;   /* tail of what is prepared */
+    unsigned int             *sq_head;
+    unsigned int             *sq_tail;
+    unsigned int             *sq_mask;
+    unsigned int             *sq_array;
+    unsigned int             *cq_head;
+    unsigned int             *cq_tail;
+    unsigned int             *cq_mask;
+    struct io_uring_cqe      *cqes;
+    unsigned int             inflight;   /* operations yet to complete */
+    struct io_uring_buf_ring *br;
+    size_t                   br_size;
+    uint16_t                 br_tail;
+    unsigned char            *recv_bufs;
+    unsigned char            *send_bufs;
+    int                      free_slots[URING_SEND_SLOTS];
+    int                      nfree;
+    struct fg_uring_conn     *dirty;     /* pushed to from any thread */
+    struct fg_uring_conn     *wait_head;
+    struct fg_uring_conn     *wait_tail;
+    struct fg_uring_conn     *conns;
+};
+
+static inline int
+sys_io_uring_setup (unsigned int entries, struct io_uring_params *p)
+{
+    return (int) syscall (__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+sys_io_uring_enter (int fd, unsigned int to_submit, unsigned int min_complete,
+                    unsigned int flags)
+{
+    return (int) syscall (__NR_io_uring_enter, fd, to_submit, min_complete,
+                          flags, NULL, 0);
+}
+
+static inline int
+sys_io_uring_register (int fd, unsigned int opcode, void *arg,
+                       unsigned int nr_args)
+{
+    return (int) syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static inline unsigned char *
+recv_buf (struct fg_uring *ring, uint16_t bid)
+{
+    return ring->recv_bufs + (size_t) bid * URING_RECV_SIZE;
+}
+
+static inline unsigned char *
+send_buf (struct fg_uring *ring, int slot)
+{
+    return ring->send_bufs + (size_t) slot * URING_SEND_SIZE;
+}
+
+/* Hand what was prepared to the kernel, optionally waiting for
+   completions */
+static int
+uring_enter (struct fg_uring *ring, unsigned int min_complete)
+{
+    int s;
+    unsigned int pending;
+
+    __atomic_store_n (ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    pending = ring->sq_local - __atomic_load_n (ring->sq_head,
+                                                __ATOMIC_ACQUIRE);
+    if (pending == 0 && min_complete == 0)
+        return 0;
+
+    s = sys_io_uring_enter (ring->fd, pending, min_complete,
+                            min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (ring->enters != NULL)
+        __atomic_fetch_add (ring->enters, 1, __ATOMIC_RELAXED);
+
+    return s;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe (struct fg_uring *ring)
+{
+    unsigned int index;
+    struct io_uring_sqe *sqe;
+
+    /* Full, make room by submitting what is queued */
+    if (ring->sq_local - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->sq_entries)
+      {
+        uring_enter (ring, 0);
+        if (ring->sq_local - __atomic_load_n (ring->sq_head,
+                                              __ATOMIC_ACQUIRE) >=
+            ring->sq_entries)
+            return NULL;
+      }
+
+    index = ring->sq_local & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset (sqe, 0, sizeof (struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local++;
+
+    return sqe;
+}
+
+/* Give a receive buffer back to the kernel */
+static void
+uring_recycle (struct fg_uring *ring, uint16_t bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &ring->br->bufs[ring->br_tail & (URING_RECV_BUFS - 1)];
+    buf->addr = (uintptr_t) recv_buf (ring, bid);
+    buf->len = URING_RECV_SIZE;
+    buf->bid = bid;
+    __atomic_store_n (&ring->br->tail, ++ring->br_tail, __ATOMIC_RELEASE);
+}
+
+static void
+conn_maybe_free (struct fg_uring_conn *conn)
+{
+    if (!conn->closed || conn->busy > 0 || conn->recv_armed ||
+        conn->slot >= 0 || conn->connecting || conn->waiting ||
+        __atomic_load_n (&conn->dirty, __ATOMIC_ACQUIRE))
+        return;
+
+    if (conn->prev != NULL)
+        conn->prev->next = conn->next;
+    else
+        conn->ring->conns = conn->next;
+    if (conn->next != NULL)
+        conn->next->prev = conn->prev;
+
+    free (conn);
+}
+
+/* Have the connection looked at on this turn of the loop. Called from the
+   output callback, which runs on any thread writing to the bufferevent */
+static void
+conn_mark (struct fg_uring_conn *conn)
+{
+    struct fg_uring *ring = conn->ring;
+
+    if (__atomic_exchange_n (&conn->dirty, true, __ATOMIC_ACQ_REL))
+        return;
+
+    conn->dirty_next = __atomic_load_n (&ring->dirty, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n (&ring->dirty, &conn->dirty_next, conn,
+                                         true, __ATOMIC_RELEASE,
+                                         __ATOMIC_RELAXED))
+        ;
+    event_active (ring->flushev, EV_WRITE, 0);
+}
+
+/* Error to be delivered from the loop, for failures while preparing
+   operations in the middle of handling others */
+static void
+conn_fail (struct fg_uring_conn *conn, short what, int err)
+{
+    if (conn->fail_err == 0)
+      {
+        conn->fail_what = what;
+        conn->fail_err = err;
+      }
+    conn_mark (conn);
+}
+
+/* Helper functions to run the callbacks of the bufferevent, which may close
+   the connection. Return true when it was closed, the connection may be
+   freed then and must not be touched */
+static bool
+conn_trigger (struct fg_uring_conn *conn, short iotype)
+{
+    conn->busy++;
+    bufferevent_trigger (conn->bev, iotype, 0);
+    conn->busy--;
+
+    if (!conn->closed)
+        return false;
+    conn_maybe_free (conn);
+    return true;
+}
+
+static bool
+conn_event (struct fg_uring_conn *conn, short what, int err)
+{
+    conn->busy++;
+    EVUTIL_SET_SOCKET_ERROR (err);
+    bufferevent_trigger_event (conn->bev, what, 0);
+    conn->busy--;
+
+    if (!conn->closed)
+        return false;
+    conn_maybe_free (conn);
+    return true;
+}
+
+static inline bool
+conn_reading (struct fg_uring_conn *conn)
+{
+    return (bufferevent_get_enabled (conn->bev) & EV_READ) != 0;
+}
+
+static inline bool
+conn_writing (struct fg_uring_conn *conn)
+{
+    return (bufferevent_get_enabled (conn->bev) & EV_WRITE) != 0;
+}
+
+static void
+conn_recv (struct fg_uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe (conn->ring);
+
+    if (sqe == NULL)
+      {
+        conn_fail (conn, BEV_EVENT_ERROR | BEV_EVENT_READING, EBUSY);
+        return;
+      }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_RECV_GROUP;
+    sqe->user_data = (uintptr_t) conn | URING_OP_RECV;
+    conn->recv_armed = true;
+    conn->ring->inflight++;
+}
+
+/* Reading was disabled, stop the multishot recv and leave what arrives
+   from now on in the socket */
+static void
+conn_cancel_recv (struct fg_uring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    if (conn->recv_cancel)
+        return;
+
+    sqe = uring_get_sqe (conn->ring);
+    if (sqe == NULL)
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t) conn | URING_OP_RECV;
+    sqe->user_data = URING_OP_NONE;
+    conn->recv_cancel = true;
+}
+
+static void
+conn_write (struct fg_uring_conn *conn)
+{
+    struct fg_uring *ring = conn->ring;
+    struct io_uring_sqe *sqe = uring_get_sqe (ring);
+
+    if (sqe == NULL)
+      {
+        ring->free_slots[ring->nfree++] = conn->slot;
+        conn->slot = -1;
+        conn_fail (conn, BEV_EVENT_ERROR | BEV_EVENT_WRITING, EBUSY);
+        return;
+      }
+
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t) (send_buf (ring, conn->slot) + conn->send_off);
+    sqe->len = conn->send_len - conn->send_off;
+    sqe->buf_index = conn->slot;
+    sqe->user_data = (uintptr_t) conn | URING_OP_SEND;
+    ring->inflight++;
+}
+
+/* Copy as much of the output as fits into a send buffer and write it. The
+   output is only drained once written, so it is accounted for like with
+   libevent until then */
+static void
+conn_send (struct fg_uring_conn *conn)
+{
+    ev_ssize_t n;
+    struct fg_uring *ring = conn->ring;
+    struct evbuffer *output;
+
+    if (conn->closed || !conn->connected || conn->slot >= 0 ||
+        conn->waiting || !conn_writing (conn))
+        return;
+
+    output = bufferevent_get_output (conn->bev);
+    if (evbuffer_get_length (output) == 0)
+        return;
+
+    if (ring->nfree == 0)
+      {
+        conn->waiting = true;
+        conn->wait_next = NULL;
+        if (ring->wait_tail != NULL)
+            ring->wait_tail->wait_next = conn;
+        else
+            ring->wait_head = conn;
+        ring->wait_tail = conn;
+        return;
+      }
+
+    conn->slot = ring->free_slots[--ring->nfree];
+    evbuffer_unfreeze (output, 1);
+    n = evbuffer_copyout (output, send_buf (ring, conn->slot),
+                          URING_SEND_SIZE);
+    evbuffer_freeze (output, 1);
+    if (n <= 0)
+      {
+        ring->free_slots[ring->nfree++] = conn->slot;
+        conn->slot = -1;
+        return;
+      }
+
+    conn->send_off = 0;
+    conn->send_len = n;
+    conn_write (conn);
+}
+
+/* Hand send buffers which were returned to the connections waiting */
+static void
+uring_serve_waiters (struct fg_uring *ring)
+{
+    while (ring->nfree > 0 && ring->wait_head != NULL)
+      {
+        struct fg_uring_conn *conn = ring->wait_head;
+
+        ring->wait_head = conn->wait_next;
+        if (ring->wait_head == NULL)
+            ring->wait_tail = NULL;
+        conn->waiting = false;
+
+        if (conn->closed)
+            conn_maybe_free (conn);
+        else
+            conn_send (conn);
+      }
+}
+
+static void
+complete_recv (struct fg_uring_conn *conn, const struct io_uring_cqe *cqe)
+{
+    struct fg_uring *ring = conn->ring;
+    bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    if (!more)
+      {
+        conn->recv_armed = false;
+        conn->recv_cancel = false;
+        ring->inflight--;
+      }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+      {
+        uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        int s = 0;
+
+        if (cqe->res > 0 && !conn->closed)
+          {
+            struct evbuffer *input = bufferevent_get_input (conn->bev);
+
+            evbuffer_unfreeze (input, 0);
+            s = evbuffer_add (input, recv_buf (ring, bid), cqe->res);
+            evbuffer_freeze (input, 0);
+          }
+        uring_recycle (ring, bid);
+        if (s < 0)
+          {
+            if (more)
+                conn_cancel_recv (conn);
+            conn_event (conn, BEV_EVENT_ERROR | BEV_EVENT_READING, ENOMEM);
+            return;
+          }
+      }
+
+    if (conn->closed)
+      {
+        conn_maybe_free (conn);
+        return;
+      }
+
+    if (cqe->res > 0)
+      {
+        /* Like a socket bufferevent, keep what was read but leave the rest
+           in the socket until reading is enabled again */
+        if (!conn_reading (conn))
+          {
+            if (more)
+                conn_cancel_recv (conn);
+            return;
+          }
+        if (!more)
+            conn_recv (conn);
+        conn_trigger (conn, EV_READ);
+      }
+    else if (cqe->res == -ENOBUFS || cqe->res == -ECANCELED)
+      {
+        /* Out of receive buffers, they were given back while reaping the
+           completions before this one. Cancelled since reading was
+           disabled, it may be enabled again by now */
+        if (!more && conn_reading (conn))
+            conn_recv (conn);
+      }
+    else
+      {
+        /* Like libevent, stop reading before telling about it */
+        bufferevent_disable (conn->bev, EV_READ);
+        if (cqe->res == 0)
+            conn_event (conn, BEV_EVENT_EOF | BEV_EVENT_READING, 0);
+        else
+            conn_event (conn, BEV_EVENT_ERROR | BEV_EVENT_READING,
+                        -cqe->res);
+      }
+}
+
+static void
+complete_send (struct fg_uring_conn *conn, int res)
+{
+    struct fg_uring *ring = conn->ring;
+    struct evbuffer *output;
+
+    ring->inflight--;
+
+    if (!conn->closed && (res == -EINTR || res == -EAGAIN))
+      {
+        conn_write (conn);
+        return;
+      }
+
+    if (conn->closed || res <= 0)
+      {
+        ring->free_slots[ring->nfree++] = conn->slot;
+        conn->slot = -1;
+        uring_serve_waiters (ring);
+        if (conn->closed)
+          {
+            conn_maybe_free (conn);
+            return;
+          }
+        bufferevent_disable (conn->bev, EV_WRITE);
+        conn_event (conn, BEV_EVENT_ERROR | BEV_EVENT_WRITING,
+                    res < 0 ? -res : EPIPE);
+        return;
+      }
+
+    output = bufferevent_get_output (conn->bev);
+    evbuffer_unfreeze (output, 1);
+    evbuffer_drain (output, res);
+    evbuffer_freeze (output, 1);
+    conn->send_off += res;
+    if (conn->send_off < conn->send_len)
+      {
+        conn_write (conn);
+        return;
+      }
+
+    ring->free_slots[ring->nfree++] = conn->slot;
+    conn->slot = -1;
+    uring_serve_waiters (ring);
+    conn_send (conn);
+
+    /* Like libevent, the write callback runs once the output is at or
+       below its low watermark */
+    conn_trigger (conn, EV_WRITE);
+}
+
+static void
+complete_connect (struct fg_uring_conn *conn, int res)
+{
+    int err = conn->connect_err, flags;
+    socklen_t len = sizeof (err);
+
+    conn->connecting = false;
+    conn->ring->inflight--;
+
+    if (conn->closed)
+      {
+        conn_maybe_free (conn);
+        return;
+      }
+
+    if (err == 0 && res < 0)
+        err = -res;
+    if (err == 0 &&
+        getsockopt (conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if (err != 0)
+      {
+        conn_event (conn, BEV_EVENT_ERROR, err);
+        return;
+      }
+
+    /* The ring waits for the socket itself, a blocking one spares it from
+       returning EAGAIN */
+    flags = fcntl (conn->fd, F_GETFL);
+    if (flags >= 0)
+        fcntl (conn->fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    conn->connected = true;
+    if (conn_event (conn, BEV_EVENT_CONNECTED, 0))
+        return;
+
+    conn_mark (conn);
+}
+
+static void
+uring_complete (const struct io_uring_cqe *cqe)
+{
+    struct fg_uring_conn *conn;
+
+    conn = (struct fg_uring_conn *) (uintptr_t)
+           (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+
+    switch (cqe->user_data & URING_OP_MASK)
+      {
+        case URING_OP_RECV:
+            complete_recv (conn, cqe);
+            break;
+        case URING_OP_SEND:
+            complete_send (conn, cqe->res);
+            break;
+        case URING_OP_CONNECT:
+            complete_connect (conn, cqe->res);
+            break;
+        default:
+            break;
+      }
+}
+
+static void
+uring_reap (struct fg_uring *ring)
+{
+    for (;;)
+      {
+        struct io_uring_cqe cqe;
+        unsigned int head = *ring->cq_head;
+
+        if (head == __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+            break;
+
+        /* Free the entry first, handling it may submit and complete more */
+        cqe = ring->cqes[head & *ring->cq_mask];
+        __atomic_store_n (ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        uring_complete (&cqe);
+      }
+}
+
+static void
+uring_cq_cb (evutil_socket_t fd, short UNUSED(what),
+             void *arg)
+{
+    uint64_t count;
+    struct fg_uring *ring = arg;
+
+    if (read (fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+        return;
+
+    uring_reap (ring);
+    uring_enter (ring, 0);
+}
+
+/* Once per turn of the loop, write the output queued on every connection
+   marked since the last turn with a single io_uring_enter */
+static void
+uring_flush_cb (evutil_socket_t UNUSED(fd),
+                short UNUSED(what), void *arg)
+{
+    struct fg_uring *ring = arg;
+    struct fg_uring_conn *conn, *next;
+
+    conn = __atomic_exchange_n (&ring->dirty, NULL, __ATOMIC_ACQUIRE);
+    for (; conn != NULL; conn = next)
+      {
+        next = conn->dirty_next;
+        __atomic_store_n (&conn->dirty, false, __ATOMIC_RELEASE);
+
+        if (conn->closed)
+          {
+            conn_maybe_free (conn);
+            continue;
+          }
+        if (conn->fail_err != 0)
+          {
+            int err = conn->fail_err;
+
+            conn->fail_err = 0;
+            conn_event (conn, conn->fail_what, err);
+            continue;
+          }
+        if (!conn->connected)
+            continue;
+
+        if (!conn->recv_armed && conn_reading (conn))
+            conn_recv (conn);
+        if (conn->kick)
+          {
+            conn->kick = false;
+            if (conn_reading (conn) && conn_trigger (conn, EV_READ))
+                continue;
+          }
+        conn_send (conn);
+      }
+
+    uring_enter (ring, 0);
+}
+
+static void
+conn_output_cb (struct evbuffer * UNUSED(buf),
+                const struct evbuffer_cb_info *info, void *arg)
+{
+    if (info->n_added > 0)
+        conn_mark (arg);
+}
+
+static void
+uring_release (struct fg_uring *ring)
+{
+    if (ring->cqev != NULL)
+        event_free (ring->cqev);
+    if (ring->flushev != NULL)
+        event_free (ring->flushev);
+    if (ring->fd >= 0)
+        close (ring->fd);
+    if (ring->efd >= 0)
+        close (ring->efd);
+    if (ring->rings != NULL)
+        munmap (ring->rings, ring->rings_size);
+    if (ring->sqes != NULL)
+        munmap (ring->sqes, ring->sqes_size);
+    if (ring->br != NULL)
+        munmap (ring->br, ring->br_size);
+    if (ring->send_bufs != NULL)
+        munmap (ring->send_bufs, URING_SEND_SLOTS * URING_SEND_SIZE);
+    free (ring->recv_bufs);
+    free (ring);
+}
+
+static void *
+map_anonymous (size_t size)
+{
+    void *p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+struct fg_uring *
+fg_uring_new (struct event_base *base, uint64_t *enters)
+{
+    int save_errno;
+    size_t sq_size, cq_size;
+    char *rings;
+    struct fg_uring *ring;
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    struct iovec iov[URING_SEND_SLOTS];
+
+    ring = calloc (1, sizeof (struct fg_uring));
+    if (ring == NULL)
+        return NULL;
+    ring->fd = -1;
+    ring->efd = -1;
+    ring->enters = enters;
+
+    memset (&p, 0, sizeof (p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_ENTRIES;
+    ring->fd = sys_io_uring_setup (URING_SQ_ENTRIES, &p);
+    if (ring->fd < 0)
+        goto fail;
+
+    /* Both rings share one mapping since 5.4 */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_NODROP))
+      {
+        errno = ENOSYS;
+        goto fail;
+      }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    ring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->rings = mmap (NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED)
+      {
+        ring->rings = NULL;
+        goto fail;
+      }
+
+    ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+    ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+      {
+        ring->sqes = NULL;
+        goto fail;
+      }
+
+    rings = ring->rings;
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned int *) (rings + p.sq_off.head);
+    ring->sq_tail = (unsigned int *) (rings + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *) (rings + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *) (rings + p.sq_off.array);
+    ring->cq_head = (unsigned int *) (rings + p.cq_off.head);
+    ring->cq_tail = (unsigned int *) (rings + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *) (rings + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (rings + p.cq_off.cqes);
+    ring->sq_local = *ring->sq_tail;
+
+    /* Completions are reaped from the loop whenever the eventfd is
+       signalled */
+    ring->efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->efd < 0 ||
+        sys_io_uring_register (ring->fd, IORING_REGISTER_EVENTFD, &ring->efd,
+                               1) < 0)
+        goto fail;
+
+    /* Buffers for multishot receives, provided through a ring (5.19) */
+    ring->br_size = URING_RECV_BUFS * sizeof (struct io_uring_buf);
+    ring->br = map_anonymous (ring->br_size);
+    ring->recv_bufs = malloc (URING_RECV_BUFS * URING_RECV_SIZE);
+    if (ring->br == NULL || ring->recv_bufs == NULL)
+        goto fail;
+
+    memset (&reg, 0, sizeof (reg));
+    reg.ring_addr = (uintptr_t) ring->br;
+    reg.ring_entries = URING_RECV_BUFS;
+    reg.bgid = URING_RECV_GROUP;
+    if (sys_io_uring_register (ring->fd, IORING_REGISTER_PBUF_RING, &reg,
+                               1) < 0)
+        goto fail;
+    for (uint16_t bid = 0; bid < URING_RECV_BUFS; bid++)
+        uring_recycle (ring, bid);
+
+    /* Send buffers are registered once, so their pages are not pinned again
+       for every write */
+    ring->send_bufs = map_anonymous (URING_SEND_SLOTS * URING_SEND_SIZE);
+    if (ring->send_bufs == NULL)
+        goto fail;
+    for (int i = 0; i < URING_SEND_SLOTS; i++)
+      {
+        iov[i].iov_base = send_buf (ring, i);
+        iov[i].iov_len = URING_SEND_SIZE;
+        ring->free_slots[i] = URING_SEND_SLOTS - 1 - i;
+      }
+    ring->nfree = URING_SEND_SLOTS;
+    if (sys_io_uring_register (ring->fd, IORING_REGISTER_BUFFERS, iov,
+                               URING_SEND_SLOTS) < 0)
+        goto fail;
+
+    ring->cqev = event_new (base, ring->efd, EV_READ | EV_PERSIST,
+                            uring_cq_cb, ring);
+    ring->flushev = event_new (base, -1, 0, uring_flush_cb, ring);
+    if (ring->cqev == NULL || ring->flushev == NULL ||
+        event_add (ring->cqev, NULL) < 0)
+      {
+        errno = ENOMEM;
+        goto fail;
+      }
+
+    return ring;
+
+ fail:
+    save_errno = errno;
+    uring_release (ring);
+    errno = save_errno;
+    return NULL;
+}
+
+void
+fg_uring_free (struct fg_uring *ring)
+{
+    if (ring == NULL)
+        return;
+
+    /* The connections were closed and their operations cancelled, the
+       kernel may still write into the receive buffers until those have
+       completed */
+    while (ring->inflight > 0)
+      {
+        if (uring_enter (ring, 1) < 0 && errno != EINTR)
+            break;
+        uring_reap (ring);
+      }
+
+    while (ring->conns != NULL)
+      {
+        struct fg_uring_conn *conn = ring->conns;
+
+        ring->conns = conn->next;
+        free (conn);
+      }
+
+    uring_release (ring);
+}
+
+static struct fg_uring_conn *
+conn_new (struct fg_uring *ring, struct bufferevent *bev, evutil_socket_t fd)
+{
+    struct fg_uring_conn *conn;
+
+    conn = calloc (1, sizeof (struct fg_uring_conn));
+    if (conn == NULL)
+        return NULL;
+
+    conn->ring = ring;
+    conn->bev = bev;
+    conn->fd = fd;
+    conn->slot = -1;
+    conn->outcb = evbuffer_add_cb (bufferevent_get_output (bev),
+                                   conn_output_cb, conn);
+    if (conn->outcb == NULL)
+      {
+        free (conn);
+        errno = ENOMEM;
+        return NULL;
+      }
+
+    conn->next = ring->conns;
+    if (ring->conns != NULL)
+        ring->conns->prev = conn;
+    ring->conns = conn;
+
+    return conn;
+}
+
+struct fg_uring_conn *
+fg_uring_conn_new (struct fg_uring *ring, struct bufferevent *bev,
+                   evutil_socket_t fd)
+{
+    int flags;
+    struct fg_uring_conn *conn;
+
+    conn = conn_new (ring, bev, fd);
+    if (conn == NULL)
+        return NULL;
+
+    flags = fcntl (fd, F_GETFL);
+    if (flags >= 0)
+        fcntl (fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    /* Start receiving and write what was queued so far on the next turn */
+    conn->connected = true;
+    conn_mark (conn);
+
+    return conn;
+}
+
+struct fg_uring_conn *
+fg_uring_connect (struct fg_uring *ring, struct bufferevent *bev,
+                  const struct sockaddr *sa, socklen_t len)
+{
+    int fd, err = 0, save_errno;
+    struct fg_uring_conn *conn;
+    struct io_uring_sqe *sqe;
+
+    fd = socket (sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                 0);
+    if (fd < 0)
+        return NULL;
+
+    /* Like libevent, a refused connection is reported from the loop and
+       any other failure right away */
+    if (connect (fd, sa, len) < 0)
+      {
+        if (errno == ECONNREFUSED)
+            err = errno;
+        else if (errno != EINPROGRESS && errno != EINTR)
+            goto fail;
+      }
+
+    conn = conn_new (ring, bev, fd);
+    if (conn == NULL)
+        goto fail;
+
+    sqe = uring_get_sqe (ring);
+    if (sqe == NULL)
+      {
+        conn->closed = true;
+        conn_maybe_free (conn);
+        errno = EBUSY;
+        goto fail;
+      }
+
+    /* The socket is writable once the connection is made or has failed */
+    if (err != 0)
+      {
+        sqe->opcode = IORING_OP_NOP;
+        sqe->fd = -1;
+      }
+    else
+      {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = POLLOUT;
+      }
+    sqe->user_data = (uintptr_t) conn | URING_OP_CONNECT;
+    conn->connect_err = err;
+    conn->connecting = true;
+    ring->inflight++;
+    uring_enter (ring, 0);
+
+    return conn;
+
+ fail:
+    save_errno = errno;
+    close (fd);
+    errno = save_errno;
+    return NULL;
+}
+
+evutil_socket_t
+fg_uring_conn_fd (struct fg_uring_conn *conn)
+{
+    return conn->fd;
+}
+
+void
+fg_uring_conn_resume (struct fg_uring_conn *conn)
+{
+    /* Input left behind when reading was disabled is handed to the read
+       callback from the loop, not from the middle of whoever resumed */
+    conn->kick = true;
+    conn_mark (conn);
+}
+
+void
+fg_uring_conn_close (struct fg_uring_conn *conn)
+{
+    struct fg_uring *ring = conn->ring;
+    struct evbuffer *output = bufferevent_get_output (conn->bev);
+
+    /* Once the callback is removed no other thread marks the connection */
+    evbuffer_lock (output);
+    evbuffer_remove_cb_entry (output, conn->outcb);
+    evbuffer_unlock (output);
+    conn->outcb = NULL;
+    conn->bev = NULL;
+    conn->closed = true;
+
+    if (conn->recv_armed || conn->slot >= 0 || conn->connecting)
+      {
+        struct io_uring_sqe *sqe = uring_get_sqe (ring);
+
+        if (sqe != NULL)
+          {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = conn->fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD |
+                                IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = URING_OP_NONE;
+          }
+        uring_enter (ring, 0);
+      }
+
+    close (conn->fd);
+    conn->fd = -1;
+    conn_maybe_free (conn);
+}
+
+#else /* !FG_HAVE_URING */
+
+struct fg_uring *
+fg_uring_new (struct event_base * UNUSED(base),
+              uint64_t * UNUSED(enters))
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void
+fg_uring_free (struct fg_uring * UNUSED(ring))
+{
+}
+
+struct fg_uring_conn *
+fg_uring_conn_new (struct fg_uring * UNUSED(ring),
+                   struct bufferevent * UNUSED(bev),
+                   evutil_socket_t UNUSED(fd))
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+struct fg_uring_conn *
+fg_uring_connect (struct fg_uring * UNUSED(ring),
+                  struct bufferevent * UNUSED(bev),
+                  const struct sockaddr * UNUSED(sa),
+                  socklen_t UNUSED(len))
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+evutil_socket_t
+fg_uring_conn_fd (struct fg_uring_conn * UNUSED(conn))
+{
+    return -1;
+}
+
+void
+fg_uring_conn_resume (struct fg_uring_conn * UNUSED(conn))
+{
+}
+
+void
+fg_uring_conn_close (struct fg_uring_conn * UNUSED(conn))
+{
+}
+
+#endif /* FG_HAVE_URING */
@@ -0,0 +1,87 @@
+/*
+ *  uring.h
+ *    The names of functions callable from within the io_uring transport
+ *****************************************************************************
+ *  This file is part of Fågelmataren, an embedded project created to learn
+ *  Linux and C. See <https://github.com/Linkaan/Fagelmatare>
+ *  Copyright (C) 2015-2017 Linus Styrén
+ *
+ *  Fågelmataren is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  Fågelmataren is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with Fågelmataren.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+
+/* The io_uring transport is built in whenever linux/io_uring.h is found,
+   make URING=0 leaves it out. It talks to the kernel through the raw
+   system calls, liburing is not needed */
+#if !defined(FG_HAVE_URING) && !defined(FG_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FG_HAVE_URING
+#endif
+#endif
+
+/* A connection on the ring keeps a socket bufferevent without a socket, so
+   the rest of the library reads and writes its buffers as before. Frames
+   are received with a multishot recv into buffers provided to the kernel
+   and copied to the input buffer, the read callback runs as if libevent
+   had read them. Output is copied to registered buffers and written once
+   per turn of the loop, one io_uring_enter for all connections. Callbacks
+   and events are delivered with bufferevent_trigger and
+   bufferevent_trigger_event, and the buffers are unfrozen around the
+   transfers like libevent does. Everything but queueing output runs on the
+   thread dispatching the base */
+struct fg_uring;
+struct fg_uring_conn;
+
+/* Set up a ring on the base. Returns NULL with errno set when io_uring is
+   not usable, ENOSYS when it is not built in. enters counts the calls of
+   io_uring_enter */
+extern struct fg_uring *fg_uring_new (struct event_base *, uint64_t *enters);
+
+/* Wait for the operations in flight and release the ring. Every
+   connection must have been closed */
+extern void fg_uring_free (struct fg_uring *);
+
+/* Take over the connected socket of a bufferevent created without one */
+extern struct fg_uring_conn *fg_uring_conn_new (struct fg_uring *,
+                                                struct bufferevent *,
+                                                evutil_socket_t);
+
+/* Connect a bufferevent created without a socket, BEV_EVENT_CONNECTED or
+   BEV_EVENT_ERROR is delivered once the connection is made. Returns NULL
+   with errno set when the connection fails right away */
+extern struct fg_uring_conn *fg_uring_connect (struct fg_uring *,
+                                               struct bufferevent *,
+                                               const struct sockaddr *,
+                                               socklen_t);
+
+extern evutil_socket_t fg_uring_conn_fd (struct fg_uring_conn *);
+
+/* Pick reading up again after bufferevent_enable (bev, EV_READ), the ring
+   stops receiving once it finds reading disabled */
+extern void fg_uring_conn_resume (struct fg_uring_conn *);
+
+/* Stop all I/O and close the socket, to be called before the bufferevent
+   is freed. Output not written yet is lost, like with bufferevent_free */
+extern void fg_uring_conn_close (struct fg_uring_conn *);
+
+#endif /* _URING_H_ */